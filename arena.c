@@ -0,0 +1,194 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+// Size of a thread's first chunk. A request that needs more gets another
+// chunk; on reset they are merged into one, so the arena settles at the
+// most any request has needed and stops growing.
+#define ARENA_CHUNK_SIZE (256 * 1024)
+
+// Each allocation is preceded by its size, so the newest one can be given
+// back: scratch buffers are freed in the reverse order they were made,
+// and a loop that makes one per iteration doesn't grow the arena.
+typedef struct arena_header {
+    size_t size;                // bytes after the header, rounded up
+    size_t pad;                 // keeps the data 16-byte aligned
+} arena_header_t;
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;   // older chunk
+    size_t size;                // bytes of data
+    size_t used;
+    size_t pad;
+    char data[];
+} arena_chunk_t;
+
+static __thread arena_chunk_t *chunks = 0; // newest first
+static __thread int started = 0;
+
+#ifdef NUFS_COUNT_ALLOCS
+static void count_request();
+static void count_report();
+#endif
+
+static arena_chunk_t *new_chunk(size_t size, arena_chunk_t *next) {
+    arena_chunk_t *chunk = malloc(sizeof(arena_chunk_t) + size);
+    chunk->next = next;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+// The chunk of this thread's arena that holds ptr, if any
+static arena_chunk_t *owner(const void *ptr) {
+    uintptr_t addr = (uintptr_t) ptr;
+    for (arena_chunk_t *chunk = chunks; chunk != 0; chunk = chunk->next) {
+        if (addr > (uintptr_t) chunk->data &&
+            addr < (uintptr_t) chunk->data + chunk->size) {
+            return chunk;
+        }
+    }
+    return 0;
+}
+
+// Get size bytes that stay valid until the end of the request, or until
+// they are freed if the thread isn't serving requests.
+void *arena_alloc(size_t size) {
+    if (!started) {
+        return malloc(size);
+    }
+
+    size_t need = sizeof(arena_header_t) + ((size + 15) & ~(size_t) 15);
+    if (chunks == 0 || chunks->size - chunks->used < need) {
+        size_t grow = chunks == 0 ? ARENA_CHUNK_SIZE : 2 * chunks->size;
+        chunks = new_chunk(need > grow ? need : grow, chunks);
+    }
+    arena_header_t *hdr = (arena_header_t *) (chunks->data + chunks->used);
+    hdr->size = need - sizeof(*hdr);
+    chunks->used += need;
+    return hdr + 1;
+}
+
+char *arena_strdup(const char *text) {
+    size_t len = strlen(text) + 1;
+    char *copy = arena_alloc(len);
+    memcpy(copy, text, len);
+    return copy;
+}
+
+// Give back memory from arena_alloc. Arena memory is only really reused
+// if it is the newest allocation; the rest waits for arena_reset.
+void arena_free(void *ptr) {
+    if (ptr == 0) {
+        return;
+    }
+    arena_chunk_t *chunk = owner(ptr);
+    if (chunk == 0) {
+        free(ptr);
+        return;
+    }
+
+    arena_header_t *hdr = (arena_header_t *) ptr - 1;
+    if (chunk == chunks && (char *) ptr + hdr->size == chunk->data + chunk->used) {
+        chunk->used = (char *) hdr - chunk->data;
+    }
+}
+
+// Serve this thread's allocations from its arena from now on
+void arena_start() {
+    started = 1;
+}
+
+// Free everything allocated since the last reset; called after each request
+void arena_reset() {
+    if (chunks != 0 && chunks->next != 0) {
+        size_t total = 0;
+        while (chunks != 0) {
+            arena_chunk_t *next = chunks->next;
+            total += chunks->size;
+            free(chunks);
+            chunks = next;
+        }
+        chunks = new_chunk(total, 0);
+    }
+    if (chunks != 0) {
+        chunks->used = 0;
+    }
+#ifdef NUFS_COUNT_ALLOCS
+    count_request();
+#endif
+}
+
+// Go back to malloc and free the arena
+void arena_stop() {
+    while (chunks != 0) {
+        arena_chunk_t *next = chunks->next;
+        free(chunks);
+        chunks = next;
+    }
+    started = 0;
+#ifdef NUFS_COUNT_ALLOCS
+    count_report();
+#endif
+}
+
+#ifdef NUFS_COUNT_ALLOCS
+// Benchmark build (make nufs-counted): count the calls nufs's own code
+// makes to the malloc family, leaving out libfuse's and libc's, and how
+// many requests made any. The first requests set up lazily allocated
+// tables; after that the count should stay put.
+
+extern char __executable_start;
+extern char etext;
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+
+static long calls = 0;
+static long calls_at_reset = 0;
+static long requests = 0;
+static long requests_allocating = 0;
+
+static void count_call(void *caller) {
+    if ((char *) caller >= &__executable_start && (char *) caller < &etext) {
+        calls += 1;
+    }
+}
+
+void *malloc(size_t size) {
+    count_call(__builtin_return_address(0));
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    count_call(__builtin_return_address(0));
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    count_call(__builtin_return_address(0));
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    if (ptr != 0) {
+        count_call(__builtin_return_address(0));
+    }
+    __libc_free(ptr);
+}
+
+static void count_request() {
+    requests += 1;
+    requests_allocating += calls != calls_at_reset;
+    calls_at_reset = calls;
+}
+
+static void count_report() {
+    printf("arena: %ld of %ld requests called malloc or free (%ld calls)\n",
+           requests_allocating, requests, calls);
+}
+#endif
@@ -0,0 +1,23 @@
+// Per-request scratch memory.
+//
+// While a thread serves FUSE requests, the short-lived allocations made for
+// each one (list nodes, names, bounce buffers) come from a bump arena that
+// is reset once the request is answered, so a steady stream of requests
+// never reaches malloc. Threads that never call arena_start (the offline
+// tools, fsck's workers, unmount) get plain malloc'd memory instead, and
+// arena_free frees it; callers don't need to know which they got.
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+void *arena_alloc(size_t size);
+char *arena_strdup(const char *text);
+void arena_free(void *ptr);
+
+void arena_start();
+void arena_reset();
+void arena_stop();
+
+#endif
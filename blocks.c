@@ -20,20 +20,32 @@
 #include "bitmap.h"
 #include "blocks.h"
 
-const int BLOCK_COUNT = 256; // we split the "disk" into 256 blocks
-const int BLOCK_SIZE = 4096; // = 4K
-const int NUFS_SIZE = BLOCK_SIZE * BLOCK_COUNT; // = 1MB
+// The geometry is read from the superblock when an image is opened.
+int BLOCK_COUNT = NUFS_DEFAULT_BLOCK_COUNT; // we split the "disk" into blocks
+int BLOCK_SIZE = NUFS_DEFAULT_BLOCK_SIZE;
+size_t NUFS_SIZE = (size_t) NUFS_DEFAULT_BLOCK_SIZE * NUFS_DEFAULT_BLOCK_COUNT;
 
-const int BLOCK_BITMAP_SIZE = BLOCK_COUNT / 8;
+int BLOCK_BITMAP_SIZE = NUFS_DEFAULT_BLOCK_COUNT / 8;
 // Note: assumes block count is divisible by 8
+int BLOCK_SHIFT = 12;
 
-static int blocks_fd = -1;
+// The image is one file, or several with the block space striped over
+// them in units of stripe_blocks blocks.
+static int member_fds[NUFS_MAX_MEMBERS];
+static int member_count = 0;
+static int stripe_blocks = 0; // 0 when there is only one file
 static void *blocks_base = 0;
+static int blocks_private = 0; // changes stay in memory (snapshot mounts)
+
+// Where the next allocation without a goal starts looking. Only kept in
+// memory; it is saved to the superblock on a clean unmount.
+static int alloc_hint = 0;
+static void (*free_hook)(int bnum) = 0; // told about each block freed
 
 // Get the number of blocks needed to store the given number of bytes.
 int bytes_to_blocks(int bytes) {
-  int quo = bytes / BLOCK_SIZE;
-  int rem = bytes % BLOCK_SIZE;
+  int quo = BLOCK_INDEX(bytes);
+  int rem = BLOCK_OFFSET(bytes);
   if (rem == 0) {
     return quo;
   } else {
@@ -41,64 +53,512 @@ int bytes_to_blocks(int bytes) {
   }
 }
 
-// Load and initialize the given disk image.
-void blocks_init(const char *image_path) {
-  blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
-  assert(blocks_fd != -1);
+// Split a colon-separated list of member paths into a copy of it. Returns
+// the number of members, or -1 if there are too many.
+static int split_members(const char *image_path, char *copy, char *paths[]) {
+  strcpy(copy, image_path);
+  int count = 0;
+  for (char *path = strtok(copy, ":"); path != 0; path = strtok(0, ":")) {
+    if (count == NUFS_MAX_MEMBERS) {
+      return -1;
+    }
+    paths[count++] = path;
+  }
+  return count;
+}
 
-  // make sure the disk image is exactly 1MB
-  int rv = ftruncate(blocks_fd, NUFS_SIZE);
-  assert(rv == 0);
+static void close_members() {
+  for (int ii = 0; ii < member_count; ++ii) {
+    close(member_fds[ii]);
+  }
+  member_count = 0;
+  stripe_blocks = 0;
+}
 
-  // map the image to memory
-  blocks_base =
-      mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
-  assert(blocks_base != MAP_FAILED);
+// Set the geometry globals and map the open image into memory. A striped
+// image gets a reserved range with each stripe unit mapped over it from
+// its member.
+static int blocks_map(int block_size, int block_count) {
+  BLOCK_SIZE = block_size;
+  BLOCK_COUNT = block_count;
+  NUFS_SIZE = (size_t) block_size * block_count;
+  BLOCK_BITMAP_SIZE = block_count / 8;
+  BLOCK_SHIFT = __builtin_ctz(block_size);
 
-  // block 0 stores the block bitmap and the inode bitmap
+  int flags = blocks_private ? MAP_PRIVATE : MAP_SHARED;
+  if (stripe_blocks == 0) {
+    blocks_base = mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, flags, member_fds[0], 0);
+  } else {
+    blocks_base = mmap(0, NUFS_SIZE, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    size_t unit = (size_t) stripe_blocks << BLOCK_SHIFT;
+    for (size_t pos = 0; blocks_base != MAP_FAILED && pos < NUFS_SIZE; pos += unit) {
+      off_t file_pos;
+      int fd = blocks_file_at(pos, &file_pos);
+      void *got = mmap((char *) blocks_base + pos, unit, PROT_READ | PROT_WRITE,
+                       flags | MAP_FIXED, fd, file_pos);
+      if (got == MAP_FAILED) {
+        munmap(blocks_base, NUFS_SIZE);
+        blocks_base = MAP_FAILED;
+      }
+    }
+  }
+  if (blocks_base == MAP_FAILED) {
+    blocks_base = 0;
+    return -1;
+  }
+  return 0;
+}
+
+// Check that the given geometry is one that can be formatted.
+int blocks_geometry_ok(int block_size, int block_count) {
+  if (block_size < NUFS_MIN_BLOCK_SIZE || block_size > NUFS_MAX_BLOCK_SIZE ||
+      (block_size & (block_size - 1)) != 0) {
+    return 0;
+  }
+  return block_count >= 16 && block_count % 8 == 0;
+}
+
+// Open an existing image, shared or private.
+static int blocks_open_mode(const char *image_path, int private) {
+  char copy[strlen(image_path) + 1];
+  char *paths[NUFS_MAX_MEMBERS];
+  int count = split_members(image_path, copy, paths);
+  if (count < 1) {
+    fprintf(stderr, "nufs: %s: expected 1 to %d image files\n", image_path,
+            NUFS_MAX_MEMBERS);
+    return -1;
+  }
+
+  blocks_private = private;
+  member_fds[0] = open(paths[0], private ? O_RDONLY : O_RDWR);
+  if (member_fds[0] == -1) {
+    return errno == ENOENT ? 1 : -1;
+  }
+  member_count = 1;
+
+  superblock_t sb;
+  ssize_t got = pread(member_fds[0], &sb, sizeof(sb), 0);
+  if (got == 0) {
+    close_members();
+    return 1; // empty image
+  }
+  // anything else is left alone: it may be a damaged image or not ours
+  if (got != sizeof(sb) || sb.magic != NUFS_MAGIC) {
+    fprintf(stderr, "nufs: %s: not a nufs image\n", paths[0]);
+    close_members();
+    return -1;
+  }
+
+  // every member holds an equal share of the blocks
+  int members = sb.stripe_members > 1 ? sb.stripe_members : 1;
+  int ok = sb.version == NUFS_VERSION && blocks_geometry_ok(sb.block_size, sb.block_count) &&
+           members == count && (members == 1 || sb.stripe_blocks > 0);
+  for (int ii = 1; ok && ii < count; ++ii) {
+    member_fds[ii] = open(paths[ii], private ? O_RDONLY : O_RDWR);
+    ok = member_fds[ii] != -1;
+    member_count += ok;
+  }
+  for (int ii = 0; ok && ii < count; ++ii) {
+    struct stat st;
+    int rv = fstat(member_fds[ii], &st);
+    assert(rv == 0);
+    ok = st.st_size >= (off_t) sb.block_size * (sb.block_count / members);
+  }
+  if (!ok) {
+    fprintf(stderr, "nufs: %s: unsupported image (version %u, %u x %u, %d of %u files)\n",
+            image_path, sb.version, sb.block_count, sb.block_size, count, members);
+    close_members();
+    return -1;
+  }
+
+  stripe_blocks = members > 1 ? sb.stripe_blocks : 0;
+  if (blocks_map(sb.block_size, sb.block_count) == -1) {
+    close_members();
+    return -1;
+  }
+  alloc_hint = sb.alloc_hint;
+  return 0;
+}
+
+// Open an existing image without mounting it.
+int blocks_open(const char *image_path) {
+  return blocks_open_mode(image_path, 0);
+}
+
+// Open an existing image with a private, copy-on-write mapping.
+int blocks_open_private(const char *image_path) {
+  return blocks_open_mode(image_path, 1);
+}
+
+// Create (or overwrite) an image file with the given geometry.
+int blocks_create(const char *image_path, int block_size, int block_count) {
+  return blocks_create_striped(image_path, block_size, block_count, 0);
+}
+
+// Create (or overwrite) an image striped over the given files.
+int blocks_create_striped(const char *image_path, int block_size, int block_count,
+                          int unit) {
+  char copy[strlen(image_path) + 1];
+  char *paths[NUFS_MAX_MEMBERS];
+  int count = split_members(image_path, copy, paths);
+  if (count < 1 || unit < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (count > 1) {
+    // each unit is its own mapping, so keep their number down
+    if (unit == 0) {
+      unit = NUFS_DEFAULT_STRIPE_BYTES / block_size;
+      unit = unit > 0 ? unit : 1;
+      while (block_count / unit > NUFS_MAX_STRIPES) {
+        unit *= 2;
+      }
+    }
+    if (block_count / unit > NUFS_MAX_STRIPES) {
+      errno = EINVAL; // stripe unit too small for the image
+      return -1;
+    }
+
+    // whole stripes only, and still a whole number of bitmap bytes
+    int stripe = count * unit;
+    while (stripe % 8 != 0) {
+      stripe *= 2;
+    }
+    block_count -= block_count % stripe;
+  }
+  if (!blocks_geometry_ok(block_size, block_count)) {
+    errno = EINVAL;
+    return -1;
+  }
+  blocks_private = 0;
+
+  // size the members up front; the blocks stay sparse until written
+  for (int ii = 0; ii < count; ++ii) {
+    member_fds[ii] = open(paths[ii], O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (member_fds[ii] == -1 ||
+        ftruncate(member_fds[ii], (off_t) block_size * (block_count / count)) != 0) {
+      member_count = ii + (member_fds[ii] != -1);
+      close_members();
+      return -1;
+    }
+  }
+  member_count = count;
+  stripe_blocks = count > 1 ? unit : 0;
+
+  if (blocks_map(block_size, block_count) == -1) {
+    close_members();
+    return -1;
+  }
+  return 0;
+}
+
+// Load the given disk image and check whether it holds a file system.
+int blocks_init(const char *image_path) {
+  int rv = blocks_open(image_path);
+  if (rv == 1) {
+    // missing or empty image: create it with the default geometry
+    rv = blocks_create(image_path, NUFS_DEFAULT_BLOCK_SIZE,
+                       NUFS_DEFAULT_BLOCK_COUNT);
+    assert(rv == 0);
+    return 1;
+  }
+  if (rv == -1) {
+    return -1;
+  }
+
+  // the free counters can only be trusted after a clean unmount
+  superblock_t *sb = blocks_super();
+  if (!sb->clean) {
+    blocks_recount();
+  }
+
+  sb->clean = 0;
+  sb->mount_count += 1;
+  return 0;
+}
+
+// Lay out a new file system on the loaded image.
+int blocks_format(int inode_count, int inode_size) {
+  superblock_t *sb = blocks_super();
+  size_t ibm_bytes = ((size_t) inode_count + 7) / 8;
+  size_t ref_bytes = (size_t) BLOCK_COUNT * sizeof(uint16_t);
+  size_t csum_bytes = (size_t) BLOCK_COUNT * sizeof(uint32_t);
+  size_t table_bytes = (size_t) inode_count * inode_size;
+  size_t data_block = 1 + (BLOCK_BITMAP_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE +
+                      (ibm_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE +
+                      (ref_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE +
+                      (csum_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE +
+                      (table_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  // the root directory needs at least one data block
+  if (inode_count < 1 || data_block >= (size_t) BLOCK_COUNT) {
+    return -1;
+  }
+
+  memset(sb, 0, BLOCK_SIZE);
+  sb->magic = NUFS_MAGIC;
+  sb->version = NUFS_VERSION;
+  sb->block_size = BLOCK_SIZE;
+  sb->block_count = BLOCK_COUNT;
+  sb->inode_count = inode_count;
+  sb->inode_size = inode_size;
+  sb->bbm_block = 1;
+  sb->ibm_block = sb->bbm_block + bytes_to_blocks(BLOCK_BITMAP_SIZE);
+  sb->ref_block = sb->ibm_block + (ibm_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  sb->csum_block = sb->ref_block + (ref_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  sb->inode_block = sb->csum_block + (csum_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  sb->data_block = data_block;
+  sb->stripe_members = member_count;
+  sb->stripe_blocks = stripe_blocks;
+
+  // clear the bitmaps, reference counts, checksums and inode table without
+  // touching their pages
+  blocks_zero(sb->bbm_block, sb->data_block - sb->bbm_block);
+
+  // the superblock, bitmaps and inode table are never handed out
   void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, 0, 1);
+  for (int ii = 0; ii < sb->data_block; ++ii) {
+    bitmap_put(bbm, ii, 1);
+  }
+
+  sb->free_blocks = BLOCK_COUNT - sb->data_block;
+  sb->free_inodes = inode_count;
+  sb->alloc_hint = sb->data_block;
+  sb->mount_count = 1;
+  alloc_hint = sb->data_block;
+  return 0;
 }
 
-// Close the disk image.
-void blockslist_free() {
-  int rv = munmap(blocks_base, NUFS_SIZE);
+// Recount the free blocks and inodes from the bitmaps.
+void blocks_recount() {
+  superblock_t *sb = blocks_super();
+  void *bbm = get_blocks_bitmap();
+  void *ibm = get_inode_bitmap();
+
+  sb->free_blocks = 0;
+  for (int ii = sb->data_block; ii < BLOCK_COUNT; ++ii) {
+    if (!bitmap_get(bbm, ii)) {
+      sb->free_blocks += 1;
+    }
+  }
+
+  sb->free_inodes = 0;
+  for (int ii = 0; ii < sb->inode_count; ++ii) {
+    if (!bitmap_get(ibm, ii)) {
+      sb->free_inodes += 1;
+    }
+  }
+}
+
+// Write back and unmap the disk image.
+void blocks_close() {
+  int rv = msync(blocks_base, NUFS_SIZE, MS_SYNC);
+  assert(rv == 0);
+  rv = munmap(blocks_base, NUFS_SIZE);
   assert(rv == 0);
+  close_members();
+
+  blocks_base = 0;
+}
+
+// Close the disk image, marking it cleanly unmounted.
+void blockslist_free() {
+  superblock_t *sb = blocks_super();
+  sb->alloc_hint = alloc_hint;
+  sb->clean = 1;
+  blocks_close();
 }
 
 // Get the given block, returning a pointer to its start.
-void *blocks_get_block(int bnum) { return blocks_base + BLOCK_SIZE * bnum; }
+void *blocks_get_block(int bnum) {
+  return blocks_base + ((size_t) bnum << BLOCK_SHIFT);
+}
+
+// Return the descriptor of the shared image, or -1 for a private mapping.
+int blocks_image_fd() { return blocks_private ? -1 : member_fds[0]; }
+
+// Find the member file and position holding the given byte of block space.
+int blocks_file_at(off_t pos, off_t *file_pos) {
+  if (stripe_blocks == 0) {
+    *file_pos = pos;
+    return member_fds[0];
+  }
+  off_t unit = (off_t) stripe_blocks << BLOCK_SHIFT;
+  off_t index = pos / unit;
+  *file_pos = index / member_count * unit + pos % unit;
+  return member_fds[index % member_count];
+}
+
+// Return the block that starts the stripe unit after the one holding bnum.
+int blocks_stripe_end(int bnum) {
+  if (stripe_blocks == 0) {
+    return BLOCK_COUNT;
+  }
+  return (bnum / stripe_blocks + 1) * stripe_blocks;
+}
+
+// Return a pointer to the superblock, which lives in block 0.
+superblock_t *blocks_super() { return (superblock_t *) blocks_base; }
 
 // Return a pointer to the beginning of the block bitmap.
 // The size is BLOCK_BITMAP_SIZE bytes.
-void *get_blocks_bitmap() { return blocks_get_block(0); }
+void *get_blocks_bitmap() { return blocks_get_block(blocks_super()->bbm_block); }
 
 // Return a pointer to the beginning of the inode table bitmap.
-void *get_inode_bitmap() {
-  uint8_t *block = blocks_get_block(0);
-
-  // The inode bitmap is stored immediately after the block bitmap
-  return (void *) (block + BLOCK_BITMAP_SIZE);
-}
+void *get_inode_bitmap() { return blocks_get_block(blocks_super()->ibm_block); }
 
 // Allocate a new block and return its index.
 int alloc_block() {
+  int got;
+  return alloc_block_run(0, 1, &got);
+}
+
+// Find up to count contiguous free blocks, preferring a run that starts at
+// goal. Falls back to the longest free run on the disk.
+int blocks_find_run(int goal, int count, int *got) {
   void *bbm = get_blocks_bitmap();
+  int first_data = blocks_super()->data_block;
+  if (goal == 0) {
+    goal = alloc_hint;
+  }
+  if (goal < first_data || goal >= BLOCK_COUNT) {
+    goal = first_data;
+  }
 
-  for (int ii = 3; ii < BLOCK_COUNT; ++ii) {
-    if (!bitmap_get(bbm, ii)) {
-      bitmap_put(bbm, ii, 1);
-      printf("+ alloc_block() -> %d\n", ii);
-      return ii;
+  int best = -1;
+  int best_len = 0;
+
+  // two passes: from goal to the end, then from the start up to goal
+  for (int pass = 0; pass < 2 && best_len < count; ++pass) {
+    int lo = pass == 0 ? goal : first_data;
+    int hi = pass == 0 ? BLOCK_COUNT : goal;
+
+    for (int ii = lo; ii < hi && best_len < count;) {
+      if (bitmap_get(bbm, ii)) {
+        ++ii;
+        continue;
+      }
+
+      int len = 0;
+      while (ii + len < hi && len < count && !bitmap_get(bbm, ii + len)) {
+        ++len;
+      }
+      if (len > best_len) {
+        best = ii;
+        best_len = len;
+      }
+      ii += len;
     }
   }
 
-  return -1;
+  *got = best_len;
+  return best;
+}
+
+// Mark a run of free blocks allocated, each with one owner and no checksum.
+static void claim_run(int first, int count) {
+  void *bbm = get_blocks_bitmap();
+  uint16_t *extra = blocks_get_block(blocks_super()->ref_block);
+  uint32_t *sums = blocks_get_block(blocks_super()->csum_block);
+  for (int ii = 0; ii < count; ++ii) {
+    bitmap_put(bbm, first + ii, 1);
+    extra[first + ii] = 0; // a new block has a single owner
+    sums[first + ii] = 0;  // and no checksum until it is written
+  }
+  blocks_super()->free_blocks -= count;
+}
+
+// Allocate up to count contiguous blocks, preferring a run that starts at
+// goal. Falls back to the longest free run on the disk.
+int alloc_block_run(int goal, int count, int *got) {
+  int best = blocks_find_run(goal, count, got);
+  if (best == -1) {
+    return -1;
+  }
+
+  claim_run(best, *got);
+  alloc_hint = best + *got;
+  printf("+ alloc_block_run(%d, %d) -> %d (+%d)\n", goal, count, best, *got);
+  return best;
+}
+
+// Allocate the given block if it is free, leaving the hint where it is.
+int alloc_block_at(int bnum) {
+  if (bnum < blocks_super()->data_block || bnum >= BLOCK_COUNT ||
+      bitmap_get(get_blocks_bitmap(), bnum)) {
+    return -1;
+  }
+  claim_run(bnum, 1);
+  return 0;
+}
+
+// Count the blocks that are currently free.
+int blocks_free_count() { return blocks_super()->free_blocks; }
+
+// Zero a run of blocks, punching them out of the image if possible. The
+// run is split where it crosses into another member's stripe unit.
+void blocks_zero(int bnum, int count) {
+  while (count > 0) {
+    int end = blocks_stripe_end(bnum);
+    int len = end - bnum < count ? end - bnum : count;
+    off_t file_pos;
+    int fd = blocks_file_at((off_t) bnum << BLOCK_SHIFT, &file_pos);
+    int rv = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, file_pos,
+                       (off_t) len << BLOCK_SHIFT);
+    if (rv != 0) {
+      memset(blocks_get_block(bnum), 0, (size_t) len << BLOCK_SHIFT);
+    }
+    bnum += len;
+    count -= len;
+  }
 }
 
-// Deallocate the block with the given index.
+// Deallocate the block with the given index, or drop one owner of a
+// shared block.
 void free_block(int bnum) {
   printf("+ free_block(%d)\n", bnum);
+  uint16_t *extra = blocks_get_block(blocks_super()->ref_block);
+  if (extra[bnum] > 0) {
+    extra[bnum] -= 1;
+    return;
+  }
+
   void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, bnum, 0);
+  if (bitmap_get(bbm, bnum)) {
+    bitmap_put(bbm, bnum, 0);
+    blocks_super()->free_blocks += 1;
+    if (free_hook != 0) {
+      free_hook(bnum);
+    }
+  }
+}
+
+// Register the function told about each block that is freed.
+void blocks_on_free(void (*hook)(int bnum)) { free_hook = hook; }
+
+// Count the owners of a block; the table holds the extra ones.
+int blocks_refs(int bnum) {
+  if (!bitmap_get(get_blocks_bitmap(), bnum)) {
+    return 0;
+  }
+  uint16_t *extra = blocks_get_block(blocks_super()->ref_block);
+  return 1 + extra[bnum];
+}
+
+// Add an owner to an allocated block.
+int blocks_ref(int bnum) {
+  uint16_t *extra = blocks_get_block(blocks_super()->ref_block);
+  if (extra[bnum] == UINT16_MAX) {
+    return -1;
+  }
+  extra[bnum] += 1;
+  return 0;
+}
+
+// Set the number of owners of an allocated block.
+void blocks_set_refs(int bnum, int refs) {
+  uint16_t *extra = blocks_get_block(blocks_super()->ref_block);
+  extra[bnum] = refs - 1 > UINT16_MAX ? UINT16_MAX : refs - 1;
 }
@@ -9,13 +9,86 @@
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
-extern const int BLOCK_COUNT; // we split the "disk" into blocks (default = 256)
-extern const int BLOCK_SIZE;  // default = 4K
-extern const int NUFS_SIZE;   // default = 1MB
+#define NUFS_MAGIC 0x5346554e // "NUFS"
+#define NUFS_VERSION 9
 
-extern const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
+/**
+ * The superblock, stored at the start of block 0.
+ *
+ * It identifies a formatted image and records where each metadata region
+ * starts, so an existing file system can be mounted without re-formatting.
+ * The blocks in between hold, in order: the block bitmap, the inode bitmap,
+ * the block reference counts, the block checksums (see checksum.h) and the
+ * inode table. Data blocks start at
+ * data_block. Snapshots (see snapshot.h) and the saved dedup index (see
+ * dedup.h) live in data blocks.
+ */
+typedef struct superblock {
+  uint32_t magic;       // NUFS_MAGIC
+  uint32_t version;     // NUFS_VERSION
+  uint32_t block_size;  // bytes per block
+  uint32_t block_count; // blocks in the image
+  uint32_t inode_count; // inodes in the inode table
+  uint32_t bbm_block;   // first block of the block bitmap
+  uint32_t ibm_block;   // first block of the inode bitmap
+  uint32_t inode_block; // first block of the inode table
+  uint32_t data_block;  // first data block
+  uint32_t clean;       // 1 after a clean unmount, 0 while mounted
+  uint32_t free_blocks; // free data blocks (trusted only if clean)
+  uint32_t free_inodes; // free inodes (trusted only if clean)
+  uint32_t alloc_hint;  // block where the allocator resumes searching
+  uint32_t mount_count; // number of times the image was mounted
+  uint32_t inode_size;  // bytes per inode table record
+  uint32_t ref_block;   // first block of the block reference counts
+  uint32_t snap_block;  // block holding the snapshot table (0 = none)
+  uint32_t dedup_block; // first block of the saved dedup index (0 = none)
+  uint32_t dedup_blocks; // blocks in the saved dedup index
+  uint32_t csum_block;  // first block of the block checksums
+  uint32_t stripe_members; // backing files the blocks are striped over
+  uint32_t stripe_blocks; // blocks per stripe unit (0 = not striped)
+} superblock_t;
+
+#define NUFS_DEFAULT_BLOCK_COUNT 256
+#define NUFS_DEFAULT_BLOCK_SIZE 4096
+#define NUFS_MIN_BLOCK_SIZE 4096
+#define NUFS_MAX_BLOCK_SIZE 65536
+
+// Most backing files an image can be striped over, and most stripe units
+// in all (each unit is a separate mapping)
+#define NUFS_MAX_MEMBERS 16
+#define NUFS_MAX_STRIPES 32768
+#define NUFS_DEFAULT_STRIPE_BYTES 65536
+
+// Geometry of the open image, taken from its superblock
+extern int BLOCK_COUNT;  // we split the "disk" into blocks (default = 256)
+extern int BLOCK_SIZE;   // default = 4K
+extern size_t NUFS_SIZE; // default = 1MB
+
+extern int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
+extern int BLOCK_SHIFT;       // log2(BLOCK_SIZE), default = 12
+
+/**
+ * File block holding the given byte offset, and the offset within it.
+ * Block sizes are powers of two, so these are a shift and a mask.
+ */
+#define BLOCK_INDEX(pos) ((int) ((pos) >> BLOCK_SHIFT))
+#define BLOCK_OFFSET(pos) ((int) ((pos) & (BLOCK_SIZE - 1)))
+
+/**
+ * Block sizes that code looping over a whole block is compiled for.
+ *
+ * A module expands X(size) once per size to get copies in which the block
+ * size is a constant, and picks the copy for the open image when it is
+ * opened, falling back to a generic copy for the other sizes:
+ *
+ *   #define HASH(size) static void hash_##size(...) { hash(..., size); }
+ *   NUFS_BLOCK_SIZES(HASH)
+ */
+#define NUFS_BLOCK_SIZES(X) X(4096) X(16384) X(65536)
 
 /** 
  * Compute the number of blocks needed to store the given number of bytes.
@@ -27,17 +100,129 @@ extern const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
 int bytes_to_blocks(int bytes);
 
 /**
- * Load and initialize the given disk image.
+ * Check whether an image with the given geometry can be created.
+ *
+ * @param block_size Bytes per block; a power of two from 4K to 64K.
+ * @param block_count Number of blocks; a multiple of 8.
+ *
+ * @return 1 if the geometry is supported, 0 otherwise.
+ */
+int blocks_geometry_ok(int block_size, int block_count);
+
+/**
+ * Open an existing disk image without mounting it.
+ *
+ * The geometry globals are set from the image's superblock. The clean
+ * flag and mount count are left alone, which makes this suitable for
+ * offline tools.
+ *
+ * An image striped over several files is named by listing them in order,
+ * separated by colons ("a.img:b.img"). Block space is laid out RAID-0
+ * style: stripe unit k lives in member k % n, and each unit is mapped
+ * from its member separately.
+ *
+ * @param image_path Path to the disk image file, or colon-separated list
+ *                   of the files it is striped over.
+ *
+ * @return 0 on success, 1 if the image is missing or empty, or -1 if it
+ *         cannot be opened, is not a nufs image or is unsupported.
+ */
+int blocks_open(const char *image_path);
+
+/**
+ * Open an existing disk image with a private mapping.
+ *
+ * Like blocks_open(), but changes made through the mapping stay in memory
+ * and never reach the image, and the image is opened read-only. Used to
+ * mount a snapshot next to the live file system.
  *
  * @param image_path Path to the disk image file.
+ *
+ * @return 0 on success, 1 if the image is missing or empty, or -1 if it
+ *         cannot be opened, is not a nufs image or is unsupported.
  */
-void blocks_init(const char *image_path);
+int blocks_open_private(const char *image_path);
 
 /**
- * Close the disk image.
+ * Create (or overwrite) a disk image with the given geometry.
+ *
+ * The image still needs blocks_format() before it can be used.
+ *
+ * @param image_path Path to the disk image file, or colon-separated list
+ *                   of files to stripe it over (see blocks_open()).
+ * @param block_size Bytes per block.
+ * @param block_count Number of blocks.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int blocks_create(const char *image_path, int block_size, int block_count);
+
+/**
+ * Create (or overwrite) a disk image striped with the given stripe unit.
+ *
+ * Like blocks_create(), but with a chosen stripe unit. The block count is
+ * rounded down to a whole number of stripes across all members.
+ *
+ * @param image_path Colon-separated list of the member files.
+ * @param block_size Bytes per block.
+ * @param block_count Number of blocks.
+ * @param stripe_blocks Blocks per stripe unit, or 0 for the default of
+ *                      NUFS_DEFAULT_STRIPE_BYTES (grown if the image would
+ *                      need more than NUFS_MAX_STRIPES units).
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int blocks_create_striped(const char *image_path, int block_size, int block_count,
+                          int stripe_blocks);
+
+/**
+ * Load the given disk image.
+ *
+ * If the image already holds a file system, it is mounted as is: only the
+ * in-memory state is rebuilt, and the free counters are recounted from the
+ * bitmaps if the image was not cleanly unmounted. A missing or empty image
+ * is created with the default geometry; any other file is left alone.
+ *
+ * @param image_path Path to the disk image file.
+ *
+ * @return 0 if an existing file system was found, 1 if the image is new
+ *         and needs blocks_format(), or -1 if the file is not a nufs image
+ *         or is unsupported.
+ */
+int blocks_init(const char *image_path);
+
+/**
+ * Write a fresh superblock and empty bitmaps and inode table to the image.
+ *
+ * @param inode_count Number of inodes in the inode table.
+ * @param inode_size Size of one inode in bytes.
+ *
+ * @return 0 on success, -1 if the metadata would not fit in the image.
+ */
+int blocks_format(int inode_count, int inode_size);
+
+/**
+ * Recount the free blocks and inodes in the superblock from the bitmaps.
+ */
+void blocks_recount();
+
+/**
+ * Write back and unmap the disk image, leaving the superblock as is.
+ */
+void blocks_close();
+
+/**
+ * Close the disk image, marking the file system as cleanly unmounted.
  */
 void blockslist_free();
 
+/**
+ * Return a pointer to the superblock.
+ *
+ * @return A pointer to the superblock at the start of block 0.
+ */
+superblock_t *blocks_super();
+
 /**
  * Get the block with the given index, returning a pointer to its start.
  *
@@ -47,6 +232,41 @@ void blockslist_free();
  */
 void *blocks_get_block(int bnum);
 
+/**
+ * Return the file descriptor of the open image, for moving block data with
+ * splice() instead of through the mapping. Block n starts at offset
+ * n * BLOCK_SIZE; for a striped image this is the first member, and
+ * blocks_file_at() finds the rest.
+ *
+ * @return The descriptor, or -1 if the image is mapped privately, since the
+ *         file then misses the changes made in memory.
+ */
+int blocks_image_fd();
+
+/**
+ * Find where a byte of block space is stored in the backing files.
+ *
+ * @param pos Byte position in block space (block n starts at
+ *            n * BLOCK_SIZE).
+ * @param file_pos Set to the position within the returned file.
+ *
+ * @return The descriptor of the member file holding pos.
+ */
+int blocks_file_at(off_t pos, off_t *file_pos);
+
+/**
+ * Return the first block past the stripe unit holding the given block.
+ *
+ * Runs of blocks read or written through blocks_file_at() must stop
+ * there, since the next unit lives in another file.
+ *
+ * @param bnum Block number.
+ *
+ * @return The block that starts the next unit, or BLOCK_COUNT if the image
+ *         is not striped.
+ */
+int blocks_stripe_end(int bnum);
+
 /**
  * Return a pointer to the beginning of the block bitmap.
  *
@@ -64,17 +284,123 @@ void *get_inode_bitmap();
 /**
  * Allocate a new block and return its number.
  *
- * Grabs the first unused block and marks it as allocated.
+ * Grabs the first unused block and marks it as allocated. A new block has
+ * one owner and no checksum.
  *
  * @return The index of the newly allocated block.
  */
 int alloc_block();
 
+/**
+ * Allocate a run of contiguous blocks.
+ *
+ * Looks for `count` free blocks in a row, starting the search at `goal` so
+ * that a file's blocks can continue where its previous block ended. If no
+ * run is long enough, the longest run found is allocated instead.
+ *
+ * @param goal Preferred first block number (0 for no preference).
+ * @param count Number of blocks wanted.
+ * @param got Set to the number of blocks actually allocated.
+ *
+ * @return The index of the first allocated block, or -1 if the disk is full.
+ */
+int alloc_block_run(int goal, int count, int *got);
+
+/**
+ * Find a run of contiguous free blocks without allocating it.
+ *
+ * Searches like alloc_block_run(): the first run of `count` free blocks
+ * from `goal` on, wrapping around to the start, or else the longest one.
+ *
+ * @param goal First block number to look at (0 for the allocation hint).
+ * @param count Number of blocks wanted.
+ * @param got Set to the length of the run found, at most count.
+ *
+ * @return The first block of the run, or -1 if no block is free.
+ */
+int blocks_find_run(int goal, int count, int *got);
+
+/**
+ * Allocate the given block if it is free.
+ *
+ * Unlike alloc_block_run(), this leaves the point where allocations
+ * without a goal resume alone, so moving data around (see defrag.h) does
+ * not steer where new files go.
+ *
+ * @param bnum Block number.
+ *
+ * @return 0 on success, -1 if the block is in use or not a data block.
+ */
+int alloc_block_at(int bnum);
+
+/**
+ * Count the blocks that are currently free.
+ *
+ * @return Number of unallocated data blocks.
+ */
+int blocks_free_count();
+
+/**
+ * Zero a run of blocks.
+ *
+ * Punches the range out of the disk image when the host filesystem
+ * supports it, so zeroing a large run does not dirty any pages.
+ *
+ * @param bnum First block to zero.
+ * @param count Number of blocks.
+ */
+void blocks_zero(int bnum, int count);
+
 /**
  * Deallocate the block with the given number.
  *
+ * A block shared by several files (see blocks_ref()) only loses one
+ * owner; it is freed when the last owner lets go.
+ *
  * @param bnun The block number to deallocate.
  */
 void free_block(int bnum);
 
+/**
+ * Register a function to call with each block that becomes free.
+ *
+ * Lets an in-memory index of block contents (see dedup.h) forget blocks
+ * as they are released. A shared block is only reported once its last
+ * owner lets go.
+ *
+ * @param hook The function, or NULL for none.
+ */
+void blocks_on_free(void (*hook)(int bnum));
+
+/**
+ * Count the owners of a block.
+ *
+ * Cloned files share data blocks. The table stores the number of extra
+ * owners of each block, so a zeroed table means every allocated block
+ * has exactly one.
+ *
+ * @param bnum Block number.
+ *
+ * @return Number of owners; 0 for a free block.
+ */
+int blocks_refs(int bnum);
+
+/**
+ * Add an owner to an allocated block.
+ *
+ * @param bnum Block number.
+ *
+ * @return 0 on success, -1 if the block already has the most owners the
+ *         table can count.
+ */
+int blocks_ref(int bnum);
+
+/**
+ * Set the number of owners of an allocated block (used by fsck).
+ *
+ * @param bnum Block number.
+ * @param refs Number of owners, at least 1.
+ */
+void blocks_set_refs(int bnum, int refs);
+
 #endif
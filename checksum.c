@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "checksum.h"
+#include "blocks.h"
+#include "bitmap.h"
+
+#define CRC32C_POLY 0x82f63b78 // Castagnoli, bit-reversed
+#define CRC_LANE 1344          // bytes per lane of the 3-way hardware loop
+
+static checksum_mode_t mode = CHECKSUM_LAZY;
+static uint8_t *verified = 0; // blocks already checked since the mount (lazy)
+
+static int ready = 0;
+static int have_sse42 = 0;
+static uint32_t sw_table[8][256];   // slicing-by-8 tables
+static uint32_t shift_lane[4][256]; // advance a CRC over CRC_LANE zero bytes
+static uint32_t shift_lanes[4][256]; // ... and over 2 * CRC_LANE zero bytes
+
+// Multiply a and b modulo the polynomial (both bit-reversed)
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t) 1 << 31;
+    uint32_t p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+// Build the tables that advance a CRC over len zero bytes. The operation
+// is linear, so it is the xor of its effect on each byte of the CRC.
+static void build_shift(uint32_t table[4][256], int len) {
+    uint32_t xn = (uint32_t) 1 << 31; // x^0
+    for (int ii = 0; ii < len; ii++) {
+        xn = multmodp(xn, (uint32_t) 1 << 23); // times x^8
+    }
+    for (int kk = 0; kk < 4; kk++) {
+        for (int bb = 0; bb < 256; bb++) {
+            table[kk][bb] = multmodp(xn, (uint32_t) bb << (8 * kk));
+        }
+    }
+}
+
+static uint32_t shift(uint32_t table[4][256], uint32_t crc) {
+    return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^
+           table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+// Set up the lookup tables and pick the hardware path if there is one
+static void build_tables() {
+    if (ready) {
+        return;
+    }
+
+    for (int bb = 0; bb < 256; bb++) {
+        uint32_t crc = bb;
+        for (int ii = 0; ii < 8; ii++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        sw_table[0][bb] = crc;
+    }
+    for (int bb = 0; bb < 256; bb++) {
+        for (int kk = 1; kk < 8; kk++) {
+            uint32_t prev = sw_table[kk - 1][bb];
+            sw_table[kk][bb] = (prev >> 8) ^ sw_table[0][prev & 0xff];
+        }
+    }
+
+    build_shift(shift_lane, CRC_LANE);
+    build_shift(shift_lanes, 2 * CRC_LANE);
+#if defined(__x86_64__)
+    have_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+    ready = 1;
+}
+
+static uint32_t crc_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        word ^= crc;
+        crc = sw_table[7][word & 0xff] ^ sw_table[6][(word >> 8) & 0xff] ^
+              sw_table[5][(word >> 16) & 0xff] ^ sw_table[4][(word >> 24) & 0xff] ^
+              sw_table[3][(word >> 32) & 0xff] ^ sw_table[2][(word >> 40) & 0xff] ^
+              sw_table[1][(word >> 48) & 0xff] ^ sw_table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ sw_table[0][(crc ^ *p++) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+static inline uint64_t load64(const uint8_t *p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+// The crc32 instruction takes 3 cycles but can start one every cycle, so
+// three lanes are run side by side and joined with the shift tables.
+__attribute__((target("sse4.2")))
+static inline uint32_t crc_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c0 = crc;
+    while (len >= 3 * CRC_LANE) {
+        uint64_t c1 = 0;
+        uint64_t c2 = 0;
+        for (int ii = 0; ii < CRC_LANE; ii += 8) {
+            c0 = _mm_crc32_u64(c0, load64(p + ii));
+            c1 = _mm_crc32_u64(c1, load64(p + CRC_LANE + ii));
+            c2 = _mm_crc32_u64(c2, load64(p + 2 * CRC_LANE + ii));
+        }
+        c0 = shift(shift_lanes, c0) ^ shift(shift_lane, c1) ^ c2;
+        p += 3 * CRC_LANE;
+        len -= 3 * CRC_LANE;
+    }
+    while (len >= 8) {
+        c0 = _mm_crc32_u64(c0, load64(p));
+        p += 8;
+        len -= 8;
+    }
+    uint32_t c = c0;
+    while (len-- > 0) {
+        c = _mm_crc32_u8(c, *p++);
+    }
+    return c;
+}
+#endif
+
+// CRC32C of len bytes, continuing from crc (0 to start)
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+#if defined(__x86_64__)
+    if (have_sse42) {
+        return ~crc_hw(~crc, data, len);
+    }
+#endif
+    return ~crc_sw(~crc, data, len);
+}
+
+// The hardware CRC of a whole block, compiled for each size in
+// NUFS_BLOCK_SIZES so the lane loops run a known number of times
+#if defined(__x86_64__)
+#define BLOCK_CRC(size)                                         \
+    __attribute__((target("sse4.2")))                           \
+    static uint32_t block_crc_##size(const void *block) {       \
+        return ~crc_hw(~0u, block, size);                       \
+    }
+NUFS_BLOCK_SIZES(BLOCK_CRC)
+#endif
+
+// The one for the open image, or 0 to use crc32c
+static uint32_t (*block_crc)(const void *block) = 0;
+
+// Get ready to checksum the blocks of the open image
+void checksum_init() {
+    build_tables();
+    block_crc = 0;
+#if defined(__x86_64__)
+    if (have_sse42) {
+        switch (BLOCK_SIZE) {
+#define PICK(size) case size: block_crc = block_crc_##size; break;
+        NUFS_BLOCK_SIZES(PICK)
+#undef PICK
+        }
+    }
+#endif
+}
+
+// The checksum kept for a block with the given contents; 0 in the table
+// means no checksum, so a CRC of 0 is kept as 1
+uint32_t checksum_of(const void *block) {
+    uint32_t crc = block_crc != 0 ? block_crc(block) : crc32c(0, block, BLOCK_SIZE);
+    return crc != 0 ? crc : 1;
+}
+
+static uint32_t *sums() {
+    return blocks_get_block(blocks_super()->csum_block);
+}
+
+// Choose how reads are checked; set before storage_init
+void checksum_set_mode(checksum_mode_t new_mode) {
+    mode = new_mode;
+}
+
+void checksum_open() {
+    checksum_init();
+    verified = calloc(BLOCK_BITMAP_SIZE, 1);
+}
+
+void checksum_close() {
+    free(verified);
+    verified = 0;
+}
+
+// Record the checksum of the given block after its contents changed
+void checksum_update(int bnum) {
+    sums()[bnum] = checksum_of(blocks_get_block(bnum));
+    if (verified != 0) {
+        bitmap_put(verified, bnum, 1);
+    }
+}
+
+// Give a copy of a block the checksum of the block it was copied from,
+// so that damage to the original is not blessed by the copy
+void checksum_copy(int dst, int src) {
+    sums()[dst] = sums()[src];
+    if (verified != 0) {
+        bitmap_put(verified, dst, bitmap_get(verified, src));
+    }
+}
+
+// Check the given block against its checksum. Returns -1 if it does not
+// match, or 0 if it does or the block has none.
+int checksum_check(int bnum) {
+    uint32_t sum = sums()[bnum];
+    if (sum == 0 || checksum_of(blocks_get_block(bnum)) == sum) {
+        return 0;
+    }
+    return -1;
+}
+
+// Check a block that is about to be read, as the mode asks. Returns -1 if
+// it is damaged. Offline tools, which never open the checksums, use
+// checksum_check() instead.
+int checksum_verify(int bnum) {
+    if (verified == 0 || mode == CHECKSUM_OFF ||
+        (mode == CHECKSUM_LAZY && bitmap_get(verified, bnum))) {
+        return 0;
+    }
+    if (checksum_check(bnum) == -1) {
+        fprintf(stderr, "nufs: block %d fails its checksum\n", bnum);
+        return -1;
+    }
+    if (mode == CHECKSUM_LAZY) {
+        bitmap_put(verified, bnum, 1);
+    }
+    return 0;
+}
@@ -0,0 +1,36 @@
+// Checksums of file data blocks.
+//
+// Every data block written through a file gets a CRC32C of its contents
+// in the checksum table (see blocks.h), which is updated each time the
+// block is written and checked when it is read back. A read that does not
+// match fails with EIO instead of returning silently corrupted data.
+// Blocks with no entry yet (indirect and directory blocks, space reserved
+// with fallocate) are not checked.
+//
+// CRC32C is computed with the SSE4.2 crc32 instruction when the processor
+// has it, and with table lookups otherwise; both give the same value.
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum checksum_mode {
+  CHECKSUM_OFF,    // keep the checksums up to date, but never check them
+  CHECKSUM_LAZY,   // check each block the first time it is read
+  CHECKSUM_STRICT, // check each block every time it is read
+} checksum_mode_t;
+
+void checksum_init();
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+uint32_t checksum_of(const void *block);
+void checksum_set_mode(checksum_mode_t mode);
+void checksum_open();
+void checksum_close();
+void checksum_update(int bnum);
+void checksum_copy(int dst, int src);
+int checksum_check(int bnum);
+int checksum_verify(int bnum);
+
+#endif
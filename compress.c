@@ -0,0 +1,509 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compress.h"
+#include "blocks.h"
+#include "delalloc.h"
+#include "checksum.h"
+#include "arena.h"
+
+// Stored at the start of the first block of a compressed cluster
+typedef struct cluster_header {
+    uint32_t raw_len;           // bytes the cluster expands to (whole blocks)
+    uint32_t packed_len;        // compressed bytes that follow the header
+} cluster_header_t;
+
+// A decompressed cluster, named by the first block of its compressed copy.
+// That block is only rewritten by compress_store, which drops the entry.
+typedef struct cached_cluster {
+    int bnum;                   // 0 = unused
+    int raw_len;
+    unsigned long last_use;
+    char *data;                 // COMPRESS_CLUSTER_BLOCKS blocks
+} cached_cluster_t;
+
+static int enabled = 0;
+static cached_cluster_t cache[COMPRESS_CACHE_SIZE];
+static unsigned long cache_clock = 0;
+
+// Codec: a byte-oriented LZ77 in the LZ4 block format. Each sequence is a
+// token (literal count << 4 | match length - 4), more literal count bytes
+// if it was 15, the literals, a 2-byte little-endian match offset, and
+// more match length bytes if it was 15. The last sequence has no match.
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t lz_hash(const uint8_t *pos) {
+    uint32_t word;
+    memcpy(&word, pos, sizeof(word));
+    return (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Write the part of a length that did not fit in the token
+static uint8_t *lz_put_length(uint8_t *op, int len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+// Read the rest of a length whose token part was 15. Returns -1 if the
+// input ends first.
+static int lz_get_length(const uint8_t **ip, const uint8_t *end, int len) {
+    int byte;
+    do {
+        if (*ip >= end) {
+            return -1;
+        }
+        byte = *(*ip)++;
+        len += byte;
+    } while (byte == 255);
+    return len;
+}
+
+// Emit one sequence. Returns the new output position, or 0 if it does not
+// fit in the output.
+static uint8_t *lz_put_sequence(uint8_t *op, uint8_t *out_end, const uint8_t *lit,
+                                int lit_len, int offset, int match_len) {
+    int worst = 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+    if (worst > out_end - op) {
+        return 0;
+    }
+
+    uint8_t *token = op++;
+    *token = (lit_len < 15 ? lit_len : 15) << 4;
+    if (lit_len >= 15) {
+        op = lz_put_length(op, lit_len - 15);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len == 0) {
+        return op;
+    }
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    match_len -= LZ_MIN_MATCH;
+    *token |= match_len < 15 ? match_len : 15;
+    if (match_len >= 15) {
+        op = lz_put_length(op, match_len - 15);
+    }
+    return op;
+}
+
+// Compress len bytes of src into dst. Returns the compressed length, or
+// -1 if it would take more than cap bytes.
+static int lz_compress(const char *src, int len, char *dst, int cap) {
+    const uint8_t *base = (const uint8_t *) src;
+    const uint8_t *end = base + len;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    uint8_t *op = (uint8_t *) dst;
+    uint8_t *out_end = op + cap;
+
+    int table[1 << LZ_HASH_BITS]; // position + 1 of the last 4 bytes seen
+    memset(table, 0, sizeof(table));
+
+    // skip ahead faster the longer nothing matches, like LZ4 does
+    int misses = 0;
+    while (len >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH) {
+        uint32_t hash = lz_hash(ip);
+        int seen = table[hash];
+        table[hash] = ip - base + 1;
+        const uint8_t *cand = base + seen - 1;
+        if (seen == 0 || ip - cand > LZ_MAX_OFFSET ||
+            memcmp(cand, ip, LZ_MIN_MATCH) != 0) {
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+
+        int match_len = LZ_MIN_MATCH;
+        while (ip + match_len < end && cand[match_len] == ip[match_len]) {
+            match_len += 1;
+        }
+        op = lz_put_sequence(op, out_end, anchor, ip - anchor, ip - cand, match_len);
+        if (op == 0) {
+            return -1;
+        }
+        ip += match_len;
+        anchor = ip;
+    }
+
+    op = lz_put_sequence(op, out_end, anchor, end - anchor, 0, 0);
+    if (op == 0) {
+        return -1;
+    }
+    return op - (uint8_t *) dst;
+}
+
+// Decompress len bytes of src into dst. Returns the decompressed length,
+// or -1 if the input is damaged or would expand past cap bytes.
+static int lz_decompress(const char *src, int len, char *dst, int cap) {
+    const uint8_t *ip = (const uint8_t *) src;
+    const uint8_t *end = ip + len;
+    uint8_t *base = (uint8_t *) dst;
+    uint8_t *op = base;
+    uint8_t *out_end = base + cap;
+
+    while (ip < end) {
+        int token = *ip++;
+        int lit_len = token >> 4;
+        if (lit_len == 15 && (lit_len = lz_get_length(&ip, end, lit_len)) == -1) {
+            return -1;
+        }
+        if (lit_len > end - ip || lit_len > out_end - op) {
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+        if (ip == end) {
+            break; // the last sequence has no match
+        }
+
+        if (end - ip < 2) {
+            return -1;
+        }
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        int match_len = token & 15;
+        if (match_len == 15 && (match_len = lz_get_length(&ip, end, match_len)) == -1) {
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op - base || match_len > out_end - op) {
+            return -1;
+        }
+
+        const uint8_t *match = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, match, match_len);
+        } else {
+            for (int ii = 0; ii < match_len; ii++) { // overlapping run
+                op[ii] = match[ii];
+            }
+        }
+        op += match_len;
+    }
+    return op - base;
+}
+
+// Compress clusters flushed from now on (existing ones are read either way)
+void compress_set_enabled(int on) {
+    enabled = on != 0;
+}
+
+int compress_enabled() {
+    return enabled;
+}
+
+// Is the given file block part of a compressed cluster?
+int compress_is_compressed(inode_t *node, int file_bnum) {
+    int cluster = file_bnum / COMPRESS_CLUSTER_BLOCKS;
+    return cluster < COMPRESS_MAX_CLUSTERS && (node->compressed >> cluster & 1);
+}
+
+// File blocks a cluster can span, short of the largest file size
+static int cluster_limit(int cluster) {
+    int room = inode_max_size() / BLOCK_SIZE - cluster * COMPRESS_CLUSTER_BLOCKS;
+    return room < COMPRESS_CLUSTER_BLOCKS ? room : COMPRESS_CLUSTER_BLOCKS;
+}
+
+// Allocate count blocks for the cluster, in as few runs as the allocator
+// gives, right after the block before the cluster when possible. Returns
+// -1 (and keeps nothing) if the disk is full.
+static int alloc_cluster(inode_t *node, int first, int *bnums, int count) {
+    int prev = first > 0 ? inode_get_bnum(node, first - 1) : 0;
+    int goal = prev != 0 ? prev + 1 : 0;
+    int done = 0;
+    while (done < count) {
+        int got;
+        int run = alloc_block_run(goal, count - done, &got);
+        if (run == -1) {
+            for (int ii = 0; ii < done; ii++) {
+                free_block(bnums[ii]);
+            }
+            return -1;
+        }
+        for (int ii = 0; ii < got; ii++) {
+            bnums[done++] = run + ii;
+        }
+        goal = run + got;
+    }
+    return 0;
+}
+
+// Point the first count blocks of the cluster at bnums and the rest of it
+// at holes, dropping the blocks it had. The indirect block must already
+// be allocated and owned, so this cannot fail.
+static void remap_cluster(inode_t *node, int cluster, int *bnums, int count) {
+    int first = cluster * COMPRESS_CLUSTER_BLOCKS;
+    int limit = cluster_limit(cluster);
+    for (int ii = 0; ii < limit; ii++) {
+        int old = inode_get_bnum(node, first + ii);
+        int bnum = ii < count ? bnums[ii] : 0;
+        if (old != bnum) {
+            inode_set_bnum(node, first + ii, bnum);
+            if (old != 0) {
+                free_block(old);
+            }
+        }
+    }
+}
+
+// Make sure the indirect block exists and belongs to this inode, so the
+// block numbers up to file block last can change without allocating.
+static int own_map(inode_t *node, int last) {
+    return last == 0 ? 0 : inode_set_bnum(node, last, inode_get_bnum(node, last));
+}
+
+// Forget the cached copy of the cluster stored at bnum
+static void cache_drop(int bnum) {
+    for (int ii = 0; ii < COMPRESS_CACHE_SIZE; ii++) {
+        if (cache[ii].bnum == bnum) {
+            cache[ii].bnum = 0;
+        }
+    }
+}
+
+// Store nblocks blocks of data as the given cluster of the file, compressed,
+// if that takes fewer blocks than it has now plus the buffered blocks that
+// are being flushed for it. Returns 1 if the cluster was stored, or 0 if it
+// should be stored as plain blocks instead.
+int compress_store(inode_t *node, int cluster, const char *data, int nblocks,
+                   int buffered) {
+    if (cluster >= COMPRESS_MAX_CLUSTERS || nblocks < 2 || (node->compressed >> cluster & 1)) {
+        return 0;
+    }
+
+    // blocks reserved past the data (fallocate) keep the cluster plain
+    int first = cluster * COMPRESS_CLUSTER_BLOCKS;
+    int used = buffered;
+    for (int ii = 0; ii < cluster_limit(cluster); ii++) {
+        if (inode_get_bnum(node, first + ii) != 0) {
+            if (ii >= nblocks) {
+                return 0;
+            }
+            used += 1;
+        }
+    }
+
+    int room = (used - 1) * BLOCK_SIZE - (int) sizeof(cluster_header_t);
+    if (room <= 0) {
+        return 0;
+    }
+    char *packed = arena_alloc(used * BLOCK_SIZE);
+    cluster_header_t *hdr = (cluster_header_t *) packed;
+    int len = lz_compress(data, nblocks * BLOCK_SIZE, packed + sizeof(*hdr), room);
+    int count = len == -1 ? used : bytes_to_blocks(sizeof(*hdr) + len);
+
+    // the buffered blocks are already reserved; the rest must be free
+    int bnums[COMPRESS_CLUSTER_BLOCKS];
+    if (len == -1 || count + 1 > blocks_free_count() - delalloc_reserved() + buffered ||
+        own_map(node, first + nblocks - 1) == -1 ||
+        alloc_cluster(node, first, bnums, count) == -1) {
+        arena_free(packed);
+        return 0;
+    }
+
+    hdr->raw_len = nblocks * BLOCK_SIZE;
+    hdr->packed_len = len;
+    memset(packed + sizeof(*hdr) + len, 0, count * BLOCK_SIZE - sizeof(*hdr) - len);
+    for (int ii = 0; ii < count; ii++) {
+        memcpy(blocks_get_block(bnums[ii]), packed + ii * BLOCK_SIZE, BLOCK_SIZE);
+        checksum_update(bnums[ii]);
+    }
+    arena_free(packed);
+
+    cache_drop(bnums[0]);
+    remap_cluster(node, cluster, bnums, count);
+    node->compressed |= (uint64_t) 1 << cluster;
+    return 1;
+}
+
+// Decompress the given cluster into out (COMPRESS_CLUSTER_BLOCKS blocks).
+// Returns the number of bytes it expands to, or -1 if it is damaged.
+static int load_cluster(inode_t *node, int cluster, char *out) {
+    int first = cluster * COMPRESS_CLUSTER_BLOCKS;
+    int bnum = inode_get_bnum(node, first);
+    if (bnum == 0) {
+        return -1;
+    }
+
+    if (checksum_verify(bnum) == -1) {
+        return -1;
+    }
+    cluster_header_t *hdr = blocks_get_block(bnum);
+    int room = COMPRESS_CLUSTER_BLOCKS * BLOCK_SIZE;
+    if (hdr->raw_len == 0 || hdr->raw_len > room || hdr->raw_len % BLOCK_SIZE != 0 ||
+        hdr->packed_len > room - sizeof(*hdr)) {
+        return -1;
+    }
+
+    // the compressed bytes are read in place when their blocks are contiguous
+    int count = bytes_to_blocks(sizeof(*hdr) + hdr->packed_len);
+    int contiguous = 1;
+    for (int ii = 1; ii < count; ii++) {
+        int next = inode_get_bnum(node, first + ii);
+        if (next == 0 || checksum_verify(next) == -1) {
+            return -1;
+        }
+        contiguous &= next == bnum + ii;
+    }
+
+    char *gathered = 0;
+    const char *packed = (const char *) (hdr + 1);
+    if (!contiguous) {
+        gathered = arena_alloc(count * BLOCK_SIZE);
+        for (int ii = 0; ii < count; ii++) {
+            memcpy(gathered + ii * BLOCK_SIZE,
+                   blocks_get_block(inode_get_bnum(node, first + ii)), BLOCK_SIZE);
+        }
+        packed = gathered + sizeof(*hdr);
+    }
+
+    int len = lz_decompress(packed, hdr->packed_len, out, hdr->raw_len);
+    arena_free(gathered);
+    return len == (int) hdr->raw_len ? len : -1;
+}
+
+// Get the decompressed copy of the given cluster, decompressing it into
+// the least recently used cache slot if needed. Returns 0 if it is damaged.
+static cached_cluster_t *cache_get(inode_t *node, int cluster) {
+    int bnum = inode_get_bnum(node, cluster * COMPRESS_CLUSTER_BLOCKS);
+    cached_cluster_t *victim = &cache[0];
+    for (int ii = 0; ii < COMPRESS_CACHE_SIZE; ii++) {
+        if (cache[ii].bnum == bnum && bnum != 0) {
+            cache[ii].last_use = ++cache_clock;
+            return &cache[ii];
+        }
+        if (cache[ii].last_use < victim->last_use) {
+            victim = &cache[ii];
+        }
+    }
+
+    if (victim->data == 0) {
+        victim->data = malloc(COMPRESS_CLUSTER_BLOCKS * BLOCK_SIZE);
+    }
+    victim->raw_len = load_cluster(node, cluster, victim->data);
+    if (victim->raw_len == -1) {
+        victim->bnum = 0;
+        return 0;
+    }
+    victim->bnum = bnum;
+    victim->last_use = ++cache_clock;
+    return victim;
+}
+
+// Copy len bytes at offset of the given file block, which is part of a
+// compressed cluster, into buf. Returns -1 if the cluster is damaged.
+int compress_read(inode_t *node, int file_bnum, int offset, char *buf, int len) {
+    cached_cluster_t *cc = cache_get(node, file_bnum / COMPRESS_CLUSTER_BLOCKS);
+    if (cc == 0) {
+        return -1;
+    }
+
+    int pos = (file_bnum % COMPRESS_CLUSTER_BLOCKS) * BLOCK_SIZE + offset;
+    if (pos >= cc->raw_len) {
+        memset(buf, 0, len); // grown past the cluster's data since
+    } else {
+        memcpy(buf, cc->data + pos, len);
+    }
+    return 0;
+}
+
+// Turn a compressed cluster back into plain blocks. Returns -1 if the disk
+// is full or the cluster is damaged.
+static int expand_cluster(inode_t *node, int cluster) {
+    cached_cluster_t *cc = cache_get(node, cluster);
+    if (cc == 0) {
+        return -1;
+    }
+
+    int first = cluster * COMPRESS_CLUSTER_BLOCKS;
+    int nblocks = cc->raw_len / BLOCK_SIZE;
+    int bnums[COMPRESS_CLUSTER_BLOCKS];
+    if (nblocks + 1 > blocks_free_count() - delalloc_reserved() ||
+        own_map(node, first + nblocks - 1) == -1 ||
+        alloc_cluster(node, first, bnums, nblocks) == -1) {
+        return -1;
+    }
+
+    for (int ii = 0; ii < nblocks; ii++) {
+        memcpy(blocks_get_block(bnums[ii]), cc->data + ii * BLOCK_SIZE, BLOCK_SIZE);
+        checksum_update(bnums[ii]);
+    }
+    cc->bnum = 0; // its blocks are freed next
+    remap_cluster(node, cluster, bnums, nblocks);
+    node->compressed &= ~((uint64_t) 1 << cluster);
+    return 0;
+}
+
+// Expand the compressed clusters that overlap file blocks
+// [first, first + count). Returns -1 if the disk fills up.
+int compress_expand(inode_t *node, int first, int count) {
+    if (node->compressed == 0 || count <= 0) {
+        return 0;
+    }
+
+    int last = (first + count - 1) / COMPRESS_CLUSTER_BLOCKS;
+    for (int cluster = first / COMPRESS_CLUSTER_BLOCKS;
+         cluster <= last && cluster < COMPRESS_MAX_CLUSTERS; cluster++) {
+        if ((node->compressed >> cluster & 1) && expand_cluster(node, cluster) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Get ready to cut the file at size: a compressed cluster the new end
+// falls inside is expanded, and those wholly past it are forgotten, as
+// shrink_inode frees their blocks like any others. Returns -1 if full.
+int compress_truncate(inode_t *node, int size) {
+    int keep = bytes_to_blocks(size);
+    if (size % BLOCK_SIZE != 0 && compress_expand(node, size / BLOCK_SIZE, 1) == -1) {
+        return -1;
+    }
+    if (keep % COMPRESS_CLUSTER_BLOCKS != 0 && compress_expand(node, keep, 1) == -1) {
+        return -1;
+    }
+
+    int past = (keep + COMPRESS_CLUSTER_BLOCKS - 1) / COMPRESS_CLUSTER_BLOCKS;
+    if (past < COMPRESS_MAX_CLUSTERS) {
+        node->compressed &= ((uint64_t) 1 << past) - 1;
+    }
+    return 0;
+}
+
+// Check that the given compressed cluster decompresses. Returns the number
+// of blocks its compressed copy takes, or -1 if it is damaged. Uses no
+// shared state, so fsck can call it from several threads.
+int compress_verify(inode_t *node, int cluster) {
+    char *out = arena_alloc(COMPRESS_CLUSTER_BLOCKS * BLOCK_SIZE);
+    int len = load_cluster(node, cluster, out);
+    arena_free(out);
+    if (len == -1) {
+        return -1;
+    }
+
+    int bnum = inode_get_bnum(node, cluster * COMPRESS_CLUSTER_BLOCKS);
+    cluster_header_t *hdr = blocks_get_block(bnum);
+    return bytes_to_blocks(sizeof(*hdr) + hdr->packed_len);
+}
+
+// Drop the cached clusters; called when the image is closed.
+void compress_reset() {
+    for (int ii = 0; ii < COMPRESS_CACHE_SIZE; ii++) {
+        free(cache[ii].data);
+        cache[ii].data = 0;
+        cache[ii].bnum = 0;
+        cache[ii].last_use = 0;
+    }
+    cache_clock = 0;
+}
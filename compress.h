@@ -0,0 +1,36 @@
+// Transparent compression of file data.
+//
+// File blocks are grouped into clusters of COMPRESS_CLUSTER_BLOCKS. When
+// buffered data for a cluster is flushed (see delalloc.h), the whole
+// cluster is compressed with a small LZ4-style codec, and if that saves
+// at least one block it is stored compressed: the first blocks of the
+// cluster hold a header and the compressed bytes, the rest are holes, and
+// the cluster's bit is set in inode->compressed. Clusters that don't
+// shrink are stored as plain blocks.
+//
+// Reads decompress through a small cache of clusters. Anything that
+// changes a compressed cluster in place (write, truncate, fallocate,
+// clone) expands it back into plain blocks first; it is compressed again
+// the next time new data for it is flushed.
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "inode.h"
+
+#define COMPRESS_CLUSTER_BLOCKS 16
+#define COMPRESS_MAX_CLUSTERS 64  // bits in inode->compressed
+#define COMPRESS_CACHE_SIZE 8     // decompressed clusters kept for reads
+
+void compress_set_enabled(int enabled);
+int compress_enabled();
+int compress_is_compressed(inode_t *node, int file_bnum);
+int compress_store(inode_t *node, int cluster, const char *data, int nblocks,
+                   int buffered);
+int compress_read(inode_t *node, int file_bnum, int offset, char *buf, int len);
+int compress_expand(inode_t *node, int first, int count);
+int compress_truncate(inode_t *node, int size);
+int compress_verify(inode_t *node, int cluster);
+void compress_reset();
+
+#endif
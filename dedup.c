@@ -0,0 +1,364 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "dedup.h"
+#include "blocks.h"
+#include "bitmap.h"
+
+// Saved index record; the saved index ends at the first record with bnum 0
+typedef struct dedup_record {
+    dedup_key_t key;
+    uint32_t bnum;
+    uint32_t reserved;
+} dedup_record_t;
+
+// Index entry of a data block, kept in an array indexed by block number so
+// a freed block can be dropped without rehashing its contents
+typedef struct index_entry {
+    dedup_key_t key;
+    int next;                   // next block in the same bucket (0 = none)
+    int indexed;
+} index_entry_t;
+
+static int enabled = 0;
+static index_entry_t *entries = 0;
+static int *buckets = 0;
+static int bucket_mask = 0;
+static dedup_stats_t stats;
+
+// Hash: 8 lanes of 64 bits take one 64-byte stripe per round, multiplying
+// the two halves of each word xor a key and adding the word to the
+// neighbouring lane (the XXH3 accumulate step). The key moves on by a
+// prime each stripe so the stripes of a block don't commute, and every
+// 1 KB the lanes are scrambled. The SSE2 and plain versions compute the
+// same value, so a saved index works on either.
+
+#define HASH_LANES 8
+#define HASH_STRIPE (HASH_LANES * 8)
+#define HASH_SCRAMBLE_STRIPES 16
+#define PRIME32 0x9E3779B1u
+#define PRIME64_1 0x9E3779B185EBCA87ull
+#define PRIME64_2 0xC2B2AE3D27D4EB4Full
+
+static const uint64_t hash_secret[HASH_LANES] = {
+    0xbe4ba423396cfeb8ull, 0x1cad21f72c81017cull, 0xdb979083e96dd4deull,
+    0x1f67b3b7a4a44072ull, 0x78e5c0cc4ee679cbull, 0x2172ffcc7dd05a82ull,
+    0x8e2443f7744608b8ull, 0x4c263a81e69035e0ull,
+};
+
+#ifdef __SSE2__
+static inline void hash_lanes(const uint8_t *data, int len, uint64_t *out) {
+    __m128i acc[HASH_LANES / 2];
+    __m128i secret[HASH_LANES / 2];
+    __m128i key[HASH_LANES / 2];
+    __m128i step = _mm_set1_epi64x(PRIME64_1);
+    __m128i prime32 = _mm_set1_epi32(PRIME32);
+    for (int ii = 0; ii < HASH_LANES / 2; ii++) {
+        acc[ii] = _mm_setzero_si128();
+        secret[ii] = _mm_loadu_si128((const __m128i *) hash_secret + ii);
+        key[ii] = secret[ii];
+    }
+
+    for (int stripe = 0; stripe < len / HASH_STRIPE; stripe++) {
+        const __m128i *words = (const __m128i *) (data + stripe * HASH_STRIPE);
+        for (int ii = 0; ii < HASH_LANES / 2; ii++) {
+            __m128i word = _mm_loadu_si128(words + ii);
+            __m128i mixed = _mm_xor_si128(word, key[ii]);
+            __m128i high = _mm_shuffle_epi32(mixed, _MM_SHUFFLE(0, 3, 0, 1));
+            __m128i swapped = _mm_shuffle_epi32(word, _MM_SHUFFLE(1, 0, 3, 2));
+            acc[ii] = _mm_add_epi64(acc[ii], _mm_mul_epu32(mixed, high));
+            acc[ii] = _mm_add_epi64(acc[ii], swapped);
+            key[ii] = _mm_add_epi64(key[ii], step);
+        }
+
+        if ((stripe + 1) % HASH_SCRAMBLE_STRIPES == 0) {
+            for (int ii = 0; ii < HASH_LANES / 2; ii++) {
+                __m128i lane = _mm_xor_si128(acc[ii], _mm_srli_epi64(acc[ii], 47));
+                lane = _mm_xor_si128(lane, secret[ii]);
+                __m128i low = _mm_mul_epu32(lane, prime32);
+                __m128i high = _mm_mul_epu32(_mm_srli_epi64(lane, 32), prime32);
+                acc[ii] = _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+            }
+        }
+    }
+
+    for (int ii = 0; ii < HASH_LANES / 2; ii++) {
+        _mm_storeu_si128((__m128i *) out + ii, acc[ii]);
+    }
+}
+#else
+static inline void hash_lanes(const uint8_t *data, int len, uint64_t *acc) {
+    uint64_t key[HASH_LANES];
+    for (int ii = 0; ii < HASH_LANES; ii++) {
+        acc[ii] = 0;
+        key[ii] = hash_secret[ii];
+    }
+
+    for (int stripe = 0; stripe < len / HASH_STRIPE; stripe++) {
+        const uint8_t *words = data + stripe * HASH_STRIPE;
+        for (int ii = 0; ii < HASH_LANES; ii++) {
+            uint64_t word;
+            memcpy(&word, words + ii * 8, sizeof(word));
+            uint64_t mixed = word ^ key[ii];
+            acc[ii] += (mixed & 0xffffffff) * (mixed >> 32);
+            acc[ii ^ 1] += word;
+            key[ii] += PRIME64_1;
+        }
+
+        if ((stripe + 1) % HASH_SCRAMBLE_STRIPES == 0) {
+            for (int ii = 0; ii < HASH_LANES; ii++) {
+                uint64_t lane = acc[ii] ^ (acc[ii] >> 47) ^ hash_secret[ii];
+                acc[ii] = lane * PRIME32;
+            }
+        }
+    }
+}
+#endif
+
+// Fold a 64x64 multiply into 64 bits
+static uint64_t mul_fold(uint64_t a, uint64_t b) {
+    __uint128_t product = (__uint128_t) a * b;
+    return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+
+static uint64_t avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= PRIME64_2;
+    return h ^ (h >> 32);
+}
+
+// Hash len bytes of data (a multiple of the stripe)
+static inline void hash_block(const void *data, int len, dedup_key_t *key) {
+    uint64_t acc[HASH_LANES];
+    hash_lanes(data, len, acc);
+
+    uint64_t low = (uint64_t) len * PRIME64_1;
+    uint64_t high = ~low;
+    for (int ii = 0; ii < HASH_LANES; ii += 2) {
+        low += mul_fold(acc[ii] ^ hash_secret[ii], acc[ii + 1] ^ hash_secret[ii + 1]);
+        high += mul_fold(acc[ii] ^ hash_secret[HASH_LANES - 1 - ii],
+                         acc[ii + 1] ^ hash_secret[HASH_LANES - 2 - ii]);
+    }
+    key->hash[0] = avalanche(low);
+    key->hash[1] = avalanche(high);
+}
+
+// Hashing and comparing whole blocks, compiled for each size in
+// NUFS_BLOCK_SIZES so the stripe loop and memcmp have a known length
+#define BLOCK_FUNCS(size)                                               \
+    static void hash_##size(const void *data, dedup_key_t *key) {       \
+        hash_block(data, size, key);                                    \
+    }                                                                   \
+    static int same_##size(const void *a, const void *b) {              \
+        return memcmp(a, b, size) == 0;                                 \
+    }
+NUFS_BLOCK_SIZES(BLOCK_FUNCS)
+
+static void hash_any(const void *data, dedup_key_t *key) {
+    hash_block(data, BLOCK_SIZE, key);
+}
+
+static int same_any(const void *a, const void *b) {
+    return memcmp(a, b, BLOCK_SIZE) == 0;
+}
+
+// The ones for the open image's block size; picked in dedup_open
+static void (*hash_fn)(const void *data, dedup_key_t *key) = hash_any;
+static int (*same_fn)(const void *a, const void *b) = same_any;
+
+// Hash one block of data (the block size is a multiple of the stripe)
+void dedup_hash(const void *data, dedup_key_t *key) {
+    hash_fn(data, key);
+    stats.hashed += 1;
+}
+
+// Share blocks written from now on (takes effect at the next mount of the
+// image when the index has to be loaded)
+void dedup_set_enabled(int on) {
+    enabled = on != 0;
+}
+
+int dedup_enabled() {
+    return enabled;
+}
+
+static int same_key(const dedup_key_t *a, const dedup_key_t *b) {
+    return a->hash[0] == b->hash[0] && a->hash[1] == b->hash[1];
+}
+
+// Find a data block in the index with the given contents. Returns its
+// number, or 0 if there is none.
+int dedup_lookup(const dedup_key_t *key, const void *data) {
+    if (entries == 0) {
+        return 0;
+    }
+
+    for (int bnum = buckets[key->hash[0] & bucket_mask]; bnum != 0;
+         bnum = entries[bnum].next) {
+        if (!same_key(&entries[bnum].key, key)) {
+            continue;
+        }
+        if (same_fn(blocks_get_block(bnum), data)) {
+            return bnum;
+        }
+        stats.collisions += 1;
+    }
+    return 0;
+}
+
+// Add an owner to a data block with the given contents. Returns its
+// number, or 0 if there is no such block to share.
+int dedup_share(const dedup_key_t *key, const void *data) {
+    int bnum = dedup_lookup(key, data);
+    if (bnum == 0) {
+        return 0;
+    }
+    if (blocks_ref(bnum) == -1) {
+        dedup_forget(bnum); // has the most owners; let a new copy take over
+        return 0;
+    }
+    stats.shared += 1;
+    return bnum;
+}
+
+// Record that the given data block holds contents with the given hash
+void dedup_insert(const dedup_key_t *key, int bnum) {
+    if (entries == 0 || entries[bnum].indexed) {
+        return;
+    }
+
+    int *bucket = &buckets[key->hash[0] & bucket_mask];
+    entries[bnum].key = *key;
+    entries[bnum].next = *bucket;
+    entries[bnum].indexed = 1;
+    *bucket = bnum;
+    stats.indexed += 1;
+}
+
+// Index the block dst under the key of src, whose contents were copied to
+// it (see defrag.h)
+void dedup_move(int src, int dst) {
+    if (entries != 0 && entries[src].indexed) {
+        dedup_insert(&entries[src].key, dst);
+    }
+}
+
+// Drop the given block from the index; its contents changed or it is free
+void dedup_forget(int bnum) {
+    if (entries == 0 || !entries[bnum].indexed) {
+        return;
+    }
+
+    int *link = &buckets[entries[bnum].key.hash[0] & bucket_mask];
+    while (*link != bnum) {
+        link = &entries[*link].next;
+    }
+    *link = entries[bnum].next;
+    entries[bnum].indexed = 0;
+    stats.indexed -= 1;
+}
+
+// Load the index saved at the last unmount, keeping the records whose
+// block still holds what was hashed.
+static void load_saved(superblock_t *sb) {
+    dedup_record_t *records = blocks_get_block(sb->dedup_block);
+    int count = sb->dedup_blocks * BLOCK_SIZE / sizeof(dedup_record_t);
+    void *bbm = get_blocks_bitmap();
+
+    for (int ii = 0; ii < count && records[ii].bnum != 0; ii++) {
+        uint32_t bnum = records[ii].bnum;
+        if (bnum < sb->data_block || bnum >= sb->block_count || !bitmap_get(bbm, bnum) ||
+            (bnum >= sb->dedup_block && bnum < sb->dedup_block + sb->dedup_blocks)) {
+            continue;
+        }
+        dedup_key_t key;
+        dedup_hash(blocks_get_block(bnum), &key);
+        if (same_key(&key, &records[ii].key)) {
+            dedup_insert(&key, bnum);
+        }
+    }
+}
+
+// Set up the index for a newly mounted image. The saved index is loaded
+// when dedup is on, and freed either way.
+void dedup_open() {
+    hash_fn = hash_any;
+    same_fn = same_any;
+    switch (BLOCK_SIZE) {
+#define PICK(size) case size: hash_fn = hash_##size; same_fn = same_##size; break;
+    NUFS_BLOCK_SIZES(PICK)
+#undef PICK
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    superblock_t *sb = blocks_super();
+    if (enabled) {
+        int nbuckets = 64;
+        while (nbuckets < BLOCK_COUNT / 4) {
+            nbuckets *= 2;
+        }
+        entries = calloc(BLOCK_COUNT, sizeof(index_entry_t));
+        buckets = calloc(nbuckets, sizeof(int));
+        bucket_mask = nbuckets - 1;
+        blocks_on_free(dedup_forget);
+
+        if (sb->dedup_block != 0) {
+            load_saved(sb);
+        }
+    }
+    stats.hashed = 0;
+
+    for (uint32_t ii = 0; ii < sb->dedup_blocks; ii++) {
+        free_block(sb->dedup_block + ii);
+    }
+    sb->dedup_block = 0;
+    sb->dedup_blocks = 0;
+}
+
+// Save the index in one run of free blocks, if there is one, and drop it.
+void dedup_close() {
+    if (entries == 0) {
+        return;
+    }
+    blocks_on_free(0);
+
+    superblock_t *sb = blocks_super();
+    int count = stats.indexed;
+    int nblocks = bytes_to_blocks((count + 1) * sizeof(dedup_record_t));
+    int got;
+    int run = count > 0 ? alloc_block_run(sb->data_block, nblocks, &got) : -1;
+    if (run != -1 && got < nblocks) {
+        for (int ii = 0; ii < got; ii++) {
+            free_block(run + ii);
+        }
+        run = -1;
+    }
+
+    if (run != -1) {
+        blocks_zero(run, nblocks);
+        dedup_record_t *records = blocks_get_block(run);
+        int ii = 0;
+        for (int bnum = 0; bnum < BLOCK_COUNT; bnum++) {
+            if (entries[bnum].indexed) {
+                records[ii].key = entries[bnum].key;
+                records[ii].bnum = bnum;
+                ii += 1;
+            }
+        }
+        sb->dedup_block = run;
+        sb->dedup_blocks = nblocks;
+    }
+
+    free(entries);
+    free(buckets);
+    entries = 0;
+    buckets = 0;
+}
+
+// Copy the counters since the image was mounted
+void dedup_get_stats(dedup_stats_t *out) {
+    *out = stats;
+}
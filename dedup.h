@@ -0,0 +1,42 @@
+// Block-level deduplication of file data.
+//
+// When buffered data is flushed (see delalloc.h), each block is hashed
+// and looked up in an index of the data blocks written so far. A block
+// with the same contents gains an owner (see blocks_ref) instead of a new
+// block being allocated; writes to it later copy it like any other shared
+// block. Matches are always compared byte for byte, so a hash collision
+// only costs a missed share.
+//
+// The index lives in memory and is saved to the image on unmount; a
+// mount without dedup drops the saved index, as it would go stale.
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+
+// 128-bit hash of a block's contents
+typedef struct dedup_key {
+  uint64_t hash[2];
+} dedup_key_t;
+
+typedef struct dedup_stats {
+  uint64_t hashed;     // blocks hashed on flush
+  uint64_t shared;     // blocks that were shared instead of written
+  uint64_t collisions; // equal hashes with different contents
+  uint64_t indexed;    // blocks in the index now
+} dedup_stats_t;
+
+void dedup_set_enabled(int enabled);
+int dedup_enabled();
+void dedup_hash(const void *data, dedup_key_t *key);
+int dedup_lookup(const dedup_key_t *key, const void *data);
+int dedup_share(const dedup_key_t *key, const void *data);
+void dedup_insert(const dedup_key_t *key, int bnum);
+void dedup_move(int src, int dst);
+void dedup_forget(int bnum);
+void dedup_open();
+void dedup_close();
+void dedup_get_stats(dedup_stats_t *stats);
+
+#endif
@@ -0,0 +1,463 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defrag.h"
+#include "bitmap.h"
+#include "blocks.h"
+#include "checksum.h"
+#include "dedup.h"
+#include "inode.h"
+#include "storage.h"
+
+// How long the thread waits when there is nothing to move, and when a
+// request holds the storage
+#define DEFRAG_IDLE_MS 1000
+#define DEFRAG_BUSY_MS 10
+
+// Most inodes a step looks at, so the storage is never held for a walk
+// through the whole inode table
+#define DEFRAG_SCAN_INODES 256
+
+static int rate = 0;            // KB per second; 0 = no thread
+static int running = 0;
+static int stopping = 0;        // guarded by wait_lock
+static pthread_t thread;
+static pthread_mutex_t wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+
+static int cursor = 0;          // inode the last step worked on
+static int pass_moved = 0;      // whether this pass has joined anything
+static int settled = 0;         // the last pass found nothing to move
+static int packed_free = -1;    // free blocks when packing last found nothing
+static defrag_stats_t stats;
+
+// A file's data blocks, or its indirect block, and where they start, for
+// packing
+typedef struct placed_file {
+    int inum;
+    int start;                  // first data block, or the indirect block
+    int count;                  // data blocks, holes left out; 1 if indirect
+    int indirect;
+} placed_file_t;
+
+// A run of free blocks
+typedef struct free_run {
+    int start;
+    int len;
+    int longest;                // longest run up to and including this one
+} free_run_t;
+
+// Move at most this many KB per second; set before storage_init. 0 (the
+// default) leaves the thread off.
+void defrag_set_rate(int kb_per_sec) {
+    rate = kb_per_sec;
+}
+
+int defrag_rate() {
+    return rate;
+}
+
+// Number of data blocks of the given inode, if defrag may move them: only
+// blocks of uncompressed regular files that nothing else owns. 0 if not.
+static int movable_blocks(int inum) {
+    if (!bitmap_get(get_inode_bitmap(), inum)) {
+        return 0;
+    }
+    inode_t *node = get_inode(inum);
+    if (!S_ISREG(node->mode) || node->compressed != 0) {
+        return 0;
+    }
+
+    int count = 0;
+    int nblocks = bytes_to_blocks(node->size);
+    for (int ii = 0; ii < nblocks; ii++) {
+        int bnum = inode_get_bnum(node, ii);
+        if (bnum == 0) {
+            continue;
+        }
+        if (blocks_refs(bnum) != 1) {
+            return 0;
+        }
+        count++;
+    }
+    return count;
+}
+
+// Number of free blocks in a row from bnum on, counting up to limit
+static int free_run_at(int bnum, int limit) {
+    void *bbm = get_blocks_bitmap();
+    int len = 0;
+    while (len < limit && bnum + len < BLOCK_COUNT && !bitmap_get(bbm, bnum + len)) {
+        len++;
+    }
+    return len;
+}
+
+// Copy file block fb of the inode to the free block dst and let the old
+// block go. The checksum is copied rather than recomputed, so a damaged
+// block stays detectably damaged.
+static int move_block(inode_t *node, int fb, int dst) {
+    int src = inode_get_bnum(node, fb);
+    if (alloc_block_at(dst) == -1) {
+        return -1;
+    }
+    memcpy(blocks_get_block(dst), blocks_get_block(src), BLOCK_SIZE);
+    checksum_copy(dst, src);
+    if (inode_set_bnum(node, fb, dst) == -1) {
+        free_block(dst);
+        return -1;
+    }
+    dedup_move(src, dst);
+    free_block(src);
+    stats.moved += 1;
+    return 0;
+}
+
+// Copy the file's indirect block to the free block dst and let the old
+// one go
+static int move_indirect(inode_t *node, int dst) {
+    int src = node->indirect;
+    if (alloc_block_at(dst) == -1) {
+        return -1;
+    }
+    memcpy(blocks_get_block(dst), blocks_get_block(src), BLOCK_SIZE);
+    checksum_copy(dst, src);
+    node->indirect = dst;
+    free_block(src);
+    stats.moved += 1;
+    return 0;
+}
+
+// Move the file's data blocks from file block first on to consecutive
+// blocks from dst, at most budget of them. Returns the number moved; sets
+// done if that got the file to its end.
+static int move_run(int inum, int first, int dst, int budget, int *done) {
+    inode_t *node = get_inode(inum);
+    int nblocks = bytes_to_blocks(node->size);
+    int moved = 0;
+    int ii = first;
+    for (; ii < nblocks && moved < budget; ii++) {
+        int bnum = inode_get_bnum(node, ii);
+        if (bnum == 0) {
+            continue;
+        }
+        if (bnum != dst) {
+            if (move_block(node, ii, dst) == -1) {
+                break;
+            }
+            moved++;
+        }
+        dst++;
+    }
+    *done = ii == nblocks;
+    return moved;
+}
+
+// Bring a file that is in more than one run together. The blocks after
+// the first break move up behind the block before it if the space there
+// is free; otherwise the whole file moves to the first free run that
+// holds it. Returns the number of blocks moved.
+static int join_file(int inum, int budget) {
+    int count = movable_blocks(inum);
+    if (count == 0) {
+        return 0;
+    }
+
+    inode_t *node = get_inode(inum);
+    int nblocks = bytes_to_blocks(node->size);
+    int prev = 0;
+    int left = count;
+    int first = -1;
+    for (int ii = 0; ii < nblocks; ii++) {
+        int bnum = inode_get_bnum(node, ii);
+        if (bnum == 0) {
+            continue;
+        }
+        if (prev != 0 && bnum != prev + 1) {
+            first = ii;
+            break;
+        }
+        prev = bnum;
+        left--;
+    }
+    if (first == -1) {
+        return 0; // already in one run
+    }
+
+    int dst = prev + 1;
+    if (free_run_at(dst, left) < left) {
+        int got;
+        dst = blocks_find_run(blocks_super()->data_block, count, &got);
+        if (got < count) {
+            return 0; // no room until packing makes some
+        }
+        first = 0;
+    }
+
+    int done;
+    int moved = move_run(inum, first, dst, budget, &done);
+    stats.files_joined += done;
+    return moved;
+}
+
+static int by_start_down(const void *aa, const void *bb) {
+    const placed_file_t *a = aa;
+    const placed_file_t *b = bb;
+    return b->start - a->start;
+}
+
+// Move a whole file, or an indirect block, down into the lowest free run
+// that holds it, trying the ones that start highest first, so the free
+// space gathers at the end of the disk. Returns the number of blocks
+// moved.
+static int pack_file(int budget) {
+    int inodes = blocks_super()->inode_count;
+    placed_file_t *files = malloc(2 * inodes * sizeof(placed_file_t));
+    int nfiles = 0;
+    for (int inum = 0; inum < inodes; inum++) {
+        int count = movable_blocks(inum);
+        if (count > 0) {
+            inode_t *node = get_inode(inum);
+            int start = 0;
+            for (int ii = 0; start == 0; ii++) {
+                start = inode_get_bnum(node, ii);
+            }
+            files[nfiles++] = (placed_file_t) {inum, start, count, 0};
+            if (node->indirect != 0 && blocks_refs(node->indirect) == 1) {
+                files[nfiles++] = (placed_file_t) {inum, node->indirect, 1, 1};
+            }
+        }
+    }
+    qsort(files, nfiles, sizeof(placed_file_t), by_start_down);
+
+    // the free runs in disk order, each with the longest one up to it, so
+    // a file that fits no run below it is passed over quickly
+    int max_runs = (BLOCK_COUNT + 1) / 2;
+    free_run_t *runs = malloc(max_runs * sizeof(free_run_t));
+    int nruns = 0;
+    int longest = 0;
+    for (int bnum = blocks_super()->data_block; bnum < BLOCK_COUNT;) {
+        int len = free_run_at(bnum, BLOCK_COUNT);
+        if (len == 0) {
+            bnum++;
+            continue;
+        }
+        longest = len > longest ? len : longest;
+        runs[nruns++] = (free_run_t) {bnum, len, longest};
+        bnum += len;
+    }
+
+    int moved = 0;
+    for (int ii = 0; ii < nfiles && moved == 0; ii++) {
+        // runs[below - 1] is the last run that starts below the file
+        int below = 0;
+        for (int hi = nruns; below < hi;) {
+            int mid = (below + hi) / 2;
+            if (runs[mid].start < files[ii].start) {
+                below = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (below == 0 || runs[below - 1].longest < files[ii].count) {
+            continue;
+        }
+
+        int jj = 0;
+        while (runs[jj].len < files[ii].count) {
+            jj++;
+        }
+        if (files[ii].indirect) {
+            moved = move_indirect(get_inode(files[ii].inum), runs[jj].start) == 0;
+            continue;
+        }
+        int done;
+        moved = move_run(files[ii].inum, 0, runs[jj].start, budget, &done);
+        if (moved > 0) {
+            cursor = files[ii].inum; // the next step carries on with it
+            stats.files_packed += 1;
+        }
+    }
+
+    free(runs);
+    free(files);
+    return moved;
+}
+
+// Pack a file after a pass that joined nothing, unless the last try
+// found nothing to pack and no block was taken or let go since
+static int pack_after_pass(int budget) {
+    int moved = 0;
+    if (!pass_moved && blocks_free_count() != packed_free) {
+        moved = pack_file(budget);
+        packed_free = moved > 0 ? -1 : blocks_free_count();
+    }
+    settled = !pass_moved && moved == 0;
+    pass_moved = 0;
+    return moved;
+}
+
+// Do up to budget blocks of work, with the storage locked: carry on
+// joining files from where the last step left off, looking at no more
+// than DEFRAG_SCAN_INODES of them, and at the end of a pass that joined
+// nothing, pack one. Returns the number of blocks moved.
+int defrag_step(int budget) {
+    int inodes = blocks_super()->inode_count;
+    cursor = cursor < inodes ? cursor : 0;
+    for (int ii = 0; ii < DEFRAG_SCAN_INODES; ii++) {
+        int moved = join_file(cursor, budget);
+        if (moved > 0) {
+            pass_moved = 1;
+            settled = 0;
+            return moved;
+        }
+        cursor = (cursor + 1) % inodes;
+        if (cursor == 0) {
+            stats.passes += 1;
+            return pack_after_pass(budget);
+        }
+    }
+    return 0;
+}
+
+// Wait for the given time or until the thread is told to stop. Returns
+// 1 if it should stop.
+static int wait_ms(int ms) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += (long) (ms % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec += 1;
+        until.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&wait_lock);
+    if (!stopping) {
+        pthread_cond_timedwait(&wake, &wait_lock, &until);
+    }
+    int stop = stopping;
+    pthread_mutex_unlock(&wait_lock);
+    return stop;
+}
+
+static void *defrag_main(void *arg) {
+    // yield the CPU to requests without starving: a step holds the
+    // storage, so it must not wait behind every other thread to finish
+    struct sched_param param = {0};
+    pthread_setschedparam(pthread_self(), SCHED_BATCH, &param);
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+    // a step moves at most a second's worth, then waits out the time its
+    // blocks took from the budget
+    long rate_bytes = (long) rate * 1024;
+    long step_bytes = rate_bytes < DEFRAG_STEP_BYTES ? rate_bytes : DEFRAG_STEP_BYTES;
+    int budget = step_bytes / BLOCK_SIZE > 0 ? step_bytes / BLOCK_SIZE : 1;
+
+    int ms = 0;
+    while (!wait_ms(ms)) {
+        if (storage_trylock() == -1) {
+            ms = DEFRAG_BUSY_MS; // requests go first
+            continue;
+        }
+        int moved = defrag_step(budget);
+        storage_unlock();
+        if (moved > 0) {
+            ms = (long) moved * BLOCK_SIZE * 1000 / rate_bytes;
+        } else {
+            ms = settled ? DEFRAG_IDLE_MS : DEFRAG_BUSY_MS;
+        }
+    }
+    return 0;
+}
+
+// Start the background thread if a rate was set. Requests must hold the
+// storage lock from now on.
+void defrag_start() {
+    if (rate <= 0 || running) {
+        return;
+    }
+    memset(&stats, 0, sizeof(stats));
+    cursor = 0;
+    pass_moved = 0;
+    settled = 0;
+    packed_free = -1;
+    stopping = 0;
+    running = pthread_create(&thread, 0, defrag_main, 0) == 0;
+}
+
+// Stop the background thread, letting its current step finish. May be
+// called with the storage locked: the thread never waits for the lock.
+void defrag_stop() {
+    if (!running) {
+        return;
+    }
+    pthread_mutex_lock(&wait_lock);
+    stopping = 1;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&wait_lock);
+    pthread_join(thread, 0);
+    running = 0;
+}
+
+// Get the counters since the mount, and measure how fragmented the files
+// and the free space are now
+void defrag_get_stats(defrag_stats_t *out) {
+    *out = stats;
+    out->files = 0;
+    out->fragmented = 0;
+
+    long blocks = 0;
+    long breaks = 0;
+    void *ibm = get_inode_bitmap();
+    for (int inum = 0; inum < blocks_super()->inode_count; inum++) {
+        inode_t *node = get_inode(inum);
+        if (!bitmap_get(ibm, inum) || !S_ISREG(node->mode)) {
+            continue;
+        }
+        int nblocks = bytes_to_blocks(node->size);
+        int prev = 0;
+        int count = 0;
+        int runs = 0;
+        for (int ii = 0; ii < nblocks; ii++) {
+            int bnum = inode_get_bnum(node, ii);
+            if (bnum == 0) {
+                continue;
+            }
+            runs += prev == 0 || bnum != prev + 1;
+            prev = bnum;
+            count++;
+        }
+        if (count > 0) {
+            out->files += 1;
+            out->fragmented += runs > 1;
+            blocks += count;
+            breaks += runs - 1;
+        }
+    }
+    out->file_score = blocks > out->files ? 100 * breaks / (blocks - out->files) : 0;
+
+    long free = 0;
+    out->free_runs = 0;
+    out->largest_free = 0;
+    for (int bnum = blocks_super()->data_block; bnum < BLOCK_COUNT;) {
+        int len = free_run_at(bnum, BLOCK_COUNT);
+        if (len == 0) {
+            bnum++;
+            continue;
+        }
+        out->free_runs += 1;
+        out->largest_free = len > out->largest_free ? len : out->largest_free;
+        free += len;
+        bnum += len;
+    }
+    out->free_score = free > 0 ? 100 * (free - out->largest_free) / free : 0;
+}
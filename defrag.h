@@ -0,0 +1,51 @@
+// Online defragmentation.
+//
+// Create/unlink churn leaves files in many runs of blocks and the free
+// space in small holes. While mounted, a background thread moves the
+// blocks of each file that is in more than one run into a single run,
+// then moves whole files down into the lowest hole they fit, so the free
+// space collects in one run at the end of the disk.
+//
+// Only blocks owned by a single regular file are moved: compressed files,
+// and blocks shared by clones, snapshots or dedup, stay where they are.
+// The thread works in steps of at most DEFRAG_STEP_BYTES, each with the
+// storage locked (see storage_lock), so requests never see a block half
+// moved. A step carries on from the inode the last one stopped at and
+// looks at only a bounded number of them, so the lock is never held for a
+// walk through the whole inode table; files are packed once a pass has
+// found nothing to join. The thread runs at batch priority with nice 19,
+// skips a step when a request holds the lock, and paces its steps to the
+// given number of KB moved per second.
+
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include <stdint.h>
+
+// KB moved per second with a plain -o defrag
+#define DEFRAG_DEFAULT_RATE 4096
+
+// Most data moved with the storage locked at once
+#define DEFRAG_STEP_BYTES (256 * 1024)
+
+typedef struct defrag_stats {
+  uint64_t moved;        // blocks moved since the mount
+  uint64_t files_joined; // files brought together into one run
+  uint64_t files_packed; // files moved down into a hole
+  uint64_t passes;       // scans through the whole inode table
+  int files;             // regular files with data
+  int fragmented;        // files in more than one run
+  int file_score;        // % of file blocks that don't follow the one before
+  int free_runs;         // runs of free blocks
+  int largest_free;      // blocks in the longest free run
+  int free_score;        // % of free blocks outside the longest free run
+} defrag_stats_t;
+
+void defrag_set_rate(int kb_per_sec);
+int defrag_rate();
+int defrag_step(int budget);
+void defrag_start();
+void defrag_stop();
+void defrag_get_stats(defrag_stats_t *stats);
+
+#endif
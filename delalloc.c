@@ -0,0 +1,455 @@
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "delalloc.h"
+#include "bitmap.h"
+#include "inode.h"
+#include "blocks.h"
+#include "compress.h"
+#include "dedup.h"
+#include "checksum.h"
+#include "arena.h"
+
+// A buffered block of file data that has no disk block yet
+typedef struct dirty_block {
+    int file_bnum;              // block index within the file
+    char *data;                 // BLOCK_SIZE bytes
+} dirty_block_t;
+
+// All buffered blocks of one inode, sorted by file_bnum
+typedef struct dirty_file {
+    int inum;
+    int count;
+    int cap;
+    dirty_block_t *blocks;
+    struct dirty_file *next;
+} dirty_file_t;
+
+static dirty_file_t *dirty_files = 0;
+static int dirty_count = 0;     // buffered blocks across all files
+
+// Block buffers and file states given back by flushes, kept for the next
+// writes instead of going back to malloc. Little more than
+// DELALLOC_MAX_BYTES is ever buffered, so that many spare blocks do.
+#define SPARE_BLOCKS (DELALLOC_MAX_BYTES / NUFS_MIN_BLOCK_SIZE + 1)
+static char *spare_blocks[SPARE_BLOCKS];
+static int spare_count = 0;
+static dirty_file_t *spare_files = 0;
+
+// Get a zeroed block buffer
+static char *new_buffer() {
+    if (spare_count == 0) {
+        return calloc(1, BLOCK_SIZE);
+    }
+    char *data = spare_blocks[--spare_count];
+    memset(data, 0, BLOCK_SIZE);
+    return data;
+}
+
+static void free_buffer(char *data) {
+    if (spare_count < SPARE_BLOCKS) {
+        spare_blocks[spare_count++] = data;
+    } else {
+        free(data);
+    }
+}
+
+// Find the dirty state of the given inode, optionally creating it
+static dirty_file_t *find_file(int inum, int create) {
+    for (dirty_file_t *df = dirty_files; df != 0; df = df->next) {
+        if (df->inum == inum) {
+            return df;
+        }
+    }
+    if (!create) {
+        return 0;
+    }
+
+    dirty_file_t *df = spare_files;
+    if (df != 0) {
+        spare_files = df->next;
+    } else {
+        df = calloc(1, sizeof(dirty_file_t));
+    }
+    df->inum = inum;
+    df->next = dirty_files;
+    dirty_files = df;
+    return df;
+}
+
+// Unlink the dirty state of a file and keep it, with its block array, for
+// the next file to get dirty
+static void drop_file(dirty_file_t *df) {
+    dirty_file_t **link = &dirty_files;
+    while (*link != df) {
+        link = &(*link)->next;
+    }
+    *link = df->next;
+
+    for (int ii = 0; ii < df->count; ii++) {
+        free_buffer(df->blocks[ii].data);
+    }
+    dirty_count -= df->count;
+    df->count = 0;
+    df->next = spare_files;
+    spare_files = df;
+}
+
+// Index of the first buffered block with file_bnum >= the given one
+static int lower_bound(dirty_file_t *df, int file_bnum) {
+    int lo = 0;
+    int hi = df->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (df->blocks[mid].file_bnum < file_bnum) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Remove buffered blocks [from, to) of the file
+static void remove_range(dirty_file_t *df, int from, int to) {
+    for (int ii = from; ii < to; ii++) {
+        free_buffer(df->blocks[ii].data);
+    }
+    memmove(df->blocks + from, df->blocks + to,
+            (df->count - to) * sizeof(dirty_block_t));
+    df->count -= to - from;
+    dirty_count -= to - from;
+}
+
+// Flush the file with the most buffered blocks
+static void relieve_pressure() {
+    dirty_file_t *largest = dirty_files;
+    for (dirty_file_t *df = dirty_files; df != 0; df = df->next) {
+        if (df->count > largest->count) {
+            largest = df;
+        }
+    }
+    if (largest != 0) {
+        delalloc_flush(largest->inum);
+    }
+}
+
+// Buffer len bytes at offset within the given (unallocated) file block.
+// Returns -1 if there is not enough free space left to back the block later.
+int delalloc_write(int inum, int file_bnum, int offset, const char *buf, int len) {
+    assert(offset + len <= BLOCK_SIZE);
+    dirty_file_t *df = find_file(inum, 1);
+
+    int ii = lower_bound(df, file_bnum);
+    if (ii == df->count || df->blocks[ii].file_bnum != file_bnum) {
+        // every buffered block (plus an indirect block per file) must fit on disk
+        if (delalloc_reserved() + 1 > blocks_free_count()) {
+            if (df->count == 0) {
+                drop_file(df);
+            }
+            return -1;
+        }
+
+        if (df->count == df->cap) {
+            df->cap = df->cap ? df->cap * 2 : 16;
+            df->blocks = realloc(df->blocks, df->cap * sizeof(dirty_block_t));
+        }
+        memmove(df->blocks + ii + 1, df->blocks + ii,
+                (df->count - ii) * sizeof(dirty_block_t));
+        df->blocks[ii].file_bnum = file_bnum;
+        df->blocks[ii].data = new_buffer();
+        df->count += 1;
+        dirty_count += 1;
+    }
+
+    memcpy(df->blocks[ii].data + offset, buf, len);
+
+    if (dirty_count * BLOCK_SIZE > DELALLOC_MAX_BYTES) {
+        relieve_pressure();
+    }
+    return len;
+}
+
+// Copy len bytes at offset of the given file block out of the buffer.
+// Returns 0 if the block is not buffered (a real hole).
+int delalloc_read(int inum, int file_bnum, int offset, char *buf, int len) {
+    dirty_file_t *df = find_file(inum, 0);
+    if (df == 0) {
+        return 0;
+    }
+
+    int ii = lower_bound(df, file_bnum);
+    if (ii == df->count || df->blocks[ii].file_bnum != file_bnum) {
+        return 0;
+    }
+
+    memcpy(buf, df->blocks[ii].data + offset, len);
+    return 1;
+}
+
+// Number of disk blocks that buffered data will need once it is flushed.
+int delalloc_reserved() {
+    int reserved = dirty_count;
+    for (dirty_file_t *df = dirty_files; df != 0; df = df->next) {
+        reserved += 1; // room for an indirect block
+    }
+    return reserved;
+}
+
+// Store each cluster that has buffered blocks compressed when that saves
+// space, gathering the rest of the cluster from disk. The buffered blocks
+// of the clusters that were stored are dropped.
+static void compress_clusters(dirty_file_t *df, inode_t *node) {
+    int file_blocks = bytes_to_blocks(node->size);
+    char *data = arena_alloc(COMPRESS_CLUSTER_BLOCKS * BLOCK_SIZE);
+
+    int ii = 0;
+    while (ii < df->count) {
+        int cluster = df->blocks[ii].file_bnum / COMPRESS_CLUSTER_BLOCKS;
+        int first = cluster * COMPRESS_CLUSTER_BLOCKS;
+        int end = lower_bound(df, first + COMPRESS_CLUSTER_BLOCKS);
+        if (cluster >= COMPRESS_MAX_CLUSTERS) {
+            break;
+        }
+
+        // the cluster's data ends at the end of the file, or at its last
+        // buffered block while a write is still growing the file
+        int nblocks = df->blocks[end - 1].file_bnum + 1 - first;
+        if (file_blocks - first > nblocks) {
+            nblocks = file_blocks - first;
+        }
+        if (nblocks > COMPRESS_CLUSTER_BLOCKS) {
+            nblocks = COMPRESS_CLUSTER_BLOCKS;
+        }
+
+        // a damaged block on disk keeps its cluster plain, so it still
+        // fails its checksum instead of being compressed as it is
+        int jj = ii;
+        int damaged = 0;
+        for (int kk = 0; kk < nblocks; kk++) {
+            char *dst = data + kk * BLOCK_SIZE;
+            int bnum = inode_get_bnum(node, first + kk);
+            if (jj < end && df->blocks[jj].file_bnum == first + kk) {
+                memcpy(dst, df->blocks[jj++].data, BLOCK_SIZE);
+            } else if (bnum != 0) {
+                damaged |= checksum_verify(bnum) == -1;
+                memcpy(dst, blocks_get_block(bnum), BLOCK_SIZE);
+            } else {
+                memset(dst, 0, BLOCK_SIZE);
+            }
+        }
+
+        if (!damaged && compress_store(node, cluster, data, nblocks, end - ii)) {
+            remove_range(df, ii, end);
+        } else {
+            ii = end;
+        }
+    }
+    arena_free(data);
+}
+
+// Should the run of blocks [first, next) being placed end before block
+// next? It should if next can share a block already on disk, or repeats a
+// block of the run, which it can share once the run is placed.
+static int ends_run(dirty_file_t *df, dedup_key_t *keys, int first, int next) {
+    if (dedup_lookup(&keys[next], df->blocks[next].data) != 0) {
+        return 1;
+    }
+    for (int ii = first; ii < next; ii++) {
+        if (keys[ii].hash[0] == keys[next].hash[0] && keys[ii].hash[1] == keys[next].hash[1] &&
+            memcmp(df->blocks[ii].data, df->blocks[next].data, BLOCK_SIZE) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Give a file about to get blocks past its first an indirect block before
+// any of them is placed, so that inode_set_bnum doesn't take the block
+// right after the data and split the file. A file placing its first block
+// now gets it just before its data; one whose first block is already on
+// disk gets it at the far end of the free space that follows, where the
+// file reaches last. Returns -1 if the disk is full.
+static int reserve_indirect(dirty_file_t *df, inode_t *node) {
+    if (node->indirect != 0 || df->count == 0 ||
+        df->blocks[df->count - 1].file_bnum == 0) {
+        return 0;
+    }
+
+    int got;
+    int ind;
+    if (node->block == 0) {
+        ind = blocks_find_run(0, df->count + 1, &got);
+    }
+    else {
+        void *bbm = get_blocks_bitmap();
+        ind = node->block + 1;
+        while (ind + 1 < BLOCK_COUNT && !bitmap_get(bbm, ind + 1)) {
+            ind += 1;
+        }
+        if (ind >= BLOCK_COUNT || bitmap_get(bbm, ind)) {
+            ind = blocks_find_run(0, 1, &got);
+        }
+    }
+    if (ind == -1 || alloc_block_at(ind) == -1) {
+        return -1;
+    }
+    memset(blocks_get_block(ind), 0, BLOCK_SIZE);
+    node->indirect = ind;
+    return 0;
+}
+
+// Place the buffered blocks of the given inode on disk. Each run of
+// consecutive file blocks is allocated with one call to the allocator,
+// right after the block that precedes it in the file when possible. With
+// compression on, whole clusters are tried compressed first; with dedup
+// on, blocks whose contents are already on disk share that block.
+int delalloc_flush(int inum) {
+    dirty_file_t *df = find_file(inum, 0);
+    if (df == 0) {
+        return 0;
+    }
+    inode_t *node = get_inode(inum);
+    if (compress_enabled()) {
+        compress_clusters(df, node);
+    }
+    if (reserve_indirect(df, node) == -1) {
+        return -1;
+    }
+
+    dedup_key_t *keys = 0;
+    if (dedup_enabled()) {
+        keys = arena_alloc(df->count * sizeof(dedup_key_t));
+        for (int ii = 0; ii < df->count; ii++) {
+            dedup_hash(df->blocks[ii].data, &keys[ii]);
+        }
+    }
+
+    int ii = 0;
+    while (ii < df->count) {
+        if (keys != 0) {
+            int shared = dedup_share(&keys[ii], df->blocks[ii].data);
+            if (shared != 0) {
+                if (inode_set_bnum(node, df->blocks[ii].file_bnum, shared) == -1) {
+                    free_block(shared);
+                    break;
+                }
+                ii += 1;
+                continue;
+            }
+        }
+
+        int run_len = 1;
+        while (ii + run_len < df->count &&
+               df->blocks[ii + run_len].file_bnum == df->blocks[ii].file_bnum + run_len &&
+               (keys == 0 || !ends_run(df, keys, ii, ii + run_len))) {
+            run_len += 1;
+        }
+
+        int first = df->blocks[ii].file_bnum;
+        int prev = first > 0 ? inode_get_bnum(node, first - 1) : 0;
+        int got;
+        int bnum = alloc_block_run(prev != 0 ? prev + 1 : 0, run_len, &got);
+        if (bnum == -1) {
+            break;
+        }
+
+        int placed = 0;
+        while (placed < got) {
+            dirty_block_t *db = &df->blocks[ii + placed];
+            memcpy(blocks_get_block(bnum + placed), db->data, BLOCK_SIZE);
+            checksum_update(bnum + placed);
+            if (inode_set_bnum(node, db->file_bnum, bnum + placed) == -1) {
+                break;
+            }
+            if (keys != 0) {
+                dedup_insert(&keys[ii + placed], bnum + placed);
+            }
+            placed += 1;
+        }
+        for (int jj = placed; jj < got; jj++) {
+            free_block(bnum + jj);
+        }
+        ii += placed;
+        if (placed < got) {
+            break;
+        }
+    }
+    arena_free(keys);
+
+    // the blocks before ii are on disk; on failure the rest stay buffered
+    if (ii < df->count) {
+        remove_range(df, 0, ii);
+        return -1;
+    }
+    drop_file(df);
+    return 0;
+}
+
+// Flush every file with buffered data.
+int delalloc_flush_all() {
+    int rv = 0;
+    while (dirty_files != 0) {
+        if (delalloc_flush(dirty_files->inum) == -1) {
+            delalloc_forget(dirty_files->inum);
+            rv = -1;
+        }
+    }
+    return rv;
+}
+
+// Drop buffered data past the new size of the file.
+void delalloc_truncate(int inum, int size) {
+    dirty_file_t *df = find_file(inum, 0);
+    if (df == 0) {
+        return;
+    }
+
+    // zero the part of the new last block that is past the end
+    int rem = size % BLOCK_SIZE;
+    int ii = lower_bound(df, size / BLOCK_SIZE);
+    if (rem != 0 && ii < df->count && df->blocks[ii].file_bnum == size / BLOCK_SIZE) {
+        memset(df->blocks[ii].data + rem, 0, BLOCK_SIZE - rem);
+        ii += 1;
+    }
+
+    remove_range(df, ii, df->count);
+    if (df->count == 0) {
+        drop_file(df);
+    }
+}
+
+// Drop buffered blocks [first, first + count) of the file.
+void delalloc_punch(int inum, int first, int count) {
+    dirty_file_t *df = find_file(inum, 0);
+    if (df == 0) {
+        return;
+    }
+
+    remove_range(df, lower_bound(df, first), lower_bound(df, first + count));
+    if (df->count == 0) {
+        drop_file(df);
+    }
+}
+
+// Drop all buffered data of an inode that is being freed.
+void delalloc_forget(int inum) {
+    dirty_file_t *df = find_file(inum, 0);
+    if (df != 0) {
+        drop_file(df);
+    }
+}
+
+// Free the buffers kept for reuse; called when the image is closed.
+void delalloc_reset() {
+    while (spare_count > 0) {
+        free(spare_blocks[--spare_count]);
+    }
+    while (spare_files != 0) {
+        dirty_file_t *df = spare_files;
+        spare_files = df->next;
+        free(df->blocks);
+        free(df);
+    }
+}
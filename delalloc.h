@@ -0,0 +1,24 @@
+// Delayed allocation of file data blocks.
+//
+// Writes that land in a hole are buffered in memory per inode instead of
+// allocating a block straight away. Blocks are placed only when the file is
+// flushed (flush/fsync/release, unmount, or too much dirty data), which lets
+// a file written in many small appends end up in one contiguous run.
+
+#ifndef DELALLOC_H
+#define DELALLOC_H
+
+// Max bytes of dirty data buffered before the largest file is flushed.
+#define DELALLOC_MAX_BYTES (256 * 1024)
+
+int delalloc_write(int inum, int file_bnum, int offset, const char *buf, int len);
+int delalloc_read(int inum, int file_bnum, int offset, char *buf, int len);
+int delalloc_reserved();
+int delalloc_flush(int inum);
+int delalloc_flush_all();
+void delalloc_truncate(int inum, int size);
+void delalloc_punch(int inum, int first, int count);
+void delalloc_forget(int inum);
+void delalloc_reset();
+
+#endif
@@ -1,152 +1,595 @@
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
+#include "bitmap.h"
 #include "directory.h"
 #include "inode.h"
 #include "slist.h"
 
 // Initializes the root directory
 void directory_init() {
-    int inum = alloc_inode();
+    int inum = alloc_inode(-1);
     inode_t *inode = get_inode(inum);
     inode->mode = 040755;
 
-    directory_put(inode, ".", inum);
-    inode->refs = 1;
-    inode->nodes = 1;
+    directory_put(inode, ".", inum); // sets refs and nodes to 1
+}
+
+// In-memory free-space map of a directory: the free bytes (tail space plus
+// tombstones) of each of its blocks, so that an insert can pick a block
+// without reading every block header. Built from the headers on first use.
+typedef struct dir_fsm {
+    int inum;
+    int count;                  // number of directory blocks mapped
+    int *free;                  // free bytes per directory block
+    struct dir_fsm *next;
+} dir_fsm_t;
+
+#define FSM_BUCKETS 64
+static dir_fsm_t *fsm_buckets[FSM_BUCKETS];
+
+// Size of a record holding a name of the given length
+static int rec_size(int name_len) {
+    return (sizeof(dirent_t) + name_len + 1 + 3) & ~3;
+}
+
+// Number of blocks in the directory
+static int dir_blocks(inode_t *dd) {
+    return BLOCK_INDEX(dd->size);
+}
+
+// Header of the given directory block, or 0 if it has no disk block
+static dirblock_t *dir_block(inode_t *dd, int file_bnum) {
+    int bnum = inode_get_bnum(dd, file_bnum);
+    return bnum == 0 ? 0 : (dirblock_t *) blocks_get_block(bnum);
+}
+
+// Header of the given directory block, ready to be changed: a block still
+// shared with a snapshot is copied first. Returns 0 if there is no room
+// for the copy.
+static dirblock_t *dir_block_w(inode_t *dd, int file_bnum) {
+    int bnum = inode_cow_bnum(dd, file_bnum);
+    return bnum <= 0 ? 0 : (dirblock_t *) blocks_get_block(bnum);
+}
+
+// Offset just past the last record of the block
+static int block_end(dirblock_t *hdr) {
+    return hdr->end == 0 ? sizeof(dirblock_t) : hdr->end;
+}
+
+// Bytes a new record could use in the block, counting tombstones
+static int block_free(dirblock_t *hdr) {
+    return BLOCK_SIZE - block_end(hdr) + hdr->dead;
+}
+
+// Slide the live records of a block down over its tombstones
+static void compact_block(dirblock_t *hdr) {
+    char *base = (char *) hdr;
+    int end = block_end(hdr);
+    int to = sizeof(dirblock_t);
+
+    for (int from = sizeof(dirblock_t); from < end;) {
+        dirent_t *entry = (dirent_t *) (base + from);
+        int len = entry->rec_len;
+        if (!entry->dead) {
+            memmove(base + to, entry, len);
+            to += len;
+        }
+        from += len;
+    }
+
+    hdr->end = to;
+    hdr->dead = 0;
+}
+
+// Find (or build) the free-space map of the given directory
+static dir_fsm_t *get_fsm(inode_t *dd) {
+    int inum = inode_inum(dd);
+    dir_fsm_t **bucket = &fsm_buckets[inum % FSM_BUCKETS];
+
+    dir_fsm_t *fsm = *bucket;
+    while (fsm != 0 && fsm->inum != inum) {
+        fsm = fsm->next;
+    }
+    if (fsm == 0) {
+        fsm = calloc(1, sizeof(dir_fsm_t));
+        fsm->inum = inum;
+        fsm->next = *bucket;
+        *bucket = fsm;
+    }
+
+    // (re)build the map if the directory changed size behind our back
+    if (fsm->count != dir_blocks(dd)) {
+        fsm->count = dir_blocks(dd);
+        fsm->free = realloc(fsm->free, (fsm->count + 1) * sizeof(int));
+        for (int ii = 0; ii < fsm->count; ii++) {
+            dirblock_t *hdr = dir_block(dd, ii);
+            fsm->free[ii] = hdr == 0 ? 0 : block_free(hdr);
+        }
+    }
+    return fsm;
+}
+
+// Drop the free-space map of a directory that is being freed
+void directory_forget(int inum) {
+    dir_fsm_t **link = &fsm_buckets[inum % FSM_BUCKETS];
+    while (*link != 0) {
+        dir_fsm_t *fsm = *link;
+        if (fsm->inum == inum) {
+            *link = fsm->next;
+            free(fsm->free);
+            free(fsm);
+            return;
+        }
+        link = &fsm->next;
+    }
+}
+
+// Find the next live entry at or after pos, skipping tombstones, holes
+// and damaged blocks
+static dirent_t *scan_from(inode_t *dd, dir_pos_t *pos) {
+    int count = dir_blocks(dd);
+    while (pos->file_bnum < count) {
+        dirblock_t *hdr = dir_block(dd, pos->file_bnum);
+        int end = hdr == 0 ? 0 : block_end(hdr);
+        if (end > BLOCK_SIZE) {
+            end = 0;
+        }
+
+        while (pos->offset + (int) sizeof(dirent_t) <= end) {
+            dirent_t *entry = (dirent_t *) ((char *) hdr + pos->offset);
+            if (entry->rec_len < sizeof(dirent_t) || pos->offset + entry->rec_len > end) {
+                break;
+            }
+            if (!entry->dead) {
+                return entry;
+            }
+            pos->offset += entry->rec_len;
+        }
+
+        pos->file_bnum += 1;
+        pos->offset = sizeof(dirblock_t);
+    }
+    return 0;
+}
+
+// Return the first live entry of the directory, or 0 if it is empty
+dirent_t *directory_first(inode_t *dd, dir_pos_t *pos) {
+    pos->file_bnum = 0;
+    pos->offset = sizeof(dirblock_t);
+    return scan_from(dd, pos);
+}
+
+// Return the live entry after the one at pos, or 0 at the end
+dirent_t *directory_next(inode_t *dd, dir_pos_t *pos) {
+    dirblock_t *hdr = dir_block(dd, pos->file_bnum);
+    dirent_t *entry = (dirent_t *) ((char *) hdr + pos->offset);
+    pos->offset += entry->rec_len;
+    return scan_from(dd, pos);
+}
+
+// Find the entry with the given name, leaving its position in pos
+static dirent_t *find_entry(inode_t *dd, const char *name, dir_pos_t *pos) {
+    int len = strlen(name);
+    for (dirent_t *entry = directory_first(dd, pos); entry != 0;
+         entry = directory_next(dd, pos)) {
+        if (entry->name_len == len && memcmp(entry->name, name, len) == 0) {
+            return entry;
+        }
+    }
+    return 0;
 }
 
 // Finds the file with the given name in the given directory
 int directory_lookup(inode_t *dd, const char *name) {
-    dirent_t *block = (dirent_t *) blocks_get_block(dd->block);
+    // "." and ".." come straight from the inode
+    if (strcmp(name, ".") == 0) {
+        return inode_inum(dd);
+    }
+    if (strcmp(name, "..") == 0) {
+        return dd->parent;
+    }
+
+    dir_pos_t pos;
+    dirent_t *entry = find_entry(dd, name, &pos);
+    return entry == 0 ? -1 : entry->inum;
+}
 
-    // Iterate through the nodes in this directory
-    dirent_t *curr_dirent = block;
-    int curr_i = 0;
-    while (curr_i < dd->nodes) {
-        curr_dirent = block + curr_i;
-        if (strcmp(curr_dirent->name, name) == 0) {
-            return curr_dirent->inum;
+// Follows the components of path that come before stop, starting at the
+// root directory. Returns the inum reached, or -1.
+static int walk_path(const char *path, const char *stop) {
+    char name[DIR_NAME_LENGTH + 1];
+    int inum = 0;
+
+    const char *cur = path;
+    while (cur < stop) {
+        if (*cur == '/') {
+            cur++;
+            continue;
+        }
+        const char *end = cur;
+        while (end < stop && *end != '/') {
+            end++;
+        }
+        int len = end - cur;
+        inode_t *dd = get_inode(inum);
+        if (len > DIR_NAME_LENGTH || !S_ISDIR(dd->mode)) {
+            return -1;
         }
-        curr_i += 1;
-    }
 
-    return -1;
+        memcpy(name, cur, len);
+        name[len] = '\0';
+        inum = directory_lookup(dd, name);
+        if (inum == -1) {
+            return -1;
+        }
+        cur = end;
+    }
+    return inum;
 }
 
 // Gets the inum at the given path.
 int path_lookup(const char *path) {
-    if (strcmp("/", path) == 0) {
-        return 0;
-    }
-
-    // Iterate through the path, looking up each directory
-    int curr_dir_inum = 0;
-    slist_t *head = slist_explode(path + 1, '/');
-    slist_t *cur = head;
-    while (cur != NULL) {
-        inode_t *curr_dir_inode = get_inode(curr_dir_inum);
-        curr_dir_inum = directory_lookup(curr_dir_inode, cur->data);
-        if (curr_dir_inum == -1) {
-            slist_free(head);
+    return walk_path(path, path + strlen(path));
+}
+
+// Gets the inum of the directory holding the last component of the path,
+// and points name at that component.
+int path_lookup_parent(const char *path, const char **name) {
+    const char *last = strrchr(path, '/');
+    if (last == 0 || last[1] == '\0') {
+        return -1;
+    }
+
+    int inum = walk_path(path, last);
+    if (inum == -1 || !S_ISDIR(get_inode(inum)->mode)) {
+        return -1;
+    }
+    *name = last + 1;
+    return inum;
+}
+
+// Finds the entry naming inum, trying the hinted block first
+static dirent_t *find_inum(inode_t *dd, int inum, int hint) {
+    dir_pos_t pos = { hint, sizeof(dirblock_t) };
+    for (dirent_t *entry = hint < 0 ? 0 : scan_from(dd, &pos);
+         entry != 0 && pos.file_bnum == hint; entry = directory_next(dd, &pos)) {
+        if (entry->inum == inum) {
+            return entry;
+        }
+    }
+
+    for (dirent_t *entry = directory_first(dd, &pos); entry != 0;
+         entry = directory_next(dd, &pos)) {
+        if (entry->inum == inum && strcmp(entry->name, ".") != 0 &&
+            strcmp(entry->name, "..") != 0) {
+            return entry;
+        }
+    }
+    return 0;
+}
+
+// Writes the path of the inode into buf by following parent pointers up to
+// the root. Returns -ENOENT if the inode can't be placed, -ENAMETOOLONG if
+// buf is too small.
+int directory_path(int inum, char *buf, size_t size) {
+    int count = blocks_super()->inode_count;
+    if (inum < 0 || inum >= count) {
+        return -ENOENT;
+    }
+    if (size < 2) {
+        return -ENAMETOOLONG;
+    }
+
+    // the path is built backwards from the end of buf
+    int at = size - 1;
+    buf[at] = '\0';
+    for (int depth = 0; inum != 0; depth++) {
+        inode_t *node = get_inode(inum);
+        int parent = node->parent;
+        if (depth >= count || parent < 0 || parent >= count) {
+            return -ENOENT; // a loop or a damaged pointer
+        }
+
+        dirent_t *entry = find_inum(get_inode(parent), inum, node->parent_blk);
+        if (entry == 0) {
+            return -ENOENT;
+        }
+        if (entry->name_len + 1 > at) {
+            return -ENAMETOOLONG;
+        }
+        at -= entry->name_len;
+        memcpy(buf + at, entry->name, entry->name_len);
+        buf[--at] = '/';
+        inum = parent;
+    }
+
+    if (buf[at] == '\0') {
+        buf[--at] = '/'; // the root itself
+    }
+    memmove(buf, buf + at, size - at);
+    return 0;
+}
+
+// Appends a record for name to the directory, growing it by a block if no
+// block has room. Leaves refs and nodes alone. Returns the directory block
+// the record went into.
+static int insert_entry(inode_t *dd, const char *name, int inum) {
+    int len = strlen(name);
+    if (len == 0 || len > DIR_NAME_LENGTH) {
+        return -1;
+    }
+    int need = rec_size(len);
+
+    // Pick the first block with room, according to the free-space map
+    dir_fsm_t *fsm = get_fsm(dd);
+    dirblock_t *hdr = 0;
+    int ii;
+    for (ii = 0; ii < fsm->count; ii++) {
+        if (fsm->free[ii] < need || (hdr = dir_block(dd, ii)) == 0) {
+            continue;
+        }
+        if ((hdr = dir_block_w(dd, ii)) == 0) {
             return -1;
         }
+        if (BLOCK_SIZE - block_end(hdr) < need) {
+            compact_block(hdr); // the room is in tombstones; reclaim it
+        }
+        if (BLOCK_SIZE - block_end(hdr) >= need) {
+            break;
+        }
+        fsm->free[ii] = block_free(hdr); // stale map entry
+    }
 
-        cur = cur->next;
+    // Otherwise the directory grows by a block
+    if (ii == fsm->count) {
+        if (ii >= inode_max_size() / BLOCK_SIZE || inode_alloc_bnum(dd, ii) == -1) {
+            return -1;
+        }
+        hdr = dir_block(dd, ii);
+        hdr->end = sizeof(dirblock_t);
+        dd->size += BLOCK_SIZE;
+        fsm->count += 1;
+        fsm->free = realloc(fsm->free, (fsm->count + 1) * sizeof(int));
     }
 
-    slist_free(head);
-    return curr_dir_inum;
+    // Append the record to the block
+    int end = block_end(hdr);
+    dirent_t *new_entry = (dirent_t *) ((char *) hdr + end);
+    new_entry->inum = inum;
+    new_entry->rec_len = need;
+    new_entry->name_len = len;
+    new_entry->dead = 0;
+    memcpy(new_entry->name, name, len + 1);
+    hdr->end = end + need;
+    hdr->live += 1;
+    fsm->free[ii] = block_free(hdr);
+
+    return ii;
 }
 
 // Creates a new directory entry in the given directory with the given name and inum.
 int directory_put(inode_t *dd, const char *name, int inum) {
-    if (dd->nodes == BLOCK_SIZE / sizeof(dirent_t)) {
+    int file_bnum = insert_entry(dd, name, inum);
+    if (file_bnum == -1) {
         return -1;
     }
 
-    inode_t *entry_node = get_inode(inum);
+    // Update the directory inode; refs counts the entries naming an inode
+    dd->nodes += 1;
+    // the parent pointer follows the first name; an extra hard link to a
+    // file doesn't move it
+    inode_t *node = get_inode(inum);
+    node->refs += 1;
+    bool first = node->refs == 1 || S_ISDIR(node->mode);
+    if (first && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+        node->parent = inode_inum(dd);
+        node->parent_blk = file_bnum;
+    }
+
+    return 0;
+}
 
-    // Update the directory data block
-    dirent_t *block = (dirent_t *) blocks_get_block(dd->block);
-    dirent_t *new_entry = block + dd->nodes;
-    strcpy(new_entry->name, name);
-    new_entry->inum = inum;
+// Removes the entry at pos from the directory, leaving refs alone. The
+// record becomes a tombstone; a block that is mostly dead is compacted.
+// Returns -1 if the block is shared and there is no room to copy it.
+int directory_remove(inode_t *dd, dir_pos_t *pos) {
+    dirblock_t *hdr = dir_block_w(dd, pos->file_bnum);
+    if (hdr == 0) {
+        return -1;
+    }
+    dirent_t *entry = (dirent_t *) ((char *) hdr + pos->offset);
 
-    // Update the directory inode
-    if (entry_node->nodes > 0) {  
-        dd->refs += 1;
+    entry->dead = 1;
+    hdr->live -= 1;
+    if (pos->offset + entry->rec_len == block_end(hdr)) {
+        hdr->end = pos->offset; // last record; just give the space back
+    } else {
+        hdr->dead += entry->rec_len;
+    }
+
+    if (hdr->live == 0) {
+        hdr->end = sizeof(dirblock_t);
+        hdr->dead = 0;
+    } else if (hdr->dead > BLOCK_SIZE / 2) {
+        compact_block(hdr);
     }
-    dd->size += sizeof(dirent_t);
-    dd->nodes += 1;
-    entry_node->refs += 1;
 
+    dir_fsm_t *fsm = get_fsm(dd);
+    fsm->free[pos->file_bnum] = block_free(hdr);
+    dd->nodes -= 1;
     return 0;
 }
 
+// Drops one reference to the inode, freeing it once nothing names it.
+// A directory whose only remaining entry is its own "." is gone, along
+// with its ".." reference.
+static void release_inode(int inum) {
+    inode_t *node = get_inode(inum);
+    node->refs -= 1;
+    if (node->nodes > 0 && node->refs <= 1) { 
+        int parent = node->parent;
+        if (parent != inum) {
+            get_inode(parent)->refs -= 1;
+        }
+        directory_forget(inum);
+        free_inode(inum); // also frees the inode's data blocks
+    }
+    else if (node->nodes == 0 && node->refs == 0) { 
+        free_inode(inum); // also frees the inode's data blocks
+    }
+}
+
+// After an entry of dd naming the inode was removed, points the parent
+// pointer at a name that is left if it pointed at the one that went. Only
+// a file with another hard link can get here, so finding the name left
+// means looking through every directory.
+static void repoint_parent(inode_t *dd, int inum) {
+    void *ibm = get_inode_bitmap();
+    inode_t *node = get_inode(inum);
+    if (!bitmap_get(ibm, inum) || node->refs == 0 ||
+        node->parent != inode_inum(dd) || find_inum(dd, inum, node->parent_blk) != 0) {
+        return;
+    }
+
+    for (int dir = 0; dir < blocks_super()->inode_count; dir++) {
+        inode_t *other = get_inode(dir);
+        if (!bitmap_get(ibm, dir) || !S_ISDIR(other->mode)) {
+            continue;
+        }
+        dir_pos_t pos;
+        for (dirent_t *entry = directory_first(other, &pos); entry != 0;
+             entry = directory_next(other, &pos)) {
+            if (entry->inum == inum) {
+                node->parent = dir;
+                node->parent_blk = pos.file_bnum;
+                return;
+            }
+        }
+    }
+}
+
 // Deletes the inode with the given name from the given directory.
 int directory_delete(inode_t *dd, const char *name) {
-    dirent_t *dir = (dirent_t *) blocks_get_block(dd->block);
-    dirent_t *curr_dirent = dir;
-
-    // Iterate through the nodes in this directory
-    int curr_i = 0;
-    while (curr_i < dd->nodes) {
-        curr_dirent = dir + curr_i;
-        if (strcmp(curr_dirent->name, name) == 0) {
-            int entry_inum = curr_dirent->inum;
-
-            // Update directory data block
-            if (curr_i < dd->nodes - 1) {
-                dirent_t *next_entry = curr_dirent + 1;
-                int num_nodes = dd->nodes - curr_i - 1;
-                memmove(curr_dirent, next_entry, num_nodes * sizeof(dirent_t));
-            }
+    dir_pos_t pos;
+    dirent_t *entry = find_entry(dd, name, &pos);
+    if (entry == 0) {
+        return -1;
+    }
 
-            // Update directory inode
-            inode_t *entry_inode = get_inode(entry_inum);
-            if (entry_inode->nodes > 0) {  
-                dd->refs -= 1;
-            }
-            dd->size -= sizeof(dirent_t);
-            dd->nodes -= 1;
+    int entry_inum = entry->inum;
+    if (directory_remove(dd, &pos) == -1) {
+        return -1;
+    }
+    release_inode(entry_inum);
+    repoint_parent(dd, entry_inum);
 
-            // Update entry inode
-            entry_inode->refs -= 1;
-            if (entry_inode->nodes > 0 && entry_inode->refs <= 1) { 
-                free_block(entry_inode->block);
-            }
-            else if (entry_inode->nodes == 0 && entry_inode->refs == 0) { 
-                free_inode(entry_inum);
-                free_block(entry_inode->block);
-            }
+    return 0;
+}
+
+// Moves the entry from_name of from_dd to to_name in to_dd, replacing
+// whatever to_name named before. The caller has checked that replacing
+// the target is allowed. The moved inode keeps its reference count; a
+// moved directory has its ".." pointed at the new parent.
+int directory_rename(inode_t *from_dd, const char *from_name,
+                     inode_t *to_dd, const char *to_name) {
+    dir_pos_t pos;
+    dirent_t *entry = find_entry(from_dd, from_name, &pos);
+    if (entry == 0) {
+        return -1;
+    }
+    int inum = entry->inum;
+    int len = strlen(to_name);
+    if (len == 0 || len > DIR_NAME_LENGTH) {
+        return -1;
+    }
+
+    dir_pos_t to_pos;
+    dirent_t *target = find_entry(to_dd, to_name, &to_pos);
+    if (target != 0 && target->inum == inum) {
+        return 0; // both names already refer to the same inode
+    }
+
+    // Copy any of the blocks about to change that a snapshot still shares
+    // before changing anything; copying alone changes nothing visible.
+    inode_t *node = get_inode(inum);
+    bool moves_dir = from_dd != to_dd && node->nodes > 0;
+    dir_pos_t dotdot_pos;
+    if (dir_block_w(from_dd, pos.file_bnum) == 0 ||
+        (target != 0 && dir_block_w(to_dd, to_pos.file_bnum) == 0) ||
+        (moves_dir && find_entry(node, "..", &dotdot_pos) != 0 &&
+         dir_block_w(node, dotdot_pos.file_bnum) == 0)) {
+        return -1;
+    }
+    entry = (dirent_t *) ((char *) dir_block(from_dd, pos.file_bnum) + pos.offset);
+
+    int old_inum = -1;
+    int file_bnum = pos.file_bnum;
+    if (target != 0) {
+        // Overwrite: repoint the target's record, then drop the source's
+        target = (dirent_t *) ((char *) dir_block(to_dd, to_pos.file_bnum) + to_pos.offset);
+        old_inum = target->inum;
+        target->inum = inum;
+        file_bnum = to_pos.file_bnum;
+        directory_remove(from_dd, &pos);
+    }
+    else if (from_dd == to_dd && rec_size(len) <= entry->rec_len) {
+        // Same directory and the new name fits: rewrite the record in place
+        entry->name_len = len;
+        memcpy(entry->name, to_name, len + 1);
+    }
+    else {
+        // Add the new record first so a full directory loses nothing. The
+        // insert may compact a block of from_dd, so find the source again.
+        file_bnum = insert_entry(to_dd, to_name, inum);
+        if (file_bnum == -1) {
+            return -1;
+        }
+        to_dd->nodes += 1;
+        find_entry(from_dd, from_name, &pos);
+        directory_remove(from_dd, &pos);
+    }
 
-            return 0;
+    // A directory moving to a new parent takes its ".." reference along
+    node->parent = inode_inum(to_dd);
+    node->parent_blk = file_bnum;
+    if (moves_dir) {
+        dirent_t *dotdot = find_entry(node, "..", &dotdot_pos);
+        if (dotdot != 0) {
+            dotdot->inum = inode_inum(to_dd);
+            from_dd->refs -= 1;
+            to_dd->refs += 1;
         }
-        curr_i += 1;
     }
 
-    return -1;
+    if (old_inum != -1) {
+        release_inode(old_inum);
+        repoint_parent(to_dd, old_inum);
+    }
+    return 0;
 }
 
 // Lists the contents of the directory specified by the given path.
 slist_t *directory_list(const char *path) {
     int inum = path_lookup(path);
     assert(inum >= 0);
+    return directory_list_inum(inum);
+}
+
+// Lists the contents of the directory with the given inum.
+slist_t *directory_list_inum(int inum) {
     inode_t *inode = get_inode(inum);
-    dirent_t *block = (dirent_t *) blocks_get_block(inode->block);
 
-    dirent_t *curr_dirent = block;
     slist_t *list = 0;
-
-    int curr_i = 0;
-    while (curr_i < inode->nodes) {
-        curr_dirent = block + curr_i;
-        list = slist_cons(curr_dirent->name, list);
-        curr_i += 1;
+    dir_pos_t pos;
+    for (dirent_t *entry = directory_first(inode, &pos); entry != 0;
+         entry = directory_next(inode, &pos)) {
+        list = slist_cons(entry->name, list);
     }
 
     return list;
-}
\ No newline at end of file
+}
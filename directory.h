@@ -7,25 +7,58 @@
 #ifndef DIRECTORY_H
 #define DIRECTORY_H
 
-#define DIR_NAME_LENGTH 48
+#define DIR_NAME_LENGTH 255
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "blocks.h"
 #include "inode.h"
 #include "slist.h"
 
-// dirent_t size: 52 bytes
+// Directories are stored as slotted blocks. Each block starts with a
+// dirblock_t header followed by variable-length dirent_t records packed
+// back to back. Removed records become tombstones that are skipped, and a
+// block is compacted in place once enough of it is dead or when its dead
+// space is needed for a new record.
+
+// dirblock_t size: 12 bytes
+typedef struct dirblock {
+  uint32_t end;               // offset just past the last record (0 = empty)
+  uint32_t dead;              // bytes held by tombstones
+  uint32_t live;              // number of live records
+} dirblock_t;
+
+// dirent_t size: 8 bytes + name, rounded up to 4 bytes
 typedef struct dirent {
-  char name[DIR_NAME_LENGTH]; // name of entry
   int inum;                   // inum for entry
+  uint16_t rec_len;           // bytes from this record to the next one
+  uint8_t name_len;           // length of the name, without the NUL
+  uint8_t dead;               // 1 if the record has been removed
+  char name[];                // NUL-terminated name of entry
 } dirent_t;
 
+// Position of an entry while iterating over a directory
+typedef struct dir_pos {
+  int file_bnum;              // directory block
+  int offset;                 // offset of the record within the block
+} dir_pos_t;
+
 void directory_init();
 int directory_lookup(inode_t *dd, const char *name);
 int path_lookup(const char *path);
+int path_lookup_parent(const char *path, const char **name);
+int directory_path(int inum, char *buf, size_t size);
 int directory_put(inode_t *dd, const char *name, int inum);
 int directory_delete(inode_t *dd, const char *name);
+int directory_rename(inode_t *from_dd, const char *from_name,
+                     inode_t *to_dd, const char *to_name);
 slist_t *directory_list(const char *path);
+slist_t *directory_list_inum(int inum);
+dirent_t *directory_first(inode_t *dd, dir_pos_t *pos);
+dirent_t *directory_next(inode_t *dd, dir_pos_t *pos);
+int directory_remove(inode_t *dd, dir_pos_t *pos);
+void directory_forget(int inum);
 
 #endif
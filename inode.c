@@ -1,12 +1,20 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "inode.h"
 #include "bitmap.h"
+#include "delalloc.h"
+#include "checksum.h"
 
-const int NUM_INODES = 256; // number of inodes in file system (default = 256)
-const int INODE_BLOCK = 1; // block where inodes begin
+const int NUM_INODES = 256; // number of inodes in a newly formatted file system
+
+// In-memory holds on inodes (see inode_pin), and the inodes whose last
+// name went away while they were held
+static int *pins = 0;
+static uint8_t *doomed = 0;
 
 // Prints inode information
 void print_inode(inode_t *node) {
@@ -15,44 +23,380 @@ void print_inode(inode_t *node) {
     printf("size: %d\n", node->size);
     printf("block: %d\n", node->block);
     printf("nodes: %d\n", node->nodes);
+    printf("indirect: %d\n", node->indirect);
+    printf("parent: %d\n", node->parent);
 }
 
-// Return pointer to inode at given inum
+// Return pointer to inode at given inum. The table is contiguous and records
+// never straddle a block, since the block size is a multiple of 64.
 inode_t *get_inode(int inum) {
-    assert(inum < NUM_INODES);
-    inode_t *inodes = (inode_t *) blocks_get_block(INODE_BLOCK);
+    assert(inum < blocks_super()->inode_count);
+    inode_t *inodes = (inode_t *) blocks_get_block(blocks_super()->inode_block);
     return inodes + inum;
 }
 
-// Return inum of newly allocated inode.
-int alloc_inode() {
-    // iterate inode bitmap to find first unused inode
-    for (int ind = 0; ind < NUM_INODES; ind++) {
-        if (bitmap_get(get_inode_bitmap(), ind) == 0) { // unused inode found
-            bitmap_put(get_inode_bitmap(), ind, 1); // set bitmap bit to 1 to mark as used
-            inode_t *inode = get_inode(ind); 
-            memset(inode, 0, sizeof(inode_t)); // write inode bytes to 0
-
-            // update inode information
-            inode->refs = 0; 
-            inode->mode = 0100644; // Regular file with read/write permissions for user
-            inode->size = 0;
-            inode->block = alloc_block(); // allocate block for inode data
-            inode->nodes = 0; 
+// Return the inum of the given inode.
+int inode_inum(inode_t *node) {
+    return node - (inode_t *) blocks_get_block(blocks_super()->inode_block);
+}
 
+// Find a free inode in [from, to) of the inode bitmap, skipping full bytes.
+static int find_free_inode(uint8_t *ibm, int from, int to) {
+    int ind = from;
+    while (ind < to) {
+        if (ind % 8 == 0 && ibm[ind / 8] == 0xff) { // 8 used inodes in a row
+            ind += 8;
+            continue;
+        }
+        if (bitmap_get(ibm, ind) == 0) {
             return ind;
         }
+        ind++;
     }
-
     return -1;
 }
 
+// Return inum of newly allocated inode. The search starts in the inode
+// table block that holds the parent, so that a directory and its entries
+// tend to share table blocks; pass -1 for no parent.
+int alloc_inode(int parent_inum) {
+    uint8_t *ibm = get_inode_bitmap();
+    int count = blocks_super()->inode_count;
+
+    int goal = 0;
+    if (parent_inum > 0) {
+        goal = parent_inum - parent_inum % INODES_PER_BLOCK;
+    }
+
+    // search from the parent's table block to the end, then wrap around
+    int ind = find_free_inode(ibm, goal, count);
+    if (ind == -1) {
+        ind = find_free_inode(ibm, 0, goal);
+    }
+    if (ind == -1) {
+        return -1;
+    }
+
+    bitmap_put(ibm, ind, 1); // set bitmap bit to 1 to mark as used
+    blocks_super()->free_inodes -= 1;
+    inode_t *inode = get_inode(ind); 
+    memset(inode, 0, sizeof(inode_t)); // write inode bytes to 0
+
+    // update inode information; data blocks are allocated on first write
+    inode->refs = 0; 
+    inode->mode = 0100644; // Regular file with read/write permissions for user
+    inode->size = 0;
+    inode->block = 0;
+    inode->nodes = 0; 
+    inode->indirect = 0;
+    inode->parent = parent_inum < 0 ? ind : parent_inum; // the root is its own parent
+
+    return ind;
+}
+
+// Keep the inode with given inum alive while something outside the
+// tree (the kernel, through the low-level driver) can still reach it: if
+// its last name is removed, freeing it waits for inode_unpin.
+void inode_pin(int inum) {
+    if (pins == 0) {
+        pins = calloc(blocks_super()->inode_count, sizeof(int));
+        doomed = calloc(blocks_super()->inode_count, 1);
+    }
+    pins[inum] += 1;
+}
+
+// Drop a hold on the inode with given inum, freeing it if it was unlinked
+// while held.
+void inode_unpin(int inum) {
+    assert(pins != 0 && pins[inum] > 0);
+    pins[inum] -= 1;
+    if (pins[inum] == 0 && doomed[inum]) {
+        doomed[inum] = 0;
+        free_inode(inum);
+    }
+}
+
 // Free inode at given inum.
 void free_inode(int inum) {
+    if (pins != 0 && pins[inum] > 0) {
+        doomed[inum] = 1; // still open: the last inode_unpin frees it
+        return;
+    }
+
     bitmap_put(get_inode_bitmap(), inum, 0); // set bitmap bit to 0 to mark as free
+    blocks_super()->free_inodes += 1;
 
     inode_t* inode = get_inode(inum);
-    free_block(inode->block); // deallocate data block
+    delalloc_forget(inum); // drop buffered data that never got a block
+    inode_release_blocks(inode); // deallocate all data blocks
 
     memset(inode, 0, sizeof(inode_t)); // write inode bytes to 0
 }
+
+// Largest file size that the direct + single indirect block can map.
+int inode_max_size() {
+    return (1 + BLOCK_SIZE / sizeof(int)) * BLOCK_SIZE;
+}
+
+// Grow inode to the given size. The new range is a hole, so nothing is
+// allocated or zeroed here.
+int grow_inode(inode_t *node, int size) {
+    if (size > inode_max_size()) {
+        return -1;
+    }
+
+    if (size > node->size) {
+        node->size = size;
+    }
+    return 0;
+}
+
+// Drop this inode's hold on all of its blocks: the direct block, the
+// blocks the indirect block maps, and the indirect block itself. Nothing
+// is written to the indirect block, which a snapshot may still share.
+void inode_release_blocks(inode_t *node) {
+    if (node->block != 0) {
+        free_block(node->block);
+        node->block = 0;
+    }
+
+    if (node->indirect != 0) {
+        int *ptrs = (int *) blocks_get_block(node->indirect);
+        for (int ii = 0; ii < BLOCK_SIZE / sizeof(int); ii++) {
+            if (ptrs[ii] != 0) {
+                free_block(ptrs[ii]);
+            }
+        }
+        free_block(node->indirect);
+        node->indirect = 0;
+    }
+}
+
+// Make sure the indirect block belongs to this inode alone before its
+// block numbers change; one still shared with a snapshot or clone is
+// copied. The blocks it maps keep their own counts. Returns -1 if full.
+static int own_indirect(inode_t *node) {
+    if (blocks_refs(node->indirect) <= 1) {
+        return 0;
+    }
+    if (delalloc_reserved() + 1 > blocks_free_count()) {
+        return -1;
+    }
+
+    int got;
+    int copy = alloc_block_run(node->indirect + 1, 1, &got);
+    if (copy == -1) {
+        return -1;
+    }
+    memcpy(blocks_get_block(copy), blocks_get_block(node->indirect), BLOCK_SIZE);
+    free_block(node->indirect); // drops this inode's share
+    node->indirect = copy;
+    return 0;
+}
+
+// Shrink inode to the given size, freeing every block past the new end.
+int shrink_inode(inode_t *node, int size) {
+    if (size >= node->size) {
+        return 0;
+    }
+
+    // Zero the tail of the new last block so a later grow reads zeros there
+    int rem = size % BLOCK_SIZE;
+    if (rem != 0 && inode_get_bnum(node, size / BLOCK_SIZE) != 0) {
+        int bnum = inode_cow_bnum(node, size / BLOCK_SIZE);
+        if (bnum == -1) {
+            return -1;
+        }
+        memset((char *) blocks_get_block(bnum) + rem, 0, BLOCK_SIZE - rem);
+        checksum_update(bnum);
+    }
+
+    // the indirect block is only needed while the file has > 1 block, so
+    // release it (and the direct block, if nothing is kept) as a whole
+    int keep = bytes_to_blocks(size);
+    if (keep <= 1) {
+        int block = keep == 1 ? node->block : 0;
+        if (keep == 1) {
+            node->block = 0;
+        }
+        inode_release_blocks(node);
+        node->block = block;
+        node->size = size;
+        return 0;
+    }
+
+    // Free the data blocks that are past the new end; a sparse file may
+    // have no indirect block at all
+    if (node->indirect == 0) {
+        node->size = size;
+        return 0;
+    }
+    if (own_indirect(node) == -1) {
+        return -1;
+    }
+    int *ptrs = (int *) blocks_get_block(node->indirect);
+    for (int ii = keep - 1; ii < BLOCK_SIZE / sizeof(int); ii++) {
+        if (ptrs[ii] != 0) {
+            free_block(ptrs[ii]);
+            ptrs[ii] = 0;
+        }
+    }
+
+    node->size = size;
+    return 0;
+}
+
+// Get the disk block backing the given file block, or 0 for a hole.
+int inode_get_bnum(inode_t *node, int file_bnum) {
+    if (file_bnum == 0) {
+        return node->block;
+    }
+    if (node->indirect == 0) {
+        return 0;
+    }
+
+    int *ptrs = (int *) blocks_get_block(node->indirect);
+    return ptrs[file_bnum - 1];
+}
+
+// Point the given file block at the given disk block, allocating the
+// indirect block if needed. Returns -1 if the disk is full.
+int inode_set_bnum(inode_t *node, int file_bnum, int bnum) {
+    if (file_bnum == 0) {
+        node->block = bnum;
+        return 0;
+    }
+
+    if (node->indirect == 0) {
+        int got;
+        int ind = alloc_block_run(bnum + 1, 1, &got);
+        if (ind == -1) {
+            return -1;
+        }
+        memset(blocks_get_block(ind), 0, BLOCK_SIZE);
+        node->indirect = ind;
+    }
+    else if (own_indirect(node) == -1) {
+        return -1;
+    }
+
+    int *ptrs = (int *) blocks_get_block(node->indirect);
+    ptrs[file_bnum - 1] = bnum;
+    return 0;
+}
+
+// Preferred disk block for the given file block: right after the
+// previous one in the file.
+static int block_goal(inode_t *node, int file_bnum) {
+    if (file_bnum == 0) {
+        return 0;
+    }
+    int prev = inode_get_bnum(node, file_bnum - 1);
+    return prev != 0 ? prev + 1 : 0;
+}
+
+// Get the disk block backing the given file block, allocating a zeroed
+// block if that part of the file is still a hole. Returns -1 if full.
+int inode_alloc_bnum(inode_t *node, int file_bnum) {
+    int bnum = inode_get_bnum(node, file_bnum);
+    if (bnum != 0) {
+        return bnum;
+    }
+
+    int got;
+    bnum = alloc_block_run(block_goal(node, file_bnum), 1, &got);
+    if (bnum == -1) {
+        return -1;
+    }
+    memset(blocks_get_block(bnum), 0, BLOCK_SIZE);
+
+    if (inode_set_bnum(node, file_bnum, bnum) == -1) {
+        free_block(bnum);
+        return -1;
+    }
+    return bnum;
+}
+
+// Free the blocks backing file blocks [first, first + count), turning that
+// range into a hole. Returns -1 if a shared indirect block could not be
+// copied.
+int inode_punch(inode_t *node, int first, int count) {
+    int max_blocks = inode_max_size() / BLOCK_SIZE;
+    for (int ii = first; ii < first + count && ii < max_blocks; ii++) {
+        int bnum = inode_get_bnum(node, ii);
+        if (bnum != 0) {
+            if (inode_set_bnum(node, ii, 0) == -1) {
+                return -1;
+            }
+            free_block(bnum);
+        }
+    }
+    return 0;
+}
+
+// Get the disk block backing the given (allocated) file block for writing.
+// A block shared with a clone or a snapshot is copied first, so the write
+// only changes this file. Returns -1 if there is no room for the copy.
+int inode_cow_bnum(inode_t *node, int file_bnum) {
+    int bnum = inode_get_bnum(node, file_bnum);
+    if (blocks_refs(bnum) <= 1) {
+        return bnum;
+    }
+
+    // don't take a block promised to buffered data
+    if (delalloc_reserved() + 1 > blocks_free_count()) {
+        return -1;
+    }
+    int got;
+    int copy = alloc_block_run(block_goal(node, file_bnum), 1, &got);
+    if (copy == -1) {
+        return -1;
+    }
+    memcpy(blocks_get_block(copy), blocks_get_block(bnum), BLOCK_SIZE);
+    checksum_copy(copy, bnum);
+    if (inode_set_bnum(node, file_bnum, copy) == -1) {
+        free_block(copy);
+        return -1;
+    }
+    free_block(bnum); // drops this file's share
+    return copy;
+}
+
+// Make file blocks [dst_first, dst_first + count) of dst share the disk
+// blocks behind [src_first, src_first + count) of src. The blocks dst had
+// there are released; holes in src punch holes in dst. Returns -1 if the
+// disk fills up part way.
+int inode_clone(inode_t *dst, int dst_first, inode_t *src, int src_first, int count) {
+    for (int ii = 0; ii < count; ii++) {
+        int bnum = inode_get_bnum(src, src_first + ii);
+        int old = inode_get_bnum(dst, dst_first + ii);
+        if (bnum == old) {
+            continue;
+        }
+        if (bnum == 0) {
+            inode_punch(dst, dst_first + ii, 1);
+            continue;
+        }
+
+        // a block with too many owners is copied instead of shared
+        int share = bnum;
+        if (blocks_ref(bnum) == -1) {
+            int got;
+            share = alloc_block_run(block_goal(dst, dst_first + ii), 1, &got);
+            if (share == -1) {
+                return -1;
+            }
+            memcpy(blocks_get_block(share), blocks_get_block(bnum), BLOCK_SIZE);
+            checksum_copy(share, bnum);
+        }
+
+        if (inode_set_bnum(dst, dst_first + ii, share) == -1) {
+            free_block(share);
+            return -1;
+        }
+        if (old != 0) {
+            free_block(old);
+        }
+    }
+    return 0;
+}
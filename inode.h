@@ -9,21 +9,49 @@
 
 #include "blocks.h"
 
-extern const int NUM_INODES; // number of inodes in file system (default = 256)
-extern const int INODE_BLOCK; // block where inodes begin
+extern const int NUM_INODES; // inodes in a newly formatted file system (default = 256)
 
-// inode_t size: 20 bytes
+// inode_t size: 64 bytes (one cache line)
+//
+// Data blocks are allocated lazily on first write. A block number of 0
+// means "no block here": the range is a hole and reads back as zeros.
+//
+// Each inode is padded and aligned to a cache line, so threads updating
+// neighbouring inodes do not false-share. The fields updated on every
+// write (size, refs, mode) come first.
 typedef struct inode {
+  int size;             // sie of inode
   int refs;             // reference count
   int mode;             // permission & type
-  int size;             // sie of inode
-  int block;            // single block pointer/number (max file size <= 4K)
   int nodes;          // number of nodes in this inode (files have 0 nodes)
-} inode_t;
+  int block;            // first data block (0 = not allocated yet)
+  int indirect;         // block holding the remaining block numbers (0 = none)
+  int parent;           // directory holding the entry that last named this inode
+  int parent_blk;       // block of that directory holding the entry (a hint)
+  uint64_t compressed;  // one bit per cluster stored compressed (see compress.h)
+  int reserved[6];      // room for new fields without changing the layout
+} __attribute__((aligned(64))) inode_t;
+
+_Static_assert(sizeof(inode_t) == 64, "inode_t must fill one cache line");
+
+#define INODES_PER_BLOCK (BLOCK_SIZE / (int) sizeof(inode_t))
 
 void print_inode(inode_t *node);
 inode_t *get_inode(int inum);
-int alloc_inode();
+int inode_inum(inode_t *node);
+int alloc_inode(int parent_inum);
 void free_inode(int inum);
+void inode_pin(int inum);
+void inode_unpin(int inum);
+int inode_max_size();
+int grow_inode(inode_t *node, int size);
+int shrink_inode(inode_t *node, int size);
+int inode_get_bnum(inode_t *node, int file_bnum);
+int inode_set_bnum(inode_t *node, int file_bnum, int bnum);
+int inode_alloc_bnum(inode_t *node, int file_bnum);
+int inode_punch(inode_t *node, int first, int count);
+void inode_release_blocks(inode_t *node);
+int inode_cow_bnum(inode_t *node, int file_bnum);
+int inode_clone(inode_t *dst, int dst_first, inode_t *src, int src_first, int count);
 
 #endif
@@ -3,7 +3,9 @@
 #include <assert.h>
 #include <bsd/string.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -13,7 +15,12 @@
 #include <fuse.h>
 
 #include "storage.h"
+#include "arena.h"
+#include "bitmap.h"
+#include "blocks.h"
 #include "directory.h"
+#include "nufs_ioctl.h"
+#include "nufs_ll.h"
 
 // implementation for: man 2 access
 // Checks if a file exists.
@@ -47,7 +54,7 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     slist_t* dir_n = storage_list(path);
 
     while (dir_n != NULL) {
-        char entry_path[256];
+        char entry_path[strlen(path) + DIR_NAME_LENGTH + 2];
         if (strcmp(path, "/") == 0) {
             snprintf(entry_path, sizeof(entry_path), "/%s", dir_n->data);
         } else {
@@ -134,6 +141,9 @@ int nufs_truncate(const char *path, off_t size) {
 // You can just check whether the file is accessible.
 int nufs_open(const char *path, struct fuse_file_info *fi) {
   int rv = nufs_access(path, 0);
+  if (rv == 0) {
+    fi->keep_cache = nufs_keep_cache(path_lookup(path), 0);
+  }
   printf("open(%s) -> %d\n", path, rv);
   return rv;
 }
@@ -154,6 +164,164 @@ int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
   return rv;
 }
 
+// Free a reply built by nufs_read_bufvec, as libfuse does for read_buf.
+void nufs_free_bufvec(struct fuse_bufvec *bufv) {
+  for (size_t ii = 0; ii < bufv->count; ii++) {
+    arena_free(bufv->buf[ii].mem);
+  }
+  arena_free(bufv);
+}
+
+// Build the reply to a read of the file with given inum. Runs of plain
+// data on disk are handed over as ranges of the image files, which libfuse
+// splices to the kernel without copying them through this process; the
+// rest is read into memory. The reply comes from the request's arena if
+// pooled, and from malloc for libfuse to free otherwise. Returns the bytes
+// read or a negative errno.
+int nufs_read_bufvec(int inum, size_t size, off_t offset, int pooled,
+                     struct fuse_bufvec **bufp) {
+  void *(*alloc)(size_t) = pooled ? arena_alloc : malloc;
+  // at most one run per block touched, plus a partial one at each end
+  size_t max = BLOCK_INDEX(size) + 2;
+  size_t bytes = sizeof(struct fuse_bufvec) + max * sizeof(struct fuse_buf);
+  struct fuse_bufvec *bufv = memset(alloc(bytes), 0, bytes);
+  *bufv = FUSE_BUFVEC_INIT(0);
+  bufv->count = 0;
+
+  size_t done = 0;
+  while (done < size) {
+    off_t image_pos;
+    int len = storage_read_map(inum, size - done, offset + done, &image_pos);
+    if (len <= 0) {
+      if (len < 0 && done == 0) {
+        nufs_free_bufvec(bufv);
+        return len;
+      }
+      break;
+    }
+
+    struct fuse_buf *buf = &bufv->buf[bufv->count++];
+    buf->size = len;
+    if (image_pos >= 0) {
+      buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+      buf->fd = blocks_file_at(image_pos, &buf->pos);
+    } else {
+      buf->mem = alloc(len);
+      buf->fd = -1;
+      int rv = storage_read_inum(inum, buf->mem, len, offset + done);
+      if (rv < 0) {
+        // a damaged block: fail the read, or cut it short before it
+        if (done == 0) {
+          nufs_free_bufvec(bufv);
+          return rv;
+        }
+        arena_free(buf->mem);
+        bufv->count--;
+        break;
+      }
+    }
+    done += len;
+  }
+  *bufp = bufv;
+  return done;
+}
+
+// Write the data in src to the file with given inum. Whole blocks that can
+// be overwritten in place are spliced straight into the image file; the
+// rest goes through storage_write_inum. Returns the bytes written or a
+// negative errno.
+int nufs_write_bufvec(int inum, struct fuse_bufvec *src, off_t offset) {
+  size_t size = fuse_buf_size(src);
+  size_t done = 0;
+  while (done < size) {
+    off_t image_pos;
+    int len = storage_write_map(inum, size - done, offset + done, &image_pos);
+    if (len < 0) {
+      return done > 0 ? (int) done : len;
+    }
+
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+    ssize_t got;
+    if (image_pos >= 0) {
+      dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      dst.buf[0].fd = blocks_file_at(image_pos, &dst.buf[0].pos);
+      got = fuse_buf_copy(&dst, src, 0);
+      if (got > 0) {
+        storage_write_done(inum, offset + done, got);
+      }
+    } else {
+      char *data = arena_alloc(len);
+      dst.buf[0].mem = data;
+      got = fuse_buf_copy(&dst, src, 0);
+      if (got > 0) {
+        got = storage_write_inum(inum, data, got, offset + done);
+      }
+      arena_free(data);
+    }
+
+    if (got <= 0) {
+      return done > 0 ? (int) done : (got < 0 ? (int) got : -EIO);
+    }
+    done += got;
+    if (got < len) {
+      break;
+    }
+  }
+  return done;
+}
+
+// Read without copying the data through a buffer of ours; see
+// nufs_read_bufvec. libfuse frees the reply itself, with free().
+int nufs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                  off_t offset, struct fuse_file_info *fi) {
+  int inum = path_lookup(path);
+  int rv = inum == -1 ? -ENOENT : nufs_read_bufvec(inum, size, offset, 0, bufp);
+  printf("read_buf(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  return rv;
+}
+
+// Write without copying the data through a buffer of ours where it can be
+// placed in the image directly; see nufs_write_bufvec.
+int nufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                   struct fuse_file_info *fi) {
+  int inum = path_lookup(path);
+  int rv = inum == -1 ? -ENOENT : nufs_write_bufvec(inum, buf, offset);
+  printf("write_buf(%s, %ld bytes, @+%ld) -> %d\n", path, fuse_buf_size(buf),
+         offset, rv);
+  return rv;
+}
+
+// Called on each close of an open file; places buffered data on disk.
+int nufs_flush(const char *path, struct fuse_file_info *fi) {
+  int rv = storage_flush(path);
+  printf("flush(%s) -> %d\n", path, rv);
+  return rv;
+}
+
+// Called when the last reference to an open file goes away.
+int nufs_release(const char *path, struct fuse_file_info *fi) {
+  int rv = storage_flush(path);
+  printf("release(%s) -> %d\n", path, rv);
+  return rv;
+}
+
+// implementation for: man 2 fsync
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  int rv = storage_flush(path);
+  printf("fsync(%s, %d) -> %d\n", path, datasync, rv);
+  return rv;
+}
+
+// Reserve or punch out space for a range of the file.
+// Implementation for: man 2 fallocate
+int nufs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                   struct fuse_file_info *fi) {
+  int rv = storage_fallocate(path, mode, offset, length);
+  printf("fallocate(%s, %d, %ld bytes, @+%ld) -> %d\n", path, mode, length,
+         offset, rv);
+  return rv;
+}
+
 // Update the timestamps on a file or directory.
 int nufs_utimens(const char *path, const struct timespec ts[2]) {
   int rv = -1;
@@ -162,14 +330,286 @@ int nufs_utimens(const char *path, const struct timespec ts[2]) {
   return rv;
 }
 
-// Extended operations
+// Set when a snapshot is mounted; the kernel refuses writes itself, but
+// the ioctls that change the file system need to be refused here.
+static int readonly = 0;
+
+// Whether the kernel may keep the pages of a file it has cached across
+// opens (-o nocache turns this off)
+static int keep_cache = 1;
+
+// Files whose data an ioctl changed since they were last opened, behind
+// the back of the kernel's page cache
+static uint8_t *changed = NULL;
+
+// Set by the low-level driver, which can tell the kernel about changes
+// made by ioctls as they happen
+static void (*notify_inode)(int inum) = NULL;
+static void (*notify_entry)(int dir_inum, const char *name) = NULL;
+
+void nufs_set_notify(void (*inode)(int inum),
+                     void (*entry)(int dir_inum, const char *name)) {
+  notify_inode = inode;
+  notify_entry = entry;
+}
+
+// The data of the file with given inum changed without the kernel seeing it
+static void changed_inode(int inum) {
+  if (changed == NULL) {
+    changed = calloc(blocks_super()->inode_count / 8 + 1, 1);
+  }
+  bitmap_put(changed, inum, 1);
+  if (notify_inode != NULL) {
+    notify_inode(inum);
+  }
+}
+
+// The entry with given name in directory dir_inum was made or removed
+// without the kernel seeing it
+static void changed_entry(int dir_inum, const char *name) {
+  if (notify_entry != NULL) {
+    notify_entry(dir_inum, name);
+  }
+}
+
+// Decide whether the kernel may keep the cached pages of the file with
+// given inum as it is opened. Without notifications (always_valid == 0)
+// that is only safe if no ioctl changed the file since it was last opened
+// and it has one name, since the path-based driver gives each name its
+// own page cache.
+int nufs_keep_cache(int inum, int always_valid) {
+  int stale = changed != NULL && bitmap_get(changed, inum);
+  if (stale) {
+    bitmap_put(changed, inum, 0);
+  }
+  if (!keep_cache) {
+    return 0;
+  }
+  if (always_valid) {
+    return 1;
+  }
+  struct stat st;
+  storage_stat_inum(inum, &st);
+  return !stale && st.st_nlink == 1;
+}
+
+// Find the name a batch operation works on in the batch's data area.
+// Returns NULL unless it is a non-empty name without slashes that ends
+// within the data.
+static const char *batch_name(nufs_ioc_batch_t *batch, nufs_batch_op_t *op) {
+  if (op->name_off >= NUFS_BATCH_DATA_SIZE) {
+    return NULL;
+  }
+  const char *name = batch->data + op->name_off;
+  size_t room = NUFS_BATCH_DATA_SIZE - op->name_off;
+  size_t len = strnlen(name, room);
+  if (len == 0 || len == room || memchr(name, '/', len) != NULL) {
+    return NULL;
+  }
+  return name;
+}
+
+// Run the operations of a batch on names in the directory at path, which
+// is looked up once for all of them. Each operation gets its own result.
+static int nufs_batch(const char *path, nufs_ioc_batch_t *batch) {
+  int dir = storage_lookup_dir(path);
+  if (dir < 0) {
+    return dir;
+  }
+  if (batch->count > NUFS_BATCH_MAX_OPS) {
+    return -EINVAL;
+  }
+
+  batch->done = 0;
+  for (uint32_t ii = 0; ii < batch->count; ii++) {
+    nufs_batch_op_t *op = &batch->ops[ii];
+    const char *name = batch_name(batch, op);
+    struct stat st;
+    if (name == NULL) {
+      op->result = -EINVAL;
+      continue;
+    }
+    if (readonly && op->opcode != NUFS_BATCH_STAT) {
+      op->result = -EROFS;
+      continue;
+    }
+
+    switch (op->opcode) {
+    case NUFS_BATCH_CREATE:
+      if ((op->mode & S_IFMT) != 0 && !S_ISREG(op->mode)) {
+        op->result = -EINVAL;
+      } else {
+        int rv = storage_mknod_at(dir, name, S_IFREG | (op->mode & 07777));
+        op->result = rv < 0 ? rv : 0;
+        if (rv >= 0) {
+          changed_entry(dir, name);
+        }
+      }
+      break;
+    case NUFS_BATCH_STAT:
+      op->result = storage_stat_at(dir, name, &st);
+      if (op->result == 0) {
+        op->mode = st.st_mode;
+        op->inum = st.st_ino;
+        op->size = st.st_size;
+        op->nlink = st.st_nlink;
+      }
+      break;
+    case NUFS_BATCH_UNLINK:
+      op->result = storage_stat_at(dir, name, &st);
+      if (op->result == 0) {
+        op->result = S_ISDIR(st.st_mode) ? -EISDIR : storage_unlink_at(dir, name);
+      }
+      if (op->result == 0) {
+        changed_entry(dir, name);
+      }
+      break;
+    case NUFS_BATCH_WRITE:
+      if (op->data_off > NUFS_BATCH_DATA_SIZE ||
+          op->data_len > NUFS_BATCH_DATA_SIZE - op->data_off) {
+        op->result = -EINVAL;
+      } else if (op->offset > INT32_MAX) {
+        op->result = -EFBIG;
+      } else {
+        op->result = storage_write_at(dir, name, batch->data + op->data_off,
+                                      op->data_len, op->offset);
+        if (op->result >= 0) {
+          changed_inode(storage_lookup(dir, name));
+        }
+      }
+      break;
+    default:
+      op->result = -EINVAL;
+    }
+    if (op->result >= 0) {
+      batch->done += 1;
+    }
+  }
+  return 0;
+}
+
+// Extended operations; see nufs_ioctl.h
 int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                unsigned int flags, void *data) {
-  int rv = -1;
+  int rv;
+  if (readonly && _IOC_DIR((unsigned int) cmd) & _IOC_WRITE &&
+      (unsigned int) cmd != NUFS_IOC_INUM_PATH && (unsigned int) cmd != NUFS_IOC_BATCH) {
+    printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, -EROFS);
+    return -EROFS;
+  }
+
+  switch ((unsigned int) cmd) {
+  case NUFS_IOC_GET_INUM:
+    rv = path_lookup(path);
+    if (rv == -1) {
+      rv = -ENOENT;
+    } else {
+      *(int32_t *) data = rv;
+      rv = 0;
+    }
+    break;
+  case NUFS_IOC_INUM_PATH: {
+    nufs_ioc_path_t *req = data;
+    rv = storage_path(req->inum, req->path, sizeof(req->path));
+    break;
+  }
+  case NUFS_IOC_CLONE_RANGE: {
+    nufs_ioc_clone_range_t *req = data;
+    if (req->src_inum < 0 || req->src_inum > INT32_MAX) {
+      rv = -ENOENT;
+      break;
+    }
+    rv = storage_clone(req->src_inum, path, req->src_offset, req->src_length,
+                       req->dest_offset);
+    if (rv == 0) {
+      changed_inode(path_lookup(path));
+    }
+    break;
+  }
+  case NUFS_IOC_SNAP_CREATE:
+  case NUFS_IOC_SNAP_DELETE: {
+    nufs_ioc_snapshot_t *req = data;
+    req->name[NUFS_SNAP_NAME_MAX - 1] = '\0';
+    rv = (unsigned int) cmd == NUFS_IOC_SNAP_CREATE
+             ? storage_snapshot_create(req->name)
+             : storage_snapshot_delete(req->name);
+    break;
+  }
+  case NUFS_IOC_SNAP_LIST: {
+    nufs_ioc_snapshot_list_t *list = data;
+    memset(list, 0, sizeof(*list));
+    for (int ii = 0; ii < NUFS_SNAP_LIST_MAX; ii++) {
+      const char *name = storage_snapshot_name(ii);
+      if (name != 0) {
+        strlcpy(list->names[list->count++], name, NUFS_SNAP_NAME_MAX);
+      }
+    }
+    rv = 0;
+    break;
+  }
+  case NUFS_IOC_DEDUP_STATS: {
+    nufs_ioc_dedup_stats_t *out = data;
+    dedup_stats_t stats;
+    storage_dedup_stats(&stats);
+    out->hashed = stats.hashed;
+    out->shared = stats.shared;
+    out->collisions = stats.collisions;
+    out->indexed = stats.indexed;
+    out->block_size = BLOCK_SIZE;
+    rv = 0;
+    break;
+  }
+  case NUFS_IOC_DEFRAG_STATS: {
+    nufs_ioc_defrag_stats_t *out = data;
+    defrag_stats_t stats;
+    storage_defrag_stats(&stats);
+    out->moved = stats.moved;
+    out->files_joined = stats.files_joined;
+    out->files_packed = stats.files_packed;
+    out->passes = stats.passes;
+    out->rate = defrag_rate();
+    out->files = stats.files;
+    out->fragmented = stats.fragmented;
+    out->file_score = stats.file_score;
+    out->free_runs = stats.free_runs;
+    out->largest_free = stats.largest_free;
+    out->free_score = stats.free_score;
+    out->block_size = BLOCK_SIZE;
+    rv = 0;
+    break;
+  }
+  case NUFS_IOC_BATCH:
+    rv = nufs_batch(path, data);
+    break;
+  default:
+    rv = -ENOTTY;
+  }
   printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
   return rv;
 }
 
+// Ask the kernel for requests as large as libfuse takes (128 KB) instead
+// of one page at a time, and to splice read and write data instead of
+// copying it, if it can.
+void nufs_init_conn(struct fuse_conn_info *conn) {
+  conn->want |= conn->capable & (FUSE_CAP_BIG_WRITES | FUSE_CAP_SPLICE_READ |
+                                 FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+  conn->max_write = NUFS_MAX_REQUEST;
+  conn->max_readahead = NUFS_MAX_REQUEST;
+}
+
+void *nufs_init(struct fuse_conn_info *conn) {
+  nufs_init_conn(conn);
+  printf("init()\n");
+  return NULL;
+}
+
+// Called on unmount; writes out everything that is still buffered.
+void nufs_destroy(void *private_data) {
+  storage_destroy();
+  printf("destroy()\n");
+}
+
 void nufs_init_ops(struct fuse_operations *ops) {
   memset(ops, 0, sizeof(struct fuse_operations));
   ops->access = nufs_access;
@@ -187,16 +627,111 @@ void nufs_init_ops(struct fuse_operations *ops) {
   ops->open = nufs_open;
   ops->read = nufs_read;
   ops->write = nufs_write;
+  ops->read_buf = nufs_read_buf;
+  ops->write_buf = nufs_write_buf;
+  ops->flush = nufs_flush;
+  ops->release = nufs_release;
+  ops->fsync = nufs_fsync;
+  ops->fallocate = nufs_fallocate;
   ops->utimens = nufs_utimens;
   ops->ioctl = nufs_ioctl;
+  ops->init = nufs_init;
+  ops->destroy = nufs_destroy;
 };
 
 struct fuse_operations nufs_ops;
 
+// Options of our own, given with -o next to the FUSE ones
+typedef struct nufs_config {
+  char *snapshot; // mount this snapshot read-only instead of the live tree
+  int compress;   // compress file data as it is written out
+  int dedup;      // share data blocks with equal contents
+  char *checksum; // when to check data blocks: strict, lazy (default) or off
+  int lowlevel;   // serve the inode-based FUSE API (see nufs_ll.c)
+  double timeout; // seconds the kernel may cache names and attributes
+  int nocache;    // drop the kernel's cached file pages on each open
+  int defrag;     // KB per second to defragment at in the background
+} nufs_config_t;
+
+static struct fuse_opt nufs_opts[] = {
+    {"snapshot=%s", offsetof(nufs_config_t, snapshot), 0},
+    {"compress", offsetof(nufs_config_t, compress), 1},
+    {"dedup", offsetof(nufs_config_t, dedup), 1},
+    {"checksum=%s", offsetof(nufs_config_t, checksum), 0},
+    {"lowlevel", offsetof(nufs_config_t, lowlevel), 1},
+    {"timeout=%lf", offsetof(nufs_config_t, timeout), 0},
+    {"nocache", offsetof(nufs_config_t, nocache), 1},
+    {"defrag", offsetof(nufs_config_t, defrag), DEFRAG_DEFAULT_RATE},
+    {"defrag=%d", offsetof(nufs_config_t, defrag), 0},
+    FUSE_OPT_END,
+};
+
 int main(int argc, char *argv[]) {
-  assert(argc > 2 && argc < 6);
+  assert(argc > 2);
   // printf("TODO: mount %s as data file\n", argv[--argc]);
-  storage_init(argv[--argc]);
+  const char *image = argv[--argc];
+
+  nufs_config_t conf = {0};
+  conf.timeout = -1;
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  if (fuse_opt_parse(&args, &conf, nufs_opts, NULL) == -1) {
+    return 1;
+  }
+
+  // set before the image is opened, which loads the saved dedup index
+  storage_set_compression(conf.compress);
+  storage_set_dedup(conf.dedup);
+  if (conf.checksum == NULL || strcmp(conf.checksum, "lazy") == 0) {
+    storage_set_checksums(CHECKSUM_LAZY);
+  } else if (strcmp(conf.checksum, "strict") == 0) {
+    storage_set_checksums(CHECKSUM_STRICT);
+  } else if (strcmp(conf.checksum, "off") == 0) {
+    storage_set_checksums(CHECKSUM_OFF);
+  } else {
+    fprintf(stderr, "nufs: checksum must be strict, lazy or off\n");
+    return 1;
+  }
+
+  if (conf.snapshot != NULL) {
+    readonly = 1;
+    fuse_opt_add_arg(&args, "-oro");
+    if (storage_init_snapshot(image, conf.snapshot) == -1) {
+      return 1;
+    }
+  } else {
+    // a snapshot mount never moves anything
+    storage_set_defrag(conf.defrag);
+    if (storage_init(image) == -1) {
+      return 1;
+    }
+  }
+  keep_cache = !conf.nocache;
+
+  if (conf.lowlevel) {
+    return nufs_ll_main(&args, conf.timeout < 0 ? NUFS_LL_TIMEOUT : conf.timeout);
+  }
+  if (conf.timeout >= 0) {
+    // negative entries stay uncached: a name made by NUFS_IOC_BATCH could
+    // not be announced to the kernel
+    char opt[80];
+    snprintf(opt, sizeof(opt), "-oentry_timeout=%g,attr_timeout=%g", conf.timeout,
+             conf.timeout);
+    fuse_opt_add_arg(&args, opt);
+  }
   nufs_init_ops(&nufs_ops);
-  return fuse_main(argc, argv, &nufs_ops, NULL);
+
+  // fuse_main, but with our own loop when single-threaded
+  char *mountpoint;
+  int multithreaded;
+  struct fuse *fuse = fuse_setup(args.argc, args.argv, &nufs_ops, sizeof(nufs_ops),
+                                 &mountpoint, &multithreaded, NULL);
+  if (fuse == NULL) {
+    return 1;
+  }
+  if (multithreaded && conf.defrag > 0) {
+    fprintf(stderr, "nufs: defrag needs -s; not started\n");
+  }
+  int rv = multithreaded ? fuse_loop_mt(fuse) : nufs_ll_loop(fuse_get_session(fuse));
+  fuse_teardown(fuse, mountpoint);
+  return rv == -1 ? 1 : 0;
 }
@@ -0,0 +1,122 @@
+// ioctl commands understood by a mounted nufs file system.
+//
+// The structures are fixed-size so that FUSE can copy them in and out
+// without the restricted-ioctl retry dance.
+
+#ifndef NUFS_IOCTL_H
+#define NUFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define NUFS_PATH_MAX 4092
+
+// Path of an inode, rebuilt from the parent pointers
+typedef struct nufs_ioc_path {
+  int32_t inum;               // in: inode to look up
+  char path[NUFS_PATH_MAX];   // out: absolute path within the file system
+} nufs_ioc_path_t;
+
+// Range of another file to share with the open file. Modelled on struct
+// file_clone_range, but names the source by inode number: the kernel
+// handles FICLONE itself and never passes it on to FUSE.
+typedef struct nufs_ioc_clone_range {
+  int64_t src_inum;           // source inode (see NUFS_IOC_GET_INUM)
+  uint64_t src_offset;        // block-aligned start in the source
+  uint64_t src_length;        // bytes to share; 0 = to the end of the source
+  uint64_t dest_offset;       // block-aligned start in the open file
+} nufs_ioc_clone_range_t;
+
+#define NUFS_SNAP_NAME_MAX 40
+#define NUFS_SNAP_LIST_MAX 64
+
+// Name of a snapshot to create or delete
+typedef struct nufs_ioc_snapshot {
+  char name[NUFS_SNAP_NAME_MAX];
+} nufs_ioc_snapshot_t;
+
+// Names of the existing snapshots
+typedef struct nufs_ioc_snapshot_list {
+  uint32_t count;
+  char names[NUFS_SNAP_LIST_MAX][NUFS_SNAP_NAME_MAX];
+} nufs_ioc_snapshot_list_t;
+
+// Block deduplication counters since the file system was mounted
+typedef struct nufs_ioc_dedup_stats {
+  uint64_t hashed;            // blocks hashed as they were written out
+  uint64_t shared;            // blocks shared instead of written
+  uint64_t collisions;        // equal hashes with different contents
+  uint64_t indexed;           // blocks in the index now
+  uint64_t block_size;        // bytes saved = shared * block_size
+} nufs_ioc_dedup_stats_t;
+
+// Online defragmentation counters since the file system was mounted, and
+// how fragmented it is now (see defrag.h)
+typedef struct nufs_ioc_defrag_stats {
+  uint64_t moved;             // blocks moved
+  uint64_t files_joined;      // files brought together into one run
+  uint64_t files_packed;      // files moved down into a hole
+  uint64_t passes;            // scans through the whole inode table
+  uint32_t rate;              // KB moved per second at most (0 = off)
+  uint32_t files;             // regular files with data
+  uint32_t fragmented;        // files in more than one run
+  uint32_t file_score;        // % of file blocks not following the one before
+  uint32_t free_runs;         // runs of free blocks
+  uint32_t largest_free;      // blocks in the longest free run
+  uint32_t free_score;        // % of free blocks outside the longest run
+  uint32_t block_size;
+} nufs_ioc_defrag_stats_t;
+
+#define NUFS_BATCH_MAX_OPS 64
+#define NUFS_BATCH_DATA_SIZE 12288
+
+enum nufs_batch_opcode {
+  NUFS_BATCH_CREATE = 1,      // make a regular file with the given mode
+  NUFS_BATCH_STAT,            // look up a name; fills in the stat fields
+  NUFS_BATCH_UNLINK,          // remove a file
+  NUFS_BATCH_WRITE,           // write data_len bytes at offset, then flush
+};
+
+// One operation of a batch, on a name in the directory the ioctl is
+// issued on. Names and write data are stored in the batch's data area.
+typedef struct nufs_batch_op {
+  uint32_t opcode;            // in: NUFS_BATCH_*
+  uint32_t mode;              // in: create: mode; out: stat: mode
+  uint32_t name_off;          // in: NUL-terminated name at data + name_off
+  uint32_t data_off;          // in: write: bytes at data + data_off
+  uint32_t data_len;          // in: write: number of bytes
+  int32_t result;             // out: 0 (write: bytes written) or -errno
+  uint64_t offset;            // in: write: offset in the file
+  int64_t inum;               // out: stat: inode number
+  uint64_t size;              // out: stat: size in bytes
+  uint32_t nlink;             // out: stat: number of links
+  uint32_t reserved;
+} nufs_batch_op_t;
+
+// A batch of operations. They are run in order, and each one runs even
+// if an earlier one failed; see nufs_batch.h for building one.
+typedef struct nufs_ioc_batch {
+  uint32_t count;             // in: operations in ops
+  uint32_t done;              // out: operations that succeeded
+  nufs_batch_op_t ops[NUFS_BATCH_MAX_OPS];
+  char data[NUFS_BATCH_DATA_SIZE];
+} nufs_ioc_batch_t;
+
+// Get the inode number of the open file
+#define NUFS_IOC_GET_INUM _IOR('N', 1, int32_t)
+// Get the path of an inode
+#define NUFS_IOC_INUM_PATH _IOWR('N', 2, nufs_ioc_path_t)
+// Share a range of another file's data blocks, copy-on-write
+#define NUFS_IOC_CLONE_RANGE _IOW('N', 3, nufs_ioc_clone_range_t)
+// Take, delete and list snapshots of the whole file system
+#define NUFS_IOC_SNAP_CREATE _IOW('N', 4, nufs_ioc_snapshot_t)
+#define NUFS_IOC_SNAP_DELETE _IOW('N', 5, nufs_ioc_snapshot_t)
+#define NUFS_IOC_SNAP_LIST _IOR('N', 6, nufs_ioc_snapshot_list_t)
+// Get the dedup counters
+#define NUFS_IOC_DEDUP_STATS _IOR('N', 7, nufs_ioc_dedup_stats_t)
+// Run a batch of operations in the open directory
+#define NUFS_IOC_BATCH _IOWR('N', 8, nufs_ioc_batch_t)
+// Get the defrag counters and fragmentation scores
+#define NUFS_IOC_DEFRAG_STATS _IOR('N', 9, nufs_ioc_defrag_stats_t)
+
+#endif
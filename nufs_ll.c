@@ -0,0 +1,434 @@
+// FUSE low-level driver: the kernel names files by node ID instead of by
+// path, so no request walks the tree from the root. Node IDs are inums
+// plus one, which makes the root FUSE_ROOT_ID.
+//
+// Every entry the kernel is handed (lookup, mknod, mkdir, link) counts as
+// a lookup until the kernel forgets it. While an inode has lookups it is
+// pinned (see inode_pin), so a file that is unlinked while open stays
+// readable and its inum is not handed out again under the kernel's feet.
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define FUSE_USE_VERSION 26
+#include <fuse_lowlevel.h>
+
+#include "arena.h"
+#include "inode.h"
+#include "nufs_ioctl.h"
+#include "nufs_ll.h"
+#include "storage.h"
+
+#define INUM(ino) ((int) (ino) - 1)
+#define INO(inum) ((fuse_ino_t) (inum) + 1)
+
+// How long the kernel may cache names, missing names and attributes.
+// Every change but those made by ioctls goes through the kernel, and those
+// are announced to it (see notify_inode and notify_entry).
+static double timeout = NUFS_LL_TIMEOUT;
+
+static uint64_t *lookups; // lookups the kernel holds on each inum
+static struct fuse_chan *chan; // for notifications to the kernel
+
+// Hand the kernel an entry for inum, counting the lookup.
+static void reply_entry(fuse_req_t req, int inum) {
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  e.ino = INO(inum);
+  e.attr_timeout = timeout;
+  e.entry_timeout = timeout;
+  storage_stat_inum(inum, &e.attr);
+
+  if (lookups[inum]++ == 0) {
+    inode_pin(inum);
+  }
+  if (fuse_reply_entry(req, &e) != 0 && --lookups[inum] == 0) {
+    inode_unpin(inum); // the kernel never got it
+  }
+}
+
+static void reply_err(fuse_req_t req, int rv) {
+  fuse_reply_err(req, rv < 0 ? -rv : 0);
+}
+
+// Drop nlookup of the kernel's lookups on inum.
+static void forget_one(int inum, uint64_t nlookup) {
+  if (nlookup > lookups[inum]) {
+    nlookup = lookups[inum];
+  }
+  lookups[inum] -= nlookup;
+  if (nlookup > 0 && lookups[inum] == 0) {
+    inode_unpin(inum);
+  }
+}
+
+static void nufs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  int rv = storage_lookup(INUM(parent), name);
+  printf("lookup(%lu, %s) -> %d\n", parent, name, rv);
+  if (rv == -ENOENT) {
+    // node ID 0: the kernel caches that the name is missing
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.entry_timeout = timeout;
+    fuse_reply_entry(req, &e);
+  } else if (rv < 0) {
+    reply_err(req, rv);
+  } else {
+    reply_entry(req, rv);
+  }
+}
+
+static void nufs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+  forget_one(INUM(ino), nlookup);
+  fuse_reply_none(req);
+}
+
+static void nufs_ll_forget_multi(fuse_req_t req, size_t count,
+                                 struct fuse_forget_data *forgets) {
+  for (size_t ii = 0; ii < count; ii++) {
+    forget_one(INUM(forgets[ii].ino), forgets[ii].nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+static void nufs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi) {
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  storage_stat_inum(INUM(ino), &st);
+  fuse_reply_attr(req, &st, timeout);
+}
+
+// chmod and truncate; there are no owners or timestamps to set
+static void nufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                            int to_set, struct fuse_file_info *fi) {
+  int rv = 0;
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    rv = storage_truncate_inum(INUM(ino), attr->st_size);
+  }
+  if (rv == 0 && to_set & FUSE_SET_ATTR_MODE) {
+    rv = storage_chmod_inum(INUM(ino), attr->st_mode);
+  }
+  printf("setattr(%lu, %x) -> %d\n", ino, to_set, rv);
+  if (rv < 0) {
+    reply_err(req, rv);
+    return;
+  }
+  nufs_ll_getattr(req, ino, fi);
+}
+
+static void nufs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode, dev_t rdev) {
+  int rv = storage_mknod_at(INUM(parent), name, mode);
+  printf("mknod(%lu, %s, %04o) -> %d\n", parent, name, mode, rv);
+  if (rv < 0) {
+    reply_err(req, rv);
+  } else {
+    reply_entry(req, rv);
+  }
+}
+
+static void nufs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode) {
+  nufs_ll_mknod(req, parent, name, mode | 040000, 0);
+}
+
+static void nufs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  int rv = storage_unlink_at(INUM(parent), name);
+  printf("unlink(%lu, %s) -> %d\n", parent, name, rv);
+  reply_err(req, rv);
+}
+
+static void nufs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  int rv = storage_rmdir_at(INUM(parent), name);
+  printf("rmdir(%lu, %s) -> %d\n", parent, name, rv);
+  reply_err(req, rv);
+}
+
+static void nufs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           fuse_ino_t newparent, const char *newname) {
+  int rv = storage_rename_at(INUM(parent), name, INUM(newparent), newname);
+  printf("rename(%lu, %s => %lu, %s) -> %d\n", parent, name, newparent, newname,
+         rv);
+  reply_err(req, rv);
+}
+
+static void nufs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                         const char *newname) {
+  int rv = storage_link_at(INUM(ino), INUM(newparent), newname);
+  printf("link(%lu => %lu, %s) -> %d\n", ino, newparent, newname, rv);
+  if (rv < 0) {
+    reply_err(req, rv);
+  } else {
+    reply_entry(req, INUM(ino));
+  }
+}
+
+// The kernel hears of every change to the file, so its cached pages stay
+// valid across opens.
+static void nufs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  fi->keep_cache = nufs_keep_cache(INUM(ino), 1);
+  fuse_reply_open(req, fi);
+}
+
+// Plain data on disk is spliced from the image; see nufs_read_bufvec.
+static void nufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                         struct fuse_file_info *fi) {
+  struct fuse_bufvec *bufv;
+  int rv = nufs_read_bufvec(INUM(ino), size, off, 1, &bufv);
+  printf("read(%lu, %ld bytes, @+%ld) -> %d\n", ino, size, off, rv);
+  if (rv < 0) {
+    reply_err(req, rv);
+    return;
+  }
+  fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+  nufs_free_bufvec(bufv);
+}
+
+static void nufs_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+                              struct fuse_bufvec *bufv, off_t off,
+                              struct fuse_file_info *fi) {
+  int rv = nufs_write_bufvec(INUM(ino), bufv, off);
+  printf("write_buf(%lu, %ld bytes, @+%ld) -> %d\n", ino, fuse_buf_size(bufv),
+         off, rv);
+  if (rv < 0) {
+    reply_err(req, rv);
+  } else {
+    fuse_reply_write(req, rv);
+  }
+}
+
+// flush, release and fsync all place buffered data on disk
+static void nufs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  int rv = storage_flush_inum(INUM(ino));
+  printf("flush(%lu) -> %d\n", ino, rv);
+  reply_err(req, rv);
+}
+
+static void nufs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                          struct fuse_file_info *fi) {
+  nufs_ll_flush(req, ino, fi);
+}
+
+static void nufs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                              off_t offset, off_t length,
+                              struct fuse_file_info *fi) {
+  int rv = storage_fallocate_inum(INUM(ino), mode, offset, length);
+  printf("fallocate(%lu, %d, %ld bytes, @+%ld) -> %d\n", ino, mode, length,
+         offset, rv);
+  reply_err(req, rv);
+}
+
+// Listing of an open directory, taken when it is opened so that the
+// offsets handed out stay valid while entries come and go
+typedef struct dir_listing {
+  char *buf;
+  size_t size;
+} dir_listing_t;
+
+static void nufs_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi) {
+  dir_listing_t *dir = calloc(1, sizeof(dir_listing_t));
+  slist_t *names = storage_list_inum(INUM(ino));
+
+  for (slist_t *xs = names; xs != NULL; xs = xs->next) {
+    int inum = storage_lookup(INUM(ino), xs->data);
+    if (inum < 0) {
+      continue;
+    }
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    storage_stat_inum(inum, &st);
+
+    size_t len = fuse_add_direntry(req, NULL, 0, xs->data, NULL, 0);
+    dir->buf = realloc(dir->buf, dir->size + len);
+    fuse_add_direntry(req, dir->buf + dir->size, len, xs->data, &st,
+                      dir->size + len);
+    dir->size += len;
+  }
+  slist_free(names);
+
+  fi->fh = (uintptr_t) dir;
+  fuse_reply_open(req, fi);
+}
+
+static void nufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                            off_t off, struct fuse_file_info *fi) {
+  dir_listing_t *dir = (dir_listing_t *) (uintptr_t) fi->fh;
+  if (off >= (off_t) dir->size) {
+    fuse_reply_buf(req, NULL, 0);
+    return;
+  }
+  size_t left = dir->size - off;
+  fuse_reply_buf(req, dir->buf + off, left < size ? left : size);
+}
+
+static void nufs_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+                               struct fuse_file_info *fi) {
+  dir_listing_t *dir = (dir_listing_t *) (uintptr_t) fi->fh;
+  free(dir->buf);
+  free(dir);
+  fuse_reply_err(req, 0);
+}
+
+// The ioctls work on paths (see nufs_ioctl), so the inode is named by one
+// of its paths; the fixed-size structures come and go in the buffers.
+static void nufs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+                          struct fuse_file_info *fi, unsigned flags,
+                          const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
+  if (flags & FUSE_IOCTL_COMPAT) {
+    fuse_reply_err(req, ENOSYS);
+    return;
+  }
+
+  char path[NUFS_PATH_MAX];
+  int rv = storage_path(INUM(ino), path, sizeof(path));
+  if (rv < 0) {
+    reply_err(req, rv);
+    return;
+  }
+
+  size_t size = in_bufsz > out_bufsz ? in_bufsz : out_bufsz;
+  void *data = arena_alloc(size > 0 ? size : 1);
+  memset(data, 0, size);
+  memcpy(data, in_buf, in_bufsz);
+  rv = nufs_ioctl(path, cmd, arg, fi, flags, data);
+  if (rv < 0) {
+    reply_err(req, rv);
+  } else {
+    fuse_reply_ioctl(req, rv, data, out_bufsz);
+  }
+  arena_free(data);
+}
+
+// Drop the kernel's cached attributes and pages of a file an ioctl changed.
+static void notify_inode(int inum) {
+  if (lookups[inum] > 0) {
+    fuse_lowlevel_notify_inval_inode(chan, INO(inum), 0, 0);
+  }
+}
+
+// Drop the kernel's cached name (or missing name) an ioctl made or removed.
+static void notify_entry(int dir_inum, const char *name) {
+  if (lookups[dir_inum] > 0 || dir_inum == 0) {
+    fuse_lowlevel_notify_inval_entry(chan, INO(dir_inum), name, strlen(name));
+  }
+}
+
+static void nufs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+  nufs_init_conn(conn);
+  nufs_set_notify(notify_inode, notify_entry);
+  lookups = calloc(blocks_super()->inode_count, sizeof(uint64_t));
+}
+
+// Called on unmount; the kernel's lookups all go away with it. This may
+// run after nufs_ll_loop has returned, outside the storage lock, so the
+// defragmenter is stopped before any inode is touched.
+static void nufs_ll_destroy(void *userdata) {
+  storage_defrag_stop();
+  for (int inum = 0; inum < (int) blocks_super()->inode_count; inum++) {
+    forget_one(inum, lookups[inum]);
+  }
+  free(lookups);
+  storage_destroy();
+  printf("destroy()\n");
+}
+
+static struct fuse_lowlevel_ops nufs_ll_ops = {
+    .init = nufs_ll_init,
+    .destroy = nufs_ll_destroy,
+    .lookup = nufs_ll_lookup,
+    .forget = nufs_ll_forget,
+    .forget_multi = nufs_ll_forget_multi,
+    .getattr = nufs_ll_getattr,
+    .setattr = nufs_ll_setattr,
+    .mknod = nufs_ll_mknod,
+    .mkdir = nufs_ll_mkdir,
+    .unlink = nufs_ll_unlink,
+    .rmdir = nufs_ll_rmdir,
+    .rename = nufs_ll_rename,
+    .link = nufs_ll_link,
+    .open = nufs_ll_open,
+    .read = nufs_ll_read,
+    .write_buf = nufs_ll_write_buf,
+    .flush = nufs_ll_flush,
+    .release = nufs_ll_flush,
+    .fsync = nufs_ll_fsync,
+    .opendir = nufs_ll_opendir,
+    .readdir = nufs_ll_readdir,
+    .releasedir = nufs_ll_releasedir,
+    .ioctl = nufs_ll_ioctl,
+    .fallocate = nufs_ll_fallocate,
+};
+
+// Serve requests until unmounted, one at a time, like fuse_session_loop.
+// Each holds the storage lock while it is handled, so the defragmenter
+// (see defrag.h) can work between requests. Memory a request takes from
+// the arena is freed once it is answered.
+int nufs_ll_loop(struct fuse_session *se) {
+  struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+  size_t bufsize = fuse_chan_bufsize(ch);
+  char *buf = malloc(bufsize);
+  int rv = 0;
+
+  arena_start();
+  storage_defrag_start();
+  while (!fuse_session_exited(se)) {
+    struct fuse_chan *tmpch = ch;
+    struct fuse_buf fbuf = {.mem = buf, .size = bufsize};
+    rv = fuse_session_receive_buf(se, &fbuf, &tmpch);
+    if (rv == -EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      break;
+    }
+    storage_lock();
+    fuse_session_process_buf(se, &fbuf, tmpch);
+    storage_unlock();
+    arena_reset();
+  }
+  storage_defrag_stop();
+  arena_stop();
+
+  free(buf);
+  fuse_session_reset(se);
+  return rv < 0 ? -1 : 0;
+}
+
+// Mount and serve requests until unmounted, one at a time (see
+// nufs_ll_loop).
+int nufs_ll_main(struct fuse_args *args, double cache_timeout) {
+  char *mountpoint;
+  int foreground;
+  if (fuse_parse_cmdline(args, &mountpoint, NULL, &foreground) == -1 ||
+      mountpoint == NULL) {
+    return 1;
+  }
+
+  timeout = cache_timeout;
+  int rv = 1;
+  chan = fuse_mount(mountpoint, args);
+  if (chan != NULL) {
+    struct fuse_session *se =
+        fuse_lowlevel_new(args, &nufs_ll_ops, sizeof(nufs_ll_ops), NULL);
+    if (se != NULL) {
+      if (fuse_set_signal_handlers(se) != -1) {
+        fuse_session_add_chan(se, chan);
+        fuse_daemonize(foreground);
+        rv = nufs_ll_loop(se) == -1 ? 1 : 0;
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(chan);
+      }
+      fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, chan);
+  }
+  free(mountpoint);
+  return rv;
+}
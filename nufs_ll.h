@@ -0,0 +1,36 @@
+// FUSE low-level (inode-based) front end; see nufs_ll.c.
+
+#ifndef NUFS_LL_H
+#define NUFS_LL_H
+
+#include <sys/types.h>
+
+struct fuse_args;
+struct fuse_bufvec;
+struct fuse_conn_info;
+struct fuse_file_info;
+struct fuse_session;
+
+// Seconds the kernel may cache names and attributes by default; changes
+// it doesn't make itself are announced to it
+#define NUFS_LL_TIMEOUT 60.0
+
+// Largest read or write request to ask the kernel for
+#define NUFS_MAX_REQUEST (128 * 1024)
+
+int nufs_ll_main(struct fuse_args *args, double timeout);
+int nufs_ll_loop(struct fuse_session *se);
+
+// defined in nufs.c, shared by both drivers
+int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+               unsigned int flags, void *data);
+int nufs_read_bufvec(int inum, size_t size, off_t offset, int pooled,
+                     struct fuse_bufvec **bufp);
+void nufs_free_bufvec(struct fuse_bufvec *bufv);
+int nufs_write_bufvec(int inum, struct fuse_bufvec *src, off_t offset);
+void nufs_init_conn(struct fuse_conn_info *conn);
+int nufs_keep_cache(int inum, int always_valid);
+void nufs_set_notify(void (*inode)(int inum),
+                     void (*entry)(int dir_inum, const char *name));
+
+#endif
@@ -11,11 +11,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "slist.h"
 
 slist_t *slist_cons(const char *text, slist_t *rest) {
-  slist_t *xs = malloc(sizeof(slist_t));
-  xs->data = strdup(text);
+  slist_t *xs = arena_alloc(sizeof(slist_t));
+  xs->data = arena_strdup(text);
   xs->refs = 1;
   xs->next = rest;
   return xs;
@@ -30,8 +31,8 @@ void slist_free(slist_t *xs) {
 
   if (xs->refs == 0) {
     slist_free(xs->next);
-    free(xs->data);
-    free(xs);
+    arena_free(xs->data);
+    arena_free(xs);
   }
 }
 
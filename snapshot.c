@@ -0,0 +1,187 @@
+#include <string.h>
+#include <time.h>
+
+#include "snapshot.h"
+#include "bitmap.h"
+#include "blocks.h"
+#include "delalloc.h"
+#include "inode.h"
+#include "nufs_ioctl.h"
+
+_Static_assert(sizeof(snapshot_t) == 64, "snapshot_t must be 64 bytes");
+_Static_assert(SNAPSHOT_NAME_LENGTH + 1 == NUFS_SNAP_NAME_MAX &&
+               MAX_SNAPSHOTS == NUFS_SNAP_LIST_MAX,
+               "snapshot limits must match nufs_ioctl.h");
+
+// The snapshot table, or 0 if there is none
+static snapshot_t *table() {
+    int bnum = blocks_super()->snap_block;
+    return bnum == 0 ? 0 : (snapshot_t *) blocks_get_block(bnum);
+}
+
+// Free the table block once the last snapshot is gone
+static void drop_empty_table() {
+    snapshot_t *snaps = table();
+    if (snaps == 0) {
+        return;
+    }
+    for (int ii = 0; ii < MAX_SNAPSHOTS; ii++) {
+        if (snaps[ii].name[0] != '\0') {
+            return;
+        }
+    }
+    free_block(blocks_super()->snap_block);
+    blocks_super()->snap_block = 0;
+}
+
+// Return the snapshot in the given slot, or 0 if the slot is free
+snapshot_t *snapshot_get(int index) {
+    snapshot_t *snaps = table();
+    if (snaps == 0 || index < 0 || index >= MAX_SNAPSHOTS || snaps[index].name[0] == '\0') {
+        return 0;
+    }
+    return &snaps[index];
+}
+
+// Find the slot of the snapshot with the given name, or -1
+static int find_slot(const char *name) {
+    for (int ii = 0; ii < MAX_SNAPSHOTS; ii++) {
+        snapshot_t *snap = snapshot_get(ii);
+        if (snap != 0 && strcmp(snap->name, name) == 0) {
+            return ii;
+        }
+    }
+    return -1;
+}
+
+// Call fn on every block the inode holds, stopping at the first failure
+static int visit_blocks(inode_t *node, int (*fn)(int bnum)) {
+    if (node->block != 0 && fn(node->block) == -1) {
+        return -1;
+    }
+    if (node->indirect == 0) {
+        return 0;
+    }
+
+    int *ptrs = (int *) blocks_get_block(node->indirect);
+    for (int ii = 0; ii < BLOCK_SIZE / sizeof(int); ii++) {
+        if (ptrs[ii] != 0 && fn(ptrs[ii]) == -1) {
+            return -1;
+        }
+    }
+    return fn(node->indirect);
+}
+
+// Whether a block can take one more owner
+static int has_room(int bnum) {
+    return blocks_refs(bnum) > UINT16_MAX ? -1 : 0;
+}
+
+// Take a snapshot of the live tree under the given (new) name. Returns -1
+// if the table is full, the disk has no room for the copies, or a block
+// already has as many owners as can be counted.
+int snapshot_create(const char *name) {
+    superblock_t *sb = blocks_super();
+    uint8_t *ibm = get_inode_bitmap();
+
+    // buffered data has no blocks to share yet
+    if (delalloc_flush_all() == -1) {
+        return -1;
+    }
+    for (int inum = 0; inum < sb->inode_count; inum++) {
+        if (bitmap_get(ibm, inum) && visit_blocks(get_inode(inum), has_room) == -1) {
+            return -1;
+        }
+    }
+
+    if (sb->snap_block == 0) {
+        int got;
+        int bnum = alloc_block_run(0, 1, &got);
+        if (bnum == -1) {
+            return -1;
+        }
+        memset(blocks_get_block(bnum), 0, BLOCK_SIZE);
+        sb->snap_block = bnum;
+    }
+    int slot = 0;
+    while (slot < MAX_SNAPSHOTS && snapshot_get(slot) != 0) {
+        slot++;
+    }
+    if (slot == MAX_SNAPSHOTS) {
+        return -1;
+    }
+
+    // copy the inode bitmap and the inode table into one run
+    int ibm_blocks = sb->ref_block - sb->ibm_block;
+    int table_blocks = sb->data_block - sb->inode_block;
+    int count = ibm_blocks + table_blocks;
+    int got;
+    int run = alloc_block_run(0, count, &got);
+    if (run == -1 || got < count) {
+        for (int ii = 0; ii < got; ii++) {
+            free_block(run + ii);
+        }
+        drop_empty_table();
+        return -1;
+    }
+    memcpy(blocks_get_block(run), ibm, (size_t) ibm_blocks * BLOCK_SIZE);
+    memcpy(blocks_get_block(run + ibm_blocks), blocks_get_block(sb->inode_block),
+           (size_t) table_blocks * BLOCK_SIZE);
+
+    // the snapshot now owns every block the live tree uses
+    for (int inum = 0; inum < sb->inode_count; inum++) {
+        if (bitmap_get(ibm, inum)) {
+            visit_blocks(get_inode(inum), blocks_ref);
+        }
+    }
+
+    snapshot_t *snap = &table()[slot];
+    memset(snap, 0, sizeof(snapshot_t));
+    strncpy(snap->name, name, SNAPSHOT_NAME_LENGTH);
+    snap->ibm_block = run;
+    snap->inode_block = run + ibm_blocks;
+    snap->blocks = count;
+    snap->created = time(0);
+    return 0;
+}
+
+// Delete the named snapshot, releasing its hold on every block it shares
+// and freeing its copies. Returns -1 if there is no such snapshot.
+int snapshot_delete(const char *name) {
+    int slot = find_slot(name);
+    if (slot == -1) {
+        return -1;
+    }
+
+    snapshot_t *snap = snapshot_get(slot);
+    uint8_t *ibm = blocks_get_block(snap->ibm_block);
+    inode_t *inodes = blocks_get_block(snap->inode_block);
+    for (int inum = 0; inum < blocks_super()->inode_count; inum++) {
+        if (bitmap_get(ibm, inum)) {
+            inode_release_blocks(&inodes[inum]);
+        }
+    }
+
+    for (int ii = 0; ii < snap->blocks; ii++) {
+        free_block(snap->ibm_block + ii);
+    }
+    memset(snap, 0, sizeof(snapshot_t));
+    drop_empty_table();
+    return 0;
+}
+
+// Point the inode bitmap and inode table at the named snapshot's copies.
+// Only meant for an image opened with blocks_open_private(), where the
+// change to the superblock stays in memory. Returns -1 if there is no
+// such snapshot.
+int snapshot_select(const char *name) {
+    int slot = find_slot(name);
+    if (slot == -1) {
+        return -1;
+    }
+
+    snapshot_t *snap = snapshot_get(slot);
+    blocks_super()->ibm_block = snap->ibm_block;
+    blocks_super()->inode_block = snap->inode_block;
+    return 0;
+}
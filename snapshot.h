@@ -0,0 +1,32 @@
+// Whole-file-system snapshots.
+//
+// A snapshot is a frozen copy of the inode bitmap and inode table. Every
+// block the live tree uses at that moment gains an owner (see blocks_ref),
+// so the live tree copies a block before changing it and the snapshot
+// keeps seeing the old contents. Taking a snapshot costs a walk over the
+// block maps plus a copy of the inode table; no file data is copied.
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#define SNAPSHOT_NAME_LENGTH 39
+#define MAX_SNAPSHOTS 64
+
+// snapshot_t size: 64 bytes; the table lives in superblock->snap_block
+typedef struct snapshot {
+  char name[SNAPSHOT_NAME_LENGTH + 1]; // NUL-terminated; empty = free slot
+  uint32_t ibm_block;         // copy of the inode bitmap
+  uint32_t inode_block;       // copy of the inode table, right after it
+  uint32_t blocks;            // blocks in both copies
+  uint32_t reserved;
+  int64_t created;            // seconds since the epoch
+} snapshot_t;
+
+int snapshot_create(const char *name);
+int snapshot_delete(const char *name);
+snapshot_t *snapshot_get(int index);
+int snapshot_select(const char *name);
+
+#endif
@@ -1,19 +1,148 @@
+#include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <alloca.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <stdbool.h>
+#include <linux/falloc.h>
+#include <pthread.h>
 
 #include "storage.h"
 #include "directory.h"
 #include "blocks.h"
 #include "slist.h"
+#include "bitmap.h"
+#include "delalloc.h"
+#include "snapshot.h"
+#include "compress.h"
+#include "defrag.h"
+
+// Taken by whoever is using the storage: the thread serving requests, or
+// the defragmenter between requests
+static pthread_mutex_t storage_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Initializes storage for file system in user space. An image that already
+// holds a file system is mounted as is; a blank one is formatted first.
+int storage_init(const char *path) {
+    int rv = blocks_init(path); // load the image at given path
+    if (rv == -1) {
+        return -1;
+    }
+
+    if (rv == 0 && blocks_super()->inode_size != sizeof(inode_t)) {
+        fprintf(stderr, "nufs: %s: unsupported inode size %u\n", path,
+                blocks_super()->inode_size);
+        return -1;
+    }
+
+    if (rv == 1) { // blank image
+        rv = blocks_format(NUM_INODES, sizeof(inode_t));
+        assert(rv == 0);
+        directory_init(); // initialize root directory
+    }
+    checksum_open();
+    dedup_open();
+    return 0;
+}
+
+// Mount the named snapshot of the image at path. The image is mapped
+// privately, so nothing done through this mount reaches it.
+int storage_init_snapshot(const char *path, const char *name) {
+    if (blocks_open_private(path) != 0) {
+        fprintf(stderr, "nufs: %s: cannot open image\n", path);
+        return -1;
+    }
+    if (blocks_super()->inode_size != sizeof(inode_t)) {
+        fprintf(stderr, "nufs: %s: unsupported inode size %u\n", path,
+                blocks_super()->inode_size);
+        return -1;
+    }
+    if (snapshot_select(name) == -1) {
+        fprintf(stderr, "nufs: %s: no snapshot named '%s'\n", path, name);
+        return -1;
+    }
+    checksum_open();
+    return 0;
+}
 
-// Initializes storage for file system in user space
-void storage_init(const char *path) {
-    blocks_init(path); // initialize blocks at given path
-    directory_init(); // initialize root directory
+// Flush all buffered data to disk and mark the image cleanly unmounted
+void storage_destroy() {
+    defrag_stop();
+    delalloc_flush_all();
+    delalloc_reset();
+    compress_reset();
+    dedup_close();
+    checksum_close();
+    blockslist_free();
+}
+
+// Compress file data as it is flushed from now on
+void storage_set_compression(bool enabled) {
+    compress_set_enabled(enabled);
+}
+
+// Share data blocks with equal contents; set before storage_init
+void storage_set_dedup(bool enabled) {
+    dedup_set_enabled(enabled);
+}
+
+// Choose how data blocks are checked against their checksums when read
+void storage_set_checksums(checksum_mode_t mode) {
+    checksum_set_mode(mode);
+}
+
+// Get the dedup counters since the image was mounted
+void storage_dedup_stats(dedup_stats_t *stats) {
+    dedup_get_stats(stats);
+}
+
+// Move fragmented file data together in the background at up to the given
+// KB per second (0 = never); set before storage_init
+void storage_set_defrag(int kb_per_sec) {
+    defrag_set_rate(kb_per_sec);
+}
+
+// Start defragmenting, if asked to; from now on requests must be served
+// with the storage locked
+void storage_defrag_start() {
+    defrag_start();
+}
+
+// Stop defragmenting and wait for the step in progress; afterwards
+// requests no longer need the storage locked
+void storage_defrag_stop() {
+    defrag_stop();
+}
+
+// Get the defrag counters and how fragmented the image is now
+void storage_defrag_stats(defrag_stats_t *stats) {
+    defrag_get_stats(stats);
+}
+
+void storage_lock() {
+    pthread_mutex_lock(&storage_mutex);
+}
+
+// Lock the storage unless it is in use; returns -1 if it is
+int storage_trylock() {
+    return pthread_mutex_trylock(&storage_mutex) == 0 ? 0 : -1;
+}
+
+void storage_unlock() {
+    pthread_mutex_unlock(&storage_mutex);
+}
+
+// Update given stat struct with stats of inode with given inum
+int storage_stat_inum(int inum, struct stat *st) {
+    inode_t *inode = get_inode(inum);
+    st->st_ino = inum;
+    st->st_nlink = inode->refs;
+    st->st_mode = inode->mode;
+    st->st_size = inode->size;
+    st->st_uid = getuid();
+    return 0;
 }
 
 // Update given stat struct with stats of inode for given path
@@ -25,13 +154,40 @@ int storage_stat(const char *path, struct stat *st) {
         return -ENOENT;
     }
 
-    // Update stat struct with inode information
-    inode_t *inode = get_inode(inum);
-    st->st_nlink = inode->refs;
-    st->st_mode = inode->mode;
-    st->st_size = inode->size;
-    st->st_uid = getuid();
-    return 0;
+    return storage_stat_inum(inum, st);
+}
+
+// Like storage_stat, for the entry with given name in directory dir_inum
+int storage_stat_at(int dir_inum, const char *name, struct stat *st) {
+    int inum = directory_lookup(get_inode(dir_inum), name);
+    if (inum == -1) {
+        return -ENOENT;
+    }
+
+    return storage_stat_inum(inum, st);
+}
+
+// Get the inum of the entry with given name in directory dir_inum
+int storage_lookup(int dir_inum, const char *name) {
+    inode_t *dir = get_inode(dir_inum);
+    if (!S_ISDIR(dir->mode)) {
+        return -ENOTDIR;
+    }
+    if (strlen(name) > DIR_NAME_LENGTH) {
+        return -ENAMETOOLONG;
+    }
+    int inum = directory_lookup(dir, name);
+    return inum == -1 ? -ENOENT : inum;
+}
+
+// Get the inum of the directory at given path, to pass to the *_at
+// functions below, which save resolving it again for each name
+int storage_lookup_dir(const char *path) {
+    int inum = path_lookup(path);
+    if (inum == -1) {
+        return -ENOENT;
+    }
+    return S_ISDIR(get_inode(inum)->mode) ? inum : -ENOTDIR;
 }
 
 // Read size bytes from given path + offset to given buffer and return
@@ -42,7 +198,12 @@ int storage_read(const char *path, char *buf, size_t size, off_t offset) {
     if (inum == -1) {
         return 0;
     }
+    return storage_read_inum(inum, buf, size, offset);
+}
 
+// Read size bytes from given inode + offset to given buffer and return
+// number of bytes read
+int storage_read_inum(int inum, char *buf, size_t size, off_t offset) {
     inode_t *inode = get_inode(inum);
 
     // return 0 bytes of offset is larger than size of inode
@@ -58,48 +219,223 @@ int storage_read(const char *path, char *buf, size_t size, off_t offset) {
         size_to_read = size;
     }
 
-    // Get the block and read data starting from the offset
-    char *begin_read = (char *) blocks_get_block(inode->block) + offset;
+    // Read block by block; holes that have no buffered data read back as zeros
+    size_t done = 0;
+    while (done < size_to_read) {
+        off_t pos = offset + done;
+        int block_off = BLOCK_OFFSET(pos);
+        size_t chunk = BLOCK_SIZE - block_off;
+        if (chunk > size_to_read - done) {
+            chunk = size_to_read - done;
+        }
+
+        int bnum = inode_get_bnum(inode, BLOCK_INDEX(pos));
+        if (compress_is_compressed(inode, BLOCK_INDEX(pos))) {
+            if (compress_read(inode, BLOCK_INDEX(pos), block_off, buf + done, chunk) == -1) {
+                return -EIO;
+            }
+        } else if (bnum == 0) {
+            if (!delalloc_read(inum, BLOCK_INDEX(pos), block_off, buf + done, chunk)) {
+                memset(buf + done, 0, chunk);
+            }
+        } else {
+            if (checksum_verify(bnum) == -1) {
+                return -EIO;
+            }
+            memcpy(buf + done, (char *) blocks_get_block(bnum) + block_off, chunk);
+        }
+        done += chunk;
+    }
 
-    memcpy(buf, begin_read, size_to_read);
     return size_to_read;
 }
 
-// Write size bytes to given path + offset from given buffer and return
-// number of bytes written
-int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
-    int rv = storage_truncate(path, offset + size); // Resize inode at path to fit size + offset
-    // return 0 bytes written if truncating file size was unsuccessful
-    if (rv == -1) {
+// Find how the read of size bytes at offset in the file with given inum
+// starts. Returns the length of the first run that is either plain data
+// in consecutive disk blocks, with its offset in the image file in
+// *image_pos, or has to be read with storage_read_inum (holes, buffered
+// data, compressed clusters), with *image_pos set to -1. Returns 0 at the
+// end of the file, or -EIO if the first block fails its checksum.
+int storage_read_map(int inum, size_t size, off_t offset, off_t *image_pos) {
+    inode_t *inode = get_inode(inum);
+    if (offset >= inode->size) {
         return 0;
     }
+    if (offset + size > inode->size) {
+        size = inode->size - offset;
+    }
 
-    int inum = path_lookup(path);
-    // return 0 bytes written if file not found
-    if (inum == -1) {
-        return 0;
+    int first = BLOCK_INDEX(offset);
+    int last = BLOCK_INDEX(offset + size - 1);
+    int mapped = blocks_image_fd() != -1 && !compress_is_compressed(inode, first) &&
+                 inode_get_bnum(inode, first) != 0;
+    if (mapped && checksum_verify(inode_get_bnum(inode, first)) == -1) {
+        return -EIO;
+    }
+
+    // a run of blocks read from the image stays within one stripe unit
+    int stripe_end = mapped ? blocks_stripe_end(inode_get_bnum(inode, first)) : 0;
+    int end = first + 1;
+    for (; end <= last; end++) {
+        int bnum = inode_get_bnum(inode, end);
+        if (!mapped) {
+            if (blocks_image_fd() != -1 && bnum != 0 && !compress_is_compressed(inode, end)) {
+                break;
+            }
+        } else if (bnum != inode_get_bnum(inode, end - 1) + 1 || bnum == stripe_end ||
+                   compress_is_compressed(inode, end) || checksum_verify(bnum) == -1) {
+            break; // a damaged block fails when the next run starts there
+        }
     }
 
+    *image_pos = -1;
+    if (mapped) {
+        *image_pos = ((off_t) inode_get_bnum(inode, first) << BLOCK_SHIFT) + BLOCK_OFFSET(offset);
+    }
+    off_t run = ((off_t) end << BLOCK_SHIFT) - offset;
+    return run < (off_t) size ? run : (off_t) size;
+}
+
+// Write size bytes to given inode + offset from given buffer and return
+// number of bytes written
+int storage_write_inum(int inum, const char *buf, size_t size, off_t offset) {
     inode_t *inode = get_inode(inum);
-    
-    //return 0 bytes written if offset is larger than BLOCK_SIZE (4kb);
-    if (offset >= BLOCK_SIZE) {
-        return 0;
+
+    // return -EFBIG if the write ends past the largest mappable size
+    if (offset + size > inode_max_size()) {
+        return -EFBIG;
+    }
+
+    // Write block by block. Blocks that already exist (including space
+    // reserved with fallocate) are written in place; data for holes is
+    // buffered and only gets a block when the file is flushed.
+    size_t done = 0;
+    while (done < size) {
+        off_t pos = offset + done;
+        int block_off = BLOCK_OFFSET(pos);
+        size_t chunk = BLOCK_SIZE - block_off;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+
+        // a compressed cluster goes back to plain blocks before it changes
+        if (compress_expand(inode, BLOCK_INDEX(pos), 1) == -1) {
+            break;
+        }
+
+        int bnum = inode_get_bnum(inode, BLOCK_INDEX(pos));
+        if (bnum != 0) {
+            // a block shared with a clone gets its own copy first
+            bnum = inode_cow_bnum(inode, BLOCK_INDEX(pos));
+            if (bnum == -1) {
+                break;
+            }
+            dedup_forget(bnum); // its contents no longer match the index
+            memcpy((char *) blocks_get_block(bnum) + block_off, buf + done, chunk);
+            checksum_update(bnum);
+        }
+        else if (delalloc_write(inum, BLOCK_INDEX(pos), block_off, buf + done, chunk) == -1) {
+            break;
+        }
+        done += chunk;
     }
 
-    // Limit write size to minimum bytes available
-    size_t size_to_write;
-    if (offset + size > BLOCK_SIZE) {
-        size_to_write = BLOCK_SIZE - offset;
+    // Grow the file to cover what was written
+    grow_inode(inode, offset + done);
+
+    if (done == 0 && size > 0) {
+        return -ENOSPC;
+    }
+    return done;
+}
+
+// Whole block file_bnum of the given inode can be overwritten in place
+// through the image file: it is on disk, plain and not shared
+static bool writable_in_place(inode_t *inode, int file_bnum) {
+    int bnum = inode_get_bnum(inode, file_bnum);
+    return bnum != 0 && blocks_refs(bnum) <= 1 && !compress_is_compressed(inode, file_bnum);
+}
+
+// Find how the write of size bytes at offset to the file with given inum
+// starts. Returns the length of the first run that covers whole blocks
+// which can be overwritten in place in consecutive disk blocks, with its
+// offset in the image file in *image_pos, or that has to be written with
+// storage_write_inum, with *image_pos set to -1. Data written to the image
+// file must be followed by storage_write_done.
+int storage_write_map(int inum, size_t size, off_t offset, off_t *image_pos) {
+    inode_t *inode = get_inode(inum);
+    if (offset + size > inode_max_size()) {
+        return -EFBIG;
+    }
+
+    int first = BLOCK_INDEX(offset);
+    int whole = BLOCK_INDEX(offset + size); // blocks before this one are whole
+    int mapped = blocks_image_fd() != -1 && BLOCK_OFFSET(offset) == 0 && first < whole &&
+                 writable_in_place(inode, first);
+
+    int end = first + 1;
+    if (mapped) {
+        int stripe_end = blocks_stripe_end(inode_get_bnum(inode, first));
+        while (end < whole && writable_in_place(inode, end) &&
+               inode_get_bnum(inode, end) == inode_get_bnum(inode, end - 1) + 1 &&
+               inode_get_bnum(inode, end) != stripe_end) {
+            end++;
+        }
     } else {
-        size_to_write = size;
+        while (end < whole && !(blocks_image_fd() != -1 && writable_in_place(inode, end))) {
+            end++;
+        }
+    }
+
+    *image_pos = -1;
+    if (mapped) {
+        *image_pos = (off_t) inode_get_bnum(inode, first) << BLOCK_SHIFT;
+        for (int ii = first; ii < end; ii++) {
+            dedup_forget(inode_get_bnum(inode, ii)); // about to change
+        }
+    }
+    off_t run = ((off_t) end << BLOCK_SHIFT) - offset;
+    return run < (off_t) size ? run : (off_t) size;
+}
+
+// Finish a write of len bytes at offset that went straight to the image
+// file (see storage_write_map)
+void storage_write_done(int inum, off_t offset, size_t len) {
+    inode_t *inode = get_inode(inum);
+    for (off_t pos = offset; pos < offset + (off_t) len; pos += BLOCK_SIZE) {
+        checksum_update(inode_get_bnum(inode, BLOCK_INDEX(pos)));
     }
+    grow_inode(inode, offset + len);
+}
 
-    // Get the block and write data starting from the offset
-    char *begin_write = (char *) blocks_get_block(inode->block) + offset;
+// Write size bytes to given path + offset from given buffer and return
+// number of bytes written
+int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
+    int inum = path_lookup(path);
+    // return 0 bytes written if file not found
+    if (inum == -1) {
+        return 0;
+    }
+    return storage_write_inum(inum, buf, size, offset);
+}
+
+// Write to the regular file with given name in directory dir_inum and
+// place the data on disk, as closing the file would
+int storage_write_at(int dir_inum, const char *name, const char *buf, size_t size,
+                     off_t offset) {
+    int inum = directory_lookup(get_inode(dir_inum), name);
+    if (inum == -1) {
+        return -ENOENT;
+    }
+    if (!S_ISREG(get_inode(inum)->mode)) {
+        return -EISDIR;
+    }
 
-    memcpy(begin_write, buf, size_to_write);
-    return size_to_write;
+    int rv = storage_write_inum(inum, buf, size, offset);
+    if (rv >= 0 && delalloc_flush(inum) == -1) {
+        return -ENOSPC;
+    }
+    return rv;
 }
 
 // Truncates inode at path to given size
@@ -110,131 +446,465 @@ int storage_truncate(const char *path, off_t size) {
     if (inum == -1) {
         return -1;
     }
-    
-    //return -1 if size is larger than BLOCK_SIZE
-    if (size > BLOCK_SIZE) {
-        return -1;
+    return storage_truncate_inum(inum, size);
+}
+
+// Truncates inode with given inum to given size
+int storage_truncate_inum(int inum, off_t size) {
+    //return -EFBIG if size is larger than the largest mappable size
+    if (size > inode_max_size()) {
+        return -EFBIG;
     }
 
     inode_t *inode = get_inode(inum);
-    if (size <= inode->size) { // update inode size if it is shrinking or staying the same
-        inode->size = size;
+    if (size <= inode->size) { // free the blocks past the new end
+        delalloc_truncate(inum, size);
+        if (size < inode->size && compress_truncate(inode, size) == -1) {
+            return -ENOSPC; // no room to expand the new last cluster
+        }
+        if (shrink_inode(inode, size) == -1) {
+            return -ENOSPC; // no room to copy a shared last block
+        }
+
+        // also drop blocks reserved past the end with FALLOC_FL_KEEP_SIZE
+        int keep = bytes_to_blocks(size);
+        if (inode_punch(inode, keep, inode_max_size() / BLOCK_SIZE - keep) == -1) {
+            return -ENOSPC;
+        }
+        return 0;
     }
-    else { // set new bytes to 0 if inode size is increasing
-        char *block = (char *) blocks_get_block(inode->block);
-        block += inode->size;
-        memset(block, 0, size - inode->size);
-        inode->size = size;
+    else { // growing leaves a hole; nothing is allocated or zeroed
+        return grow_inode(inode, size);
     }
-    return 0;
 }
 
-// Make file/directory at given poth iwth given mode permission and type
-int storage_mknod(const char *path, int mode) {
-    // return -1 if file already exists
-    if (path_lookup(path) != -1) {
-        return -1;
+// Reserve or release the space for the given byte range of the file at path.
+// The default mode (and FALLOC_FL_KEEP_SIZE) fills the holes in the range
+// with zeroed blocks taken from contiguous runs, so later writes there do
+// not allocate. FALLOC_FL_PUNCH_HOLE frees the blocks in the range instead.
+int storage_fallocate(const char *path, int mode, off_t offset, off_t length) {
+    int inum = path_lookup(path);
+    if (inum == -1) {
+        return -ENOENT;
     }
+    return storage_fallocate_inum(inum, mode, offset, length);
+}
 
-    // get the parent directory of the new node
-    char *par_dir = malloc(strlen(path) + 48);
-    memset(par_dir, 0, strlen(path) + 48);
-    par_dir[0] = '/';
-
-    // Split path by '/' and iterate through each item
-    slist_t *path_list = slist_explode(path + 1, '/');
-    slist_t *iter_path = path_list;
-    while (iter_path != NULL) {
-        int par_dir_inum = path_lookup(par_dir);
-        inode_t *par_dir_inode = get_inode(par_dir_inum);
-        int child_inum = directory_lookup(par_dir_inode, iter_path->data);
-
-        // the parent directory has been reached and the new node needs to be created
-        if (iter_path->next == NULL && child_inum == -1) {
-            int new_inum = alloc_inode();
-            inode_t *new_inode = get_inode(new_inum); 
-            new_inode->mode = mode;
-
-            if (mode == 040755) { // if new node is a directory
-                directory_put(new_inode, "..", path_lookup(par_dir)); // link parent reference in directory
-                directory_put(new_inode, ".", new_inum); // link self reference in directory
-                new_inode->refs = 2;
-                new_inode->nodes = 2;
-            }
+// Reserve or release space in the file with given inum; see above
+int storage_fallocate_inum(int inum, int mode, off_t offset, off_t length) {
+    if (offset < 0 || length <= 0) {
+        return -EINVAL;
+    }
+    inode_t *inode = get_inode(inum);
 
-            // link new node to parent directory
-            int rv = directory_put(par_dir_inode, iter_path->data, new_inum);
-            if (rv == -1) {
-                free(par_dir);
-                slist_free(path_list);
-                return -1;
-            }
+    // nothing can be stored past the largest size, so there is nothing to
+    // punch there and no room to reserve
+    if (offset >= inode_max_size()) {
+        if (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+            return 0;
+        }
+        return mode == 0 || mode == FALLOC_FL_KEEP_SIZE ? -EFBIG : -EOPNOTSUPP;
+    }
+
+    // place buffered data first so it is not mistaken for a hole
+    if (delalloc_flush(inum) == -1) {
+        return -ENOSPC;
+    }
+
+    off_t end = offset + length;
+    int first = offset / BLOCK_SIZE;
 
-            free(par_dir);
-            slist_free(path_list);
+    // compressed clusters in the range are expanded to plain blocks
+    off_t stop = end < inode_max_size() ? end : inode_max_size();
+    if (compress_expand(inode, first, bytes_to_blocks(stop) - first) == -1) {
+        return -ENOSPC;
+    }
+
+    if (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+        if (end > inode_max_size()) {
+            end = inode_max_size();
+        }
+
+        // zero the partial blocks at either end of the range, copying any
+        // block shared with a clone first
+        int last = end / BLOCK_SIZE;
+        int head = offset % BLOCK_SIZE;
+        int tail = end % BLOCK_SIZE;
+        if (first == last) {
+            if (inode_get_bnum(inode, first) != 0) {
+                int bnum = inode_cow_bnum(inode, first);
+                if (bnum == -1) {
+                    return -ENOSPC;
+                }
+                memset((char *) blocks_get_block(bnum) + head, 0, tail - head);
+                checksum_update(bnum);
+            }
             return 0;
         }
-        // Continue to next path level
-        else {
-            if (strcmp(par_dir, "/") == 0) {
-                strcpy(par_dir + strlen(par_dir), iter_path->data);
-            } else {
-                strcpy(par_dir + strlen(par_dir), "/");
-                strcpy(par_dir + strlen(par_dir), iter_path->data);
+        if (head != 0) {
+            if (inode_get_bnum(inode, first) != 0) {
+                int bnum = inode_cow_bnum(inode, first);
+                if (bnum == -1) {
+                    return -ENOSPC;
+                }
+                memset((char *) blocks_get_block(bnum) + head, 0, BLOCK_SIZE - head);
+                checksum_update(bnum);
+            }
+            first += 1;
+        }
+        if (tail != 0) {
+            if (inode_get_bnum(inode, last) != 0) {
+                int bnum = inode_cow_bnum(inode, last);
+                if (bnum == -1) {
+                    return -ENOSPC;
+                }
+                memset(blocks_get_block(bnum), 0, tail);
+                checksum_update(bnum);
             }
         }
-        iter_path = iter_path->next;
+
+        // whole blocks in between become a hole
+        return inode_punch(inode, first, last - first) == -1 ? -ENOSPC : 0;
+    }
+    else if (mode != 0 && mode != FALLOC_FL_KEEP_SIZE) {
+        return -EOPNOTSUPP;
     }
+
+    if (end > inode_max_size()) {
+        return -EFBIG;
+    }
+
+    // make sure the whole reservation fits before allocating anything
+    int count = bytes_to_blocks(end) - first;
+    int needed = 0;
+    for (int ii = first; ii < first + count; ii++) {
+        if (inode_get_bnum(inode, ii) == 0) {
+            needed += 1;
+        }
+    }
+    int free_blocks = blocks_free_count() - delalloc_reserved();
+    if (needed + (inode->indirect == 0 ? 1 : 0) > free_blocks) {
+        return -ENOSPC;
+    }
+
+    // fill each hole in the range with contiguous runs of blocks
+    int ii = first;
+    while (ii < first + count) {
+        if (inode_get_bnum(inode, ii) != 0) {
+            ii += 1;
+            continue;
+        }
+
+        int hole = 1;
+        while (ii + hole < first + count && inode_get_bnum(inode, ii + hole) == 0) {
+            hole += 1;
+        }
+
+        int prev = ii > 0 ? inode_get_bnum(inode, ii - 1) : 0;
+        int got;
+        int run = alloc_block_run(prev != 0 ? prev + 1 : 0, hole, &got);
+        if (run == -1) {
+            return -ENOSPC;
+        }
+        blocks_zero(run, got);
+
+        for (int jj = 0; jj < got; jj++) {
+            if (inode_set_bnum(inode, ii + jj, run + jj) == -1) {
+                for (int kk = jj; kk < got; kk++) {
+                    free_block(run + kk);
+                }
+                return -ENOSPC;
+            }
+        }
+        ii += got;
+    }
+
+    if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+        grow_inode(inode, end);
+    }
+    return 0;
+}
+
+// Give the buffered data of the file at path its disk blocks
+int storage_flush(const char *path) {
+    int inum = path_lookup(path);
+    if (inum == -1) {
+        return -ENOENT;
+    }
+    return storage_flush_inum(inum);
+}
+
+// Give the buffered data of the file with given inum its disk blocks
+int storage_flush_inum(int inum) {
+    return delalloc_flush(inum) == -1 ? -ENOSPC : 0;
+}
+
+// Make the byte range [dst_off, dst_off + len) of the file at dst_path
+// share the data blocks behind [src_off, src_off + len) of inode src_inum.
+// A len of 0 means up to the end of the source. Offsets must be block
+// aligned, and so must len unless the range ends at the end of the source
+// and reaches the end of the destination.
+int storage_clone(int src_inum, const char *dst_path, off_t src_off, off_t len,
+                  off_t dst_off) {
+    int dst_inum = path_lookup(dst_path);
+    if (dst_inum == -1) {
+        return -ENOENT;
+    }
+    return storage_clone_inum(src_inum, dst_inum, src_off, len, dst_off);
+}
+
+// Like storage_clone, for the destination file with given inum
+int storage_clone_inum(int src_inum, int dst_inum, off_t src_off, off_t len,
+                       off_t dst_off) {
+    if (src_inum < 0 || src_inum >= (int) blocks_super()->inode_count ||
+        !bitmap_get(get_inode_bitmap(), src_inum)) {
+        return -ENOENT;
+    }
+    inode_t *src = get_inode(src_inum);
+    inode_t *dst = get_inode(dst_inum);
+    if (!S_ISREG(src->mode) || !S_ISREG(dst->mode)) {
+        return -EINVAL;
+    }
+
+    if (len == 0) {
+        len = src->size > src_off ? src->size - src_off : 0;
+    }
+    off_t src_end = src_off + len;
+    off_t dst_end = dst_off + len;
+    if (src_off < 0 || dst_off < 0 || src_end > src->size ||
+        src_off % BLOCK_SIZE != 0 || dst_off % BLOCK_SIZE != 0) {
+        return -EINVAL;
+    }
+    if (len % BLOCK_SIZE != 0 && (src_end != src->size || dst_end < dst->size)) {
+        return -EINVAL; // the rest of the last block would be lost
+    }
+    if (src == dst && src_off < dst_end && dst_off < src_end) {
+        return -EINVAL; // overlapping ranges of one file
+    }
+    if (dst_end > inode_max_size()) {
+        return -EFBIG;
+    }
+
+    // buffered data has no block to share yet, and only plain blocks are
+    // shared
+    int count = bytes_to_blocks(len);
+    if (delalloc_flush(src_inum) == -1 || delalloc_flush(dst_inum) == -1 ||
+        compress_expand(src, src_off / BLOCK_SIZE, count) == -1 ||
+        compress_expand(dst, dst_off / BLOCK_SIZE, count) == -1) {
+        return -ENOSPC;
+    }
+
+    int rv = inode_clone(dst, dst_off / BLOCK_SIZE, src, src_off / BLOCK_SIZE, count);
+    if (rv == -1) {
+        return -ENOSPC;
+    }
+    grow_inode(dst, dst_end);
+    return 0;
+}
+
+// Take a snapshot of the whole file system under the given name
+int storage_snapshot_create(const char *name) {
+    if (name[0] == '\0' || strchr(name, '/') != 0) {
+        return -EINVAL;
+    }
+    if (strlen(name) > SNAPSHOT_NAME_LENGTH) {
+        return -ENAMETOOLONG;
+    }
+    for (int ii = 0; ii < MAX_SNAPSHOTS; ii++) {
+        snapshot_t *snap = snapshot_get(ii);
+        if (snap != 0 && strcmp(snap->name, name) == 0) {
+            return -EEXIST;
+        }
+    }
+    return snapshot_create(name) == -1 ? -ENOSPC : 0;
+}
+
+// Delete the snapshot with the given name, freeing the blocks only it held
+int storage_snapshot_delete(const char *name) {
+    return snapshot_delete(name) == -1 ? -ENOENT : 0;
+}
+
+// Name of the snapshot in the given slot, or 0 if the slot is free
+const char *storage_snapshot_name(int index) {
+    snapshot_t *snap = snapshot_get(index);
+    return snap == 0 ? 0 : snap->name;
+}
+
+// Make file/directory at given poth iwth given mode permission and type
+int storage_mknod(const char *path, int mode) {
+    const char *name;
+    int par_dir_inum = path_lookup_parent(path, &name);
+    if (par_dir_inum == -1) {
+        return -ENOENT;
+    }
+    int rv = storage_mknod_at(par_dir_inum, name, mode);
+    return rv < 0 ? rv : 0;
+}
+
+// Make file/directory with given name in directory par_dir_inum and return
+// its inum
+int storage_mknod_at(int par_dir_inum, const char *name, int mode) {
+    if (strlen(name) > DIR_NAME_LENGTH) {
+        return -ENAMETOOLONG;
+    }
+
+    // return -EEXIST if file already exists
+    inode_t *par_dir_inode = get_inode(par_dir_inum);
+    if (directory_lookup(par_dir_inode, name) != -1) {
+        return -EEXIST;
+    }
+
+    int new_inum = alloc_inode(par_dir_inum);
+    if (new_inum == -1) {
+        return -ENOSPC;
+    }
+    inode_t *new_inode = get_inode(new_inum);
+    new_inode->mode = mode;
+
+    bool dir = S_ISDIR(mode); // if new node is a directory
+    int dotdot = dir ? directory_put(new_inode, "..", par_dir_inum) : 0; // link parent reference
+    int dot = dir && dotdot == 0 ? directory_put(new_inode, ".", new_inum) : 0; // link self reference
+
+    // link new node to parent directory; if anything failed, take back the
+    // parent's ".." reference and free the inode with its block, so it
+    // isn't left behind where nothing can reach it
+    if (dotdot == -1 || dot == -1 || directory_put(par_dir_inode, name, new_inum) == -1) {
+        if (dir && dotdot == 0) {
+            par_dir_inode->refs -= 1;
+        }
+        directory_forget(new_inum);
+        free_inode(new_inum);
+        return -ENOSPC;
+    }
+    return new_inum;
 }
 
 // Unlink node at given path
 int storage_unlink(const char *path) {
-    int node_inum = path_lookup(path);
-    // return -1 if node is not found at path
-    if (node_inum == -1) {
-        return -1;
+    const char *name;
+    int par_dir_inum = path_lookup_parent(path, &name);
+    if (par_dir_inum == -1) {
+        return -ENOENT;
     }
+    return storage_unlink_at(par_dir_inum, name);
+}
 
-    // Get the parent path and inode
-    char *par_dir = alloca(strlen(path) + 1);
-    par_dir = path_to_parent(path, par_dir);
-    int par_dir_inum = path_lookup(par_dir);
+// Unlink node with given name in directory par_dir_inum
+int storage_unlink_at(int par_dir_inum, const char *name) {
     inode_t *par_dir_inode = get_inode(par_dir_inum);
+    if (directory_lookup(par_dir_inode, name) == -1) {
+        return -ENOENT;
+    }
 
-    // get node name
-    char *node = alloca(strlen(path) + 1);
-    node = get_name(path, node);
-
-    int rv = directory_delete(par_dir_inode, node);
-    return rv;
+    // only fails if a block shared with a snapshot can't be copied
+    int rv = directory_delete(par_dir_inode, name);
+    return rv == -1 ? -ENOSPC : 0;
 }
 
-// Links node at from path to node at to path
+// Links node at from path to a new name at to path
 int storage_link(const char *from, const char *to) {
-    int to_inum = path_lookup(to);
-    if (to_inum == -1) {
-        return -1;
+    int from_inum = path_lookup(from);
+    if (from_inum == -1) {
+        return -ENOENT;
     }
 
-    // Get the parent path and inode
-    char *par_dir = alloca(strlen(from) + 1);
-    par_dir = path_to_parent(from, par_dir);
-    int par_inum = path_lookup(par_dir);
-    inode_t *par_inode = get_inode(par_inum);
+    const char *name;
+    int par_inum = path_lookup_parent(to, &name);
+    if (par_inum == -1) {
+        return -ENOENT;
+    }
+    return storage_link_at(from_inum, par_inum, name);
+}
 
-    // get node name
-    char *from_node = alloca(strlen(from) + 1);
-    from_node = get_name(from, from_node);
+// Links node with given inum to a new name in directory par_inum
+int storage_link_at(int inum, int par_inum, const char *name) {
+    if (S_ISDIR(get_inode(inum)->mode)) {
+        return -EPERM; // no hard links to directories
+    }
+    if (strlen(name) > DIR_NAME_LENGTH) {
+        return -ENAMETOOLONG;
+    }
+    inode_t *par_inode = get_inode(par_inum);
+    if (directory_lookup(par_inode, name) != -1) {
+        return -EEXIST;
+    }
 
-    int rv = directory_put(par_inode, from_node, to_inum);
-    return rv;
+    int rv = directory_put(par_inode, name, inum);
+    return rv == -1 ? -ENOSPC : 0;
 }
 
-// Renames node at from path to node at to path
+// Renames node at from path to node at to path, replacing any node that
+// is already at to path
 int storage_rename(const char *from, const char *to) {
-    storage_link(to, from);
-    storage_unlink(from);
-    return 0;
+    const char *from_node;
+    int from_par_inum = path_lookup_parent(from, &from_node);
+    if (from_par_inum == -1) {
+        return -ENOENT;
+    }
+    const char *to_node;
+    int to_par_inum = path_lookup_parent(to, &to_node);
+    if (to_par_inum == -1) {
+        return -ENOENT;
+    }
+    return storage_rename_at(from_par_inum, from_node, to_par_inum, to_node);
+}
+
+// Renames the entry from_node of directory from_par_inum to to_node in
+// directory to_par_inum, replacing any node that is already there
+int storage_rename_at(int from_par_inum, const char *from_node, int to_par_inum,
+                      const char *to_node) {
+    inode_t *from_par_inode = get_inode(from_par_inum);
+    int inum = directory_lookup(from_par_inode, from_node);
+    if (inum == -1) {
+        return -ENOENT;
+    }
+    if (from_par_inum == to_par_inum && strcmp(from_node, to_node) == 0) {
+        return 0;
+    }
+
+    // a directory can't be moved below itself: walk up from the target
+    // directory along the parent pointers (the root is its own parent)
+    for (int up = to_par_inum;; up = get_inode(up)->parent) {
+        if (up == inum) {
+            return -EINVAL;
+        }
+        if (get_inode(up)->parent == up) {
+            break;
+        }
+    }
+
+    inode_t *to_par_inode = get_inode(to_par_inum);
+    if (strlen(to_node) > DIR_NAME_LENGTH) {
+        return -ENAMETOOLONG;
+    }
+
+    // An existing target must be of the same kind, and empty if a directory
+    int target = directory_lookup(to_par_inode, to_node);
+    if (target != -1 && target != inum) {
+        inode_t *target_inode = get_inode(target);
+        bool from_dir = S_ISDIR(get_inode(inum)->mode);
+        if (S_ISDIR(target_inode->mode) && !from_dir) {
+            return -EISDIR;
+        }
+        if (!S_ISDIR(target_inode->mode) && from_dir) {
+            return -ENOTDIR;
+        }
+        if (from_dir && target_inode->nodes > 2) {
+            return -ENOTEMPTY;
+        }
+    }
+
+    int rv = directory_rename(from_par_inode, from_node, to_par_inode, to_node);
+    return rv == -1 ? -ENOSPC : 0;
+}
+
+// Write the path of the inode with the given inum into buf
+int storage_path(int inum, char *buf, size_t size) {
+    if (inum < 0 || inum >= (int) blocks_super()->inode_count ||
+        !bitmap_get(get_inode_bitmap(), inum)) {
+        return -ENOENT;
+    }
+    return directory_path(inum, buf, size);
 }
 
 // Return list of nodes in directory at given path
@@ -242,65 +912,54 @@ slist_t *storage_list(const char *path) {
     return directory_list(path);
 }
 
+// Return list of nodes in directory with given inum
+slist_t *storage_list_inum(int inum) {
+    return directory_list_inum(inum);
+}
+
 // Remove directory at given path
 int storage_rmdir(const char *path) {
-    int inum = path_lookup(path);
-    inode_t *inode = get_inode(inum);
+    const char *name;
+    int par_inum = path_lookup_parent(path, &name);
+    if (par_inum == -1) {
+        return -1; // no such directory, or the root
+    }
+    return storage_rmdir_at(par_inum, name);
+}
 
-    if (inode->mode != 040755) { // check to see if it is a directory
-        return -1;
+// Remove the empty directory with given name in directory par_inum
+int storage_rmdir_at(int par_inum, const char *name) {
+    inode_t *par_inode = get_inode(par_inum);
+    int inum = directory_lookup(par_inode, name);
+    if (inum == -1) {
+        return -ENOENT;
     }
-    else if (strcmp(path, "/") == 0) { // make sure it isn't root directory
-        return -1;
+    inode_t *inode = get_inode(inum);
+    if (!S_ISDIR(inode->mode)) {
+        return -ENOTDIR;
     }
-    else if (inode->nodes > 2) { // can't delete directory with nodes in it
-        return -1;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return -EINVAL;
     }
-
-    int rv = storage_unlink(path);
-    return rv;
+    if (inode->nodes > 2) { // can't delete directory with nodes in it
+        return -ENOTEMPTY;
+    }
+    return storage_unlink_at(par_inum, name);
 }
 
-
 // Change permission for node at given path
 int storage_chmod(const char *path, mode_t mode) {
     int inum = path_lookup(path);
+    if (inum == -1) {
+        return -ENOENT;
+    }
+    return storage_chmod_inum(inum, mode);
+}
+
+// Change permission for node with given inum
+int storage_chmod_inum(int inum, mode_t mode) {
     inode_t *inode = get_inode(inum);
     
     inode->mode = mode;
     return 0;
 }
-
-// Get the path of the parent directory of this path.
-char *path_to_parent(const char *path, char *parent_path) {
-    if (strcmp(path, "/") == 0) {
-        return "/";
-    }
-
-    strcpy(parent_path, path);
-
-    int child_name_length = 0;
-    for (int i = strlen(path) - 1; path[i] != '/'; i--) {
-        child_name_length += 1;
-    }
-
-    parent_path[strlen(path) - child_name_length] = '\0';   
-    return parent_path;
-}
-
-// Get the name of the child directory of this path.
-char *get_name(const char *path, char *child_name) {
-    if (strcmp(path, "/") == 0) {
-        return "/";
-    }
-
-    strcpy(child_name, path);
-
-    int child_name_length = 0;
-    for (int i = strlen(path) - 1; path[i] != '/'; i--) {
-        child_name_length += 1;
-    }
-
-    child_name += strlen(path) - child_name_length;
-    return child_name;
-}
@@ -7,25 +7,72 @@
 #ifndef NUFS_STORAGE_H
 #define NUFS_STORAGE_H
 
+#include <stdbool.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "checksum.h"
+#include "dedup.h"
+#include "defrag.h"
 #include "slist.h"
 
-void storage_init(const char *path);
+int storage_init(const char *path);
+int storage_init_snapshot(const char *path, const char *name);
+void storage_destroy();
+void storage_set_compression(bool enabled);
+void storage_set_dedup(bool enabled);
+void storage_set_checksums(checksum_mode_t mode);
+void storage_dedup_stats(dedup_stats_t *stats);
+void storage_set_defrag(int kb_per_sec);
+void storage_defrag_start();
+void storage_defrag_stop();
+void storage_defrag_stats(defrag_stats_t *stats);
+void storage_lock();
+int storage_trylock();
+void storage_unlock();
 int storage_stat(const char *path, struct stat *st);
+int storage_stat_at(int dir_inum, const char *name, struct stat *st);
+int storage_stat_inum(int inum, struct stat *st);
+int storage_lookup(int dir_inum, const char *name);
+int storage_lookup_dir(const char *path);
 int storage_read(const char *path, char *buf, size_t size, off_t offset);
+int storage_read_inum(int inum, char *buf, size_t size, off_t offset);
+int storage_read_map(int inum, size_t size, off_t offset, off_t *image_pos);
 int storage_write(const char *path, const char *buf, size_t size, off_t offset);
+int storage_write_inum(int inum, const char *buf, size_t size, off_t offset);
+int storage_write_map(int inum, size_t size, off_t offset, off_t *image_pos);
+void storage_write_done(int inum, off_t offset, size_t len);
+int storage_write_at(int dir_inum, const char *name, const char *buf, size_t size,
+                     off_t offset);
 int storage_truncate(const char *path, off_t size);
+int storage_truncate_inum(int inum, off_t size);
+int storage_fallocate(const char *path, int mode, off_t offset, off_t length);
+int storage_fallocate_inum(int inum, int mode, off_t offset, off_t length);
+int storage_flush(const char *path);
+int storage_flush_inum(int inum);
+int storage_snapshot_create(const char *name);
+int storage_snapshot_delete(const char *name);
+const char *storage_snapshot_name(int index);
+int storage_clone(int src_inum, const char *dst_path, off_t src_off, off_t len,
+                  off_t dst_off);
+int storage_clone_inum(int src_inum, int dst_inum, off_t src_off, off_t len,
+                       off_t dst_off);
 int storage_mknod(const char *path, int mode);
+int storage_mknod_at(int par_dir_inum, const char *name, int mode);
 int storage_unlink(const char *path);
+int storage_unlink_at(int par_dir_inum, const char *name);
 int storage_link(const char *from, const char *to);
+int storage_link_at(int inum, int par_dir_inum, const char *name);
 int storage_rename(const char *from, const char *to);
+int storage_rename_at(int from_dir_inum, const char *from_name, int to_dir_inum,
+                      const char *to_name);
+int storage_path(int inum, char *buf, size_t size);
 slist_t *storage_list(const char *path);
+slist_t *storage_list_inum(int inum);
 int storage_rmdir(const char *path);
+int storage_rmdir_at(int par_dir_inum, const char *name);
 int storage_chmod(const char *path, mode_t mode);
-char *path_to_parent(const char *path, char *parent_path);
-char *get_name(const char *path, char *child_name);
+int storage_chmod_inum(int inum, mode_t mode);
 
 #endif
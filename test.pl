@@ -2,11 +2,15 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 31;
+use Test::Simple tests => 63;
+use Fcntl;
 use IO::Handle;
 
 sub mount {
-    system("(make mount 2>&1) >> test.log &");
+    my ($opts, $image) = @_;
+    my $make = defined($opts) ? "make mount MOUNT_OPTS=$opts" : "make mount";
+    $make .= " IMAGE=$image" if defined($image);
+    system("($make 2>&1) >> test.log &");
     sleep 1;
 }
 
@@ -121,6 +125,8 @@ ok(($files =~ /foo/ and $files =~ /tmp/), "Directories listed");
 
 ok((mkdir("mnt/foo/bar") and -d "mnt/foo/bar"), "Create a nested directory");
 ok((mkdir("mnt/foo/bar/baz") and -d "mnt/foo/bar/baz"), "Create a nested-nested directory");
+ok((mkdir("mnt/private", 0700) and (stat("mnt/private"))[3] == 2 and rmdir("mnt/private")),
+   "A directory made with any mode gets its . and .. entries");
 
 my $msg4 = "This is a file";
 write_text("tmp/file.txt", $msg4);
@@ -132,6 +138,34 @@ ok(-e "mnt/foo/file.txt", "Move a file to another directory");
 my $msg6 = read_text("foo/file.txt");
 ok($msg4 eq $msg6, "Read data back correctly");
 
+write_text("foo/file.tmp", "new contents");
+ok(rename("mnt/foo/file.tmp", "mnt/foo/file.txt"), "Rename a file over an existing one");
+ok(read_text("foo/file.txt") eq "new contents", "Renamed file replaced the old one");
+ok(rename("mnt/foo/bar", "mnt/tmp/bar") && -d "mnt/tmp/bar/baz/../../bar",
+   "Move a directory to another directory");
+
+# NUFS_IOC_GET_INUM and NUFS_IOC_INUM_PATH from nufs_ioctl.h
+mkdir("mnt/foo/deep");
+write_text("foo/deep/leaf.txt", "leaf");
+open my $lfh, "<", "mnt/foo/deep/leaf.txt" or die;
+my $inum = pack("l", -1);
+ioctl($lfh, 0x80044e01, $inum);
+my $req = pack("l a4092", unpack("l", $inum), "");
+my $path_ok = ioctl($lfh, 0xd0004e02, $req);
+close $lfh;
+my ($inum_path) = unpack("x4 Z*", $req);
+ok($path_ok && $inum_path eq "/foo/deep/leaf.txt", "Inode number maps back to its path");
+
+# once the first name of a hard link is gone, the path is the one left
+link("mnt/foo/deep/leaf.txt", "mnt/tmp/leaf2.txt");
+unlink("mnt/foo/deep/leaf.txt");
+open my $l2fh, "<", "mnt/tmp/leaf2.txt" or die;
+$req = pack("l a4092", unpack("l", $inum), "");
+$path_ok = ioctl($l2fh, 0xd0004e02, $req);
+close $l2fh;
+($inum_path) = unpack("x4 Z*", $req);
+ok($path_ok && $inum_path eq "/tmp/leaf2.txt", "Path of a hard link outlives its first name");
+
 unmount();
 
 system("rm -f data.nufs test.log");
@@ -171,5 +205,209 @@ ok(($listed and $exists and $has_size), "Larger file exists and has the correct
 $back = read_text("larger.txt");
 ok($content eq $back, "Read back data from larger file correctly");
 
-unmount()
+say "# -> sparse file larger than the disk";
+open my $sfh, ">", "mnt/sparse.bin" or die;
+close $sfh;
+truncate("mnt/sparse.bin", 2 * 1024 * 1024);
+$size = -s "mnt/sparse.bin";
+ok(defined($size) && $size == 2 * 1024 * 1024, "Sparse file has the truncated size");
+my $hole = read_text_slice("sparse.bin", 16, 1024 * 1024);
+ok($hole eq ("\0" x 16), "Hole in sparse file reads back as zeros");
+
+say "# -> preallocated file";
+system("fallocate -l 65536 mnt/prealloc.bin");
+$size = -s "mnt/prealloc.bin";
+ok(defined($size) && $size == 65536, "fallocate reserves space and sets the size");
+# an unaligned punch wholly past the largest file size does nothing
+my $punch_rv = system("fallocate -p -o 8388609 -l 4096 mnt/prealloc.bin");
+$size = -s "mnt/prealloc.bin";
+ok($punch_rv == 0 && $size == 65536, "Punching past the maximum size is a no-op");
+
+say "# -> cloned file";
+# NUFS_IOC_GET_INUM, then NUFS_IOC_CLONE_RANGE of the whole file
+open my $cfh, "<", "mnt/larger.txt" or die;
+my $src_inum = pack("l", -1);
+ioctl($cfh, 0x80044e01, $src_inum);
+close $cfh;
+open $cfh, ">", "mnt/clone.txt" or die;
+my $range = pack("q Q Q Q", unpack("l", $src_inum), 0, 0, 0);
+my $clone_ok = ioctl($cfh, 0x40204e03, $range);
+close $cfh;
+ok($clone_ok && read_text("clone.txt") eq $content, "Clone has the data of its source");
+system("printf X | dd of=mnt/clone.txt conv=notrunc status=none");
+ok(read_text("larger.txt") eq $content, "Writing a clone leaves the source alone");
+
+say "# -> snapshot";
+# NUFS_IOC_SNAP_CREATE and NUFS_IOC_SNAP_LIST on the mount point
+sysopen my $mfh, "mnt", O_RDONLY or die;
+my $snap_ok = ioctl($mfh, 0x40284e04, pack("Z40", "first"));
+my $list = "\0" x 2564;
+ioctl($mfh, 0x8a044e06, $list);
+close $mfh;
+my ($nsnaps, $first) = unpack("L Z40", $list);
+ok($snap_ok && $nsnaps == 1 && $first eq "first", "Snapshot is created and listed");
+write_text("clone.txt", "after the snapshot");
+ok(read_text("clone.txt") eq "after the snapshot", "Files stay writable after a snapshot");
+
+say "# -> compressed file";
+# the test mount uses -o compress; text this repetitive is stored compressed
+$content = "compress me " x 50000;
+write_text("packed.txt", $content);
+ok(read_text("packed.txt") eq $content, "Read back data from compressed file correctly");
+system("printf changed | dd of=mnt/packed.txt bs=1 seek=300000 conv=notrunc status=none");
+substr($content, 300000, 7) = "changed";
+ok(read_text("packed.txt") eq $content, "Overwriting part of a compressed file");
+
+say "# -> deduplicated file";
+# the test mount also uses -o dedup; random data so it isn't compressed
+srand(38);
+$content = join("", map { chr(int(rand(256))) } 1..65536);
+for my $name ("dup1.bin", "dup2.bin") {
+    open my $dfh, ">:raw", "mnt/$name" or die;
+    print $dfh $content;
+    close $dfh;
+}
+ok(read_text_slice("dup2.bin", 65536, 0) eq $content, "Read back data from a duplicate file");
+# NUFS_IOC_DEDUP_STATS on the mount point
+sysopen $mfh, "mnt", O_RDONLY or die;
+my $stats = "\0" x 40;
+my $stats_ok = ioctl($mfh, 0x80284e07, $stats);
+close $mfh;
+my ($hashed, $shared) = unpack("Q5", $stats);
+ok($stats_ok && $shared >= 16, "Duplicate file shares the blocks of the first");
+
+say "# -> small appends";
+# random, so neither compression nor dedup moves the blocks; one file is
+# written through one handle, the other reopened for every append
+my $noise = join("", map { chr(int(rand(256))) } 1 .. 32 * 1024);
+open my $afh, ">", "mnt/append1.bin" or die;
+for (my $off = 0; $off < length($noise); $off += 1000) {
+    syswrite($afh, $noise, 1000, $off);
+}
+close $afh;
+for (my $off = 0; $off < length($noise); $off += 1000) {
+    open my $rfh, ">>", "mnt/append2.bin" or die;
+    syswrite($rfh, $noise, 1000, $off);
+    close $rfh;
+}
+
+say "# -> batch";
+# NUFS_IOC_BATCH through the nufs-batch tool
+system("(make nufs-batch 2>&1) >> test.log");
+mkdir "mnt/batch";
+system("(./nufs-batch mnt/batch create one two three 2>&1) >> test.log");
+ok(-f "mnt/batch/one" && -f "mnt/batch/three", "Batch creates files");
+my $batch_stat = `./nufs-batch mnt/batch stat two missing 2>&1`;
+ok($batch_stat =~ /^two \d+ 100644 0$/m && $batch_stat =~ /missing: No such file/,
+   "Batch stat reports each name");
+
+unmount();
+
+say "# -> checksums";
+system("(make nufs-scrub 2>&1) >> test.log");
+sleep 1; # let the unmount write the image back
+ok(system("(./nufs-scrub data.nufs 2>&1) >> test.log") == 0,
+   "Scrub finds every data block intact");
+system("(make nufs-dump 2>&1) >> test.log");
+my $dump = `./nufs-dump -i data.nufs`;
+ok($dump =~ m{ /append1\.bin: .*blocks \d+-\d+ \(indirect \d+\)$}m &&
+   $dump =~ m{ /append2\.bin: .*blocks \d+-\d+ \(indirect \d+\)$}m,
+   "Files appended in small writes are in one run");
+
+say "# -> low-level driver";
+mount("compress,dedup,lowlevel");
+my $llfiles = `ls mnt/batch`;
+ok($llfiles =~ /three/ && -f "mnt/batch/two", "Low-level mount sees the same tree");
+write_text("ll.txt", "open and unlinked");
+open my $llfh, "<", "mnt/ll.txt";
+unlink("mnt/ll.txt");
+my $lldata = do { local $/ = undef; <$llfh> } || "";
+close $llfh;
+ok($lldata eq "open and unlinked\n" && !-e "mnt/ll.txt",
+   "Unlinked file stays readable while open");
+mkdir "mnt/lld";
+ok(!rename("mnt/lld", "mnt/lld/sub") && -d "mnt/lld",
+   "Directory can't move below itself");
+# the kernel caches the miss, but is told when a batch makes the name
+my $seen = -e "mnt/batch/late";
+system("(./nufs-batch mnt/batch create late 2>&1) >> test.log");
+ok(!$seen && -f "mnt/batch/late", "Batch create shows up past a cached miss");
+
+# whole blocks already on disk are overwritten in place through the image
+my $blob = join("", map { chr(int(rand(256))) } 1 .. 65536);
+my $patch = join("", map { chr(int(rand(256))) } 1 .. 16384);
+open my $zfh, ">:raw", "mnt/zc.bin";
+print $zfh $blob;
+close $zfh;
+open $zfh, "+<:raw", "mnt/zc.bin";
+seek $zfh, 16384, 0;
+print $zfh $patch;
+close $zfh;
+substr($blob, 16384, 16384) = $patch;
+open $zfh, "<:raw", "mnt/zc.bin";
+my $zdata = do { local $/ = undef; <$zfh> } || "";
+close $zfh;
+ok($zdata eq $blob, "Overwrite in place reads back");
+unmount();
+
+say "# -> striped image";
+system("rm -f stripe0.nufs stripe1.nufs");
+system("(make mkfs.nufs 2>&1) >> test.log");
+system("(./mkfs.nufs -s 8M -u 16K stripe0.nufs:stripe1.nufs 2>&1) >> test.log");
+mount(undef, "stripe0.nufs:stripe1.nufs");
+my $big = join("", map { chr(int(rand(256))) } 1 .. 262144);
+open my $stfh, ">:raw", "mnt/striped.bin";
+print $stfh $big;
+close $stfh;
+unmount();
+ok((stat "stripe0.nufs")[12] > 128 && (stat "stripe1.nufs")[12] > 128,
+   "Large file is spread over both stripe members");
+mount(undef, "stripe0.nufs:stripe1.nufs");
+open $stfh, "<:raw", "mnt/striped.bin";
+my $sdata = do { local $/ = undef; <$stfh> } || "";
+close $stfh;
+ok($sdata eq $big, "Striped file reads back after remount");
+unmount();
 
+say "# -> foreign image";
+open my $ffh, ">", "foreign.txt" or die;
+print $ffh "not a file system\n";
+close $ffh;
+mount(undef, "foreign.txt");
+unmount();
+open $ffh, "<", "foreign.txt" or die;
+my $foreign = do { local $/ = undef; <$ffh> } || "";
+close $ffh;
+ok($foreign eq "not a file system\n", "Mounting a file that is not an image leaves it alone");
+system("rm -f foreign.txt");
+
+say "# -> defragmentation";
+system("rm -f data.nufs");
+system("(make nufs-stats 2>&1) >> test.log");
+mount("compress,dedup,defrag=65536");
+# appending to several files in turn interleaves their blocks
+my %chunks;
+for my $round (1 .. 8) {
+    for my $ii (1 .. 6) {
+        my $chunk = join("", map { chr(int(rand(256))) } 1 .. 4096);
+        open my $dfh, ">>:raw", "mnt/frag$ii.bin";
+        print $dfh $chunk;
+        close $dfh;
+        $chunks{$ii} .= $chunk;
+    }
+}
+unlink("mnt/frag2.bin", "mnt/frag5.bin");
+sleep 3;
+my $dstats = `./nufs-stats mnt`;
+say "# $dstats";
+ok($dstats =~ /fragmentation: 0 of \d+ files fragmented/,
+   "Background defrag joins interleaved files");
+my $intact = 1;
+for my $ii (1, 3, 4, 6) {
+    open my $dfh, "<:raw", "mnt/frag$ii.bin";
+    my $got = do { local $/ = undef; <$dfh> } || "";
+    close $dfh;
+    $intact &&= $got eq $chunks{$ii};
+}
+ok($intact, "Defragmented files read back");
+unmount();
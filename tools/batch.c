@@ -0,0 +1,107 @@
+// nufs-batch: create, stat or remove many files in one directory of a
+// mounted nufs file system, a batch of them per ioctl.
+//
+// usage: nufs-batch dir create|stat|unlink [name...]
+//
+// Names are read one per line from standard input when none are given.
+// stat prints "name inum mode size" for each name found.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nufs_batch.h"
+
+static const char *dir;
+static const char *command;
+static const char *names[NUFS_BATCH_MAX_OPS];
+static int failed = 0;
+
+// Run the batch and report each result.
+static int run(nufs_batch_t *batch) {
+  if (nufs_batch_run(batch) == -1) {
+    fprintf(stderr, "nufs-batch: %s: %s\n", dir, strerror(errno));
+    return -1;
+  }
+
+  for (int ii = 0; ii < nufs_batch_count(batch); ++ii) {
+    const nufs_batch_op_t *op = nufs_batch_result(batch, ii);
+    if (op->result < 0) {
+      fprintf(stderr, "nufs-batch: %s: %s\n", names[ii], strerror(-op->result));
+      failed = 1;
+    } else if (op->opcode == NUFS_BATCH_STAT) {
+      printf("%s %lld %o %llu\n", names[ii], (long long) op->inum, op->mode,
+             (unsigned long long) op->size);
+    }
+  }
+  for (int ii = 0; ii < nufs_batch_count(batch); ++ii) {
+    free((void *) names[ii]);
+  }
+  nufs_batch_clear(batch);
+  return 0;
+}
+
+// Queue the command for one name, running the batch first if it is full.
+static int add(nufs_batch_t *batch, const char *name) {
+  for (;;) {
+    int rv;
+    if (strcmp(command, "create") == 0) {
+      rv = nufs_batch_create(batch, name, 0644);
+    } else if (strcmp(command, "stat") == 0) {
+      rv = nufs_batch_stat(batch, name);
+    } else {
+      rv = nufs_batch_unlink(batch, name);
+    }
+
+    if (rv != -1) {
+      names[rv] = strdup(name);
+      return 0;
+    }
+    if (errno != ENOBUFS) {
+      fprintf(stderr, "nufs-batch: %s: %s\n", name, strerror(errno));
+      failed = 1;
+      return 0;
+    }
+    if (run(batch) == -1) {
+      return -1;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3 || (strcmp(argv[2], "create") != 0 && strcmp(argv[2], "stat") != 0 &&
+                   strcmp(argv[2], "unlink") != 0)) {
+    fprintf(stderr, "usage: nufs-batch dir create|stat|unlink [name...]\n");
+    return 2;
+  }
+  dir = argv[1];
+  command = argv[2];
+
+  nufs_batch_t *batch = nufs_batch_open(dir);
+  if (batch == NULL) {
+    fprintf(stderr, "nufs-batch: %s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+
+  int rv = 0;
+  if (argc > 3) {
+    for (int ii = 3; ii < argc && rv == 0; ++ii) {
+      rv = add(batch, argv[ii]);
+    }
+  } else {
+    char line[4096];
+    while (rv == 0 && fgets(line, sizeof(line), stdin) != NULL) {
+      line[strcspn(line, "\n")] = '\0';
+      if (line[0] != '\0') {
+        rv = add(batch, line);
+      }
+    }
+  }
+  if (rv == 0) {
+    rv = run(batch);
+  }
+
+  nufs_batch_close(batch);
+  return rv == -1 || failed ? 1 : 0;
+}
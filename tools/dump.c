@@ -0,0 +1,175 @@
+// nufs-dump: print the contents of a nufs disk image without mounting it.
+//
+// usage: nufs-dump [-i] [-b] image
+//   -i  also list every inode in use with its block map
+//   -b  also print the block and inode bitmaps
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../bitmap.h"
+#include "../blocks.h"
+#include "../directory.h"
+#include "../inode.h"
+#include "../snapshot.h"
+
+// Print the disk blocks of an inode, collapsing contiguous runs.
+static void print_block_map(inode_t *node) {
+  int max_blocks = inode_max_size() / BLOCK_SIZE;
+  int run_start = 0;
+  int run_len = 0;
+  int runs = 0;
+
+  for (int ii = 0; ii <= max_blocks; ++ii) {
+    int bnum = ii < max_blocks ? inode_get_bnum(node, ii) : 0;
+    if (run_len > 0 && bnum == run_start + run_len) {
+      run_len += 1;
+      continue;
+    }
+
+    if (run_len > 0) {
+      printf(runs++ ? ", " : " ");
+      if (run_len == 1) {
+        printf("%d", run_start);
+      } else {
+        printf("%d-%d", run_start, run_start + run_len - 1);
+      }
+    }
+    run_start = bnum;
+    run_len = bnum != 0 ? 1 : 0;
+  }
+
+  if (node->indirect != 0) {
+    printf(" (indirect %d)", node->indirect);
+  }
+
+  int shared = 0;
+  for (int ii = 0; ii < max_blocks; ++ii) {
+    int bnum = inode_get_bnum(node, ii);
+    shared += bnum != 0 && blocks_refs(bnum) > 1;
+  }
+  if (shared > 0) {
+    printf(" (%d shared)", shared);
+  }
+  if (node->compressed != 0) {
+    printf(" (%d clusters compressed)", __builtin_popcountll(node->compressed));
+  }
+  printf("\n");
+}
+
+// Print the directory tree below the given directory.
+static void print_tree(int inum, const char *name, int depth) {
+  inode_t *node = get_inode(inum);
+  printf("%*s%s%s  [inode %d, %d bytes, %d refs]\n", depth * 2, "", name,
+         S_ISDIR(node->mode) ? "/" : "", inum, node->size, node->refs);
+
+  // guard against cycles in a damaged image
+  if (!S_ISDIR(node->mode) || depth > 64) {
+    return;
+  }
+
+  dir_pos_t pos;
+  for (dirent_t *entry = directory_first(node, &pos); entry != 0;
+       entry = directory_next(node, &pos)) {
+    if (strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) {
+      continue;
+    }
+    print_tree(entry->inum, entry->name, depth + 1);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int show_inodes = 0;
+  int show_bitmaps = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "ib")) != -1) {
+    switch (opt) {
+    case 'i': show_inodes = 1; break;
+    case 'b': show_bitmaps = 1; break;
+    default:
+      fprintf(stderr, "usage: nufs-dump [-i] [-b] image\n");
+      return 2;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: nufs-dump [-i] [-b] image\n");
+    return 2;
+  }
+
+  const char *image = argv[optind];
+  if (blocks_open(image) != 0 || blocks_super()->inode_size != sizeof(inode_t)) {
+    fprintf(stderr, "nufs-dump: %s: not a nufs image\n", image);
+    return 1;
+  }
+
+  superblock_t *sb = blocks_super();
+  printf("superblock:\n");
+  printf("  version      %u\n", sb->version);
+  printf("  geometry     %u blocks of %u bytes\n", sb->block_count, sb->block_size);
+  printf("  inodes       %u\n", sb->inode_count);
+  printf("  regions      block bitmap @%u, inode bitmap @%u, refcounts @%u, "
+         "checksums @%u, inode table @%u, data @%u\n", sb->bbm_block, sb->ibm_block,
+         sb->ref_block, sb->csum_block, sb->inode_block, sb->data_block);
+  if (sb->stripe_members > 1) {
+    printf("  striping     %u files, %u blocks per unit\n", sb->stripe_members,
+           sb->stripe_blocks);
+  }
+  if (sb->snap_block != 0) {
+    printf("  snapshots    table @%u\n", sb->snap_block);
+  }
+  if (sb->dedup_block != 0) {
+    printf("  dedup index  @%u (%u blocks)\n", sb->dedup_block, sb->dedup_blocks);
+  }
+  printf("  free         %u blocks, %u inodes\n", sb->free_blocks, sb->free_inodes);
+  printf("  state        %s, mounted %u times\n", sb->clean ? "clean" : "not clean",
+         sb->mount_count);
+
+  for (int ii = 0; ii < MAX_SNAPSHOTS; ++ii) {
+    snapshot_t *snap = snapshot_get(ii);
+    if (snap == 0) {
+      continue;
+    }
+    time_t created = (time_t) snap->created;
+    char when[64];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&created));
+    printf("  snapshot     %s, taken %s, copies @%u (%u blocks)\n", snap->name,
+           when, snap->ibm_block, snap->blocks);
+  }
+
+  if (show_bitmaps) {
+    printf("\nblock bitmap:\n");
+    bitmap_print(get_blocks_bitmap(), sb->block_count);
+    printf("\ninode bitmap:\n");
+    bitmap_print(get_inode_bitmap(), sb->inode_count);
+    printf("\n");
+  }
+
+  if (show_inodes) {
+    printf("\ninodes:\n");
+    for (int inum = 0; inum < (int) sb->inode_count; ++inum) {
+      if (!bitmap_get(get_inode_bitmap(), inum)) {
+        continue;
+      }
+      inode_t *node = get_inode(inum);
+      char path[4096];
+      if (directory_path(inum, path, sizeof(path)) != 0) {
+        strcpy(path, "?");
+      }
+      printf("  %d %s: mode %o, refs %d, size %d, nodes %d, parent %d, blocks",
+             inum, path, node->mode, node->refs, node->size, node->nodes,
+             node->parent);
+      print_block_map(node);
+    }
+  }
+
+  printf("\ntree:\n");
+  print_tree(0, "", 0);
+
+  blocks_close();
+  return 0;
+}
@@ -0,0 +1,543 @@
+// fsck.nufs: check (and optionally repair) a nufs disk image offline.
+//
+// usage: fsck.nufs [-n | -y] [-j threads] image
+//
+// The inode table, the directory tree and the final reconciliation are
+// each split across worker threads, so checking a large image takes about
+// as long as reading its metadata once.
+//
+// Exit status: 0 if the image is clean, 1 if errors were repaired, 4 if
+// errors were found and left alone.
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../bitmap.h"
+#include "../compress.h"
+#include "../blocks.h"
+#include "../directory.h"
+#include "../inode.h"
+#include "../snapshot.h"
+
+static int repair = 0;
+static int nthreads = 1;
+
+static superblock_t *sb;
+static _Atomic int *owners;       // references to each block from inodes
+static _Atomic uint8_t *exclusive; // blocks that must not be shared
+static _Atomic int *links;        // directory entries naming each inode
+static _Atomic uint8_t *reached;  // inodes reachable from the root
+static uint8_t *unreadable;       // directories with bad block pointers left in
+static atomic_int errors;
+static atomic_int fixed;
+
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Report a problem, noting whether it was repaired.
+__attribute__((format(printf, 2, 3)))
+static void problem(int was_fixed, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  pthread_mutex_lock(&report_lock);
+  vprintf(fmt, ap);
+  printf(was_fixed ? " (fixed)\n" : "\n");
+  pthread_mutex_unlock(&report_lock);
+  va_end(ap);
+
+  atomic_fetch_add(&errors, 1);
+  if (was_fixed) {
+    atomic_fetch_add(&fixed, 1);
+  }
+}
+
+// An inode is in use if its table entry is; free_inode() zeroes the entry.
+static int inode_in_use(int inum) {
+  return inum >= 0 && inum < (int) sb->inode_count && get_inode(inum)->mode != 0;
+}
+
+// Run fn(lo, hi) over [0, count) split into one slice per thread. Slices
+// are multiples of 8 so that threads never share a bitmap byte.
+typedef void (*range_fn)(int lo, int hi);
+
+typedef struct range_job {
+  range_fn fn;
+  int lo;
+  int hi;
+} range_job_t;
+
+static void *run_range(void *arg) {
+  range_job_t *job = arg;
+  job->fn(job->lo, job->hi);
+  return 0;
+}
+
+static void parallel_for(int count, range_fn fn) {
+  pthread_t tids[nthreads];
+  range_job_t jobs[nthreads];
+  int slice = ((count + nthreads - 1) / nthreads + 7) & ~7;
+
+  for (int tt = 0; tt < nthreads; ++tt) {
+    jobs[tt].fn = fn;
+    jobs[tt].lo = tt * slice < count ? tt * slice : count;
+    jobs[tt].hi = (tt + 1) * slice < count ? (tt + 1) * slice : count;
+    pthread_create(&tids[tt], 0, run_range, &jobs[tt]);
+  }
+  for (int tt = 0; tt < nthreads; ++tt) {
+    pthread_join(tids[tt], 0);
+  }
+}
+
+// Record a block reference from the given inode, dropping it if invalid.
+// Only file data blocks may be shared by clones; indirect and directory
+// blocks belong to one inode. Returns 1 if the slot holds a valid block
+// number, 0 if it is empty and -1 if it holds an invalid one that was
+// left in place.
+static int claim(int inum, int *slot, int shareable) {
+  int bnum = *slot;
+  if (bnum == 0) {
+    return 0;
+  }
+
+  if (bnum < (int) sb->data_block || bnum >= (int) sb->block_count) {
+    problem(repair, "inode %d: block %d is out of range", inum, bnum);
+    if (repair) {
+      *slot = 0;
+      return 0;
+    }
+    return -1;
+  }
+
+  // mark first and count second, so whichever claim comes last sees both
+  uint8_t bit = 1 << (bnum % 8);
+  if (!shareable) {
+    atomic_fetch_or(&exclusive[bnum / 8], bit);
+  }
+  if (atomic_fetch_add(&owners[bnum], 1) > 0 &&
+      (!shareable || (atomic_load(&exclusive[bnum / 8]) & bit))) {
+    problem(0, "inode %d: block %d is also used by another inode", inum, bnum);
+  }
+  return 1;
+}
+
+// Each compressed cluster must decompress, and the blocks of the cluster
+// past its compressed copy must be holes. Damaged data is only reported.
+static void check_clusters(int inum, inode_t *node) {
+  if (!S_ISREG(node->mode)) {
+    problem(repair, "inode %d: compressed clusters in a directory", inum);
+    if (repair) {
+      node->compressed = 0;
+    }
+    return;
+  }
+
+  int max_blocks = inode_max_size() / BLOCK_SIZE;
+  for (int cluster = 0; cluster < COMPRESS_MAX_CLUSTERS; ++cluster) {
+    if (!(node->compressed >> cluster & 1)) {
+      continue;
+    }
+    int count = compress_verify(node, cluster);
+    if (count == -1) {
+      problem(0, "inode %d: compressed cluster %d is damaged", inum, cluster);
+      continue;
+    }
+
+    int first = cluster * COMPRESS_CLUSTER_BLOCKS;
+    for (int ii = first + count; ii < first + COMPRESS_CLUSTER_BLOCKS && ii < max_blocks; ++ii) {
+      if (inode_get_bnum(node, ii) != 0) {
+        problem(0, "inode %d: compressed cluster %d maps block %d past its data", inum,
+                cluster, inode_get_bnum(node, ii));
+      }
+    }
+  }
+}
+
+// Pass 1: check each inode, claim its blocks and count directory entries.
+static void scan_inodes(int lo, int hi) {
+  int ptrs_per_block = BLOCK_SIZE / sizeof(int);
+
+  for (int inum = lo; inum < hi; ++inum) {
+    if (!inode_in_use(inum)) {
+      continue;
+    }
+    inode_t *node = get_inode(inum);
+
+    if (!S_ISREG(node->mode) && !S_ISDIR(node->mode)) {
+      problem(0, "inode %d: unknown file type (mode %o)", inum, node->mode);
+    }
+    if (node->size < 0 || node->size > inode_max_size()) {
+      problem(repair, "inode %d: bad size %d", inum, node->size);
+      if (repair) {
+        node->size = node->size < 0 ? 0 : inode_max_size();
+      }
+    }
+
+    int data_shareable = S_ISREG(node->mode);
+    int bad = claim(inum, &node->block, data_shareable) < 0;
+    int indirect = claim(inum, &node->indirect, 0);
+    bad |= indirect < 0;
+    if (indirect > 0) {
+      int *ptrs = blocks_get_block(node->indirect);
+      for (int ii = 0; ii < ptrs_per_block; ++ii) {
+        bad |= claim(inum, &ptrs[ii], data_shareable) < 0;
+      }
+    }
+    if (node->compressed != 0 && !bad) {
+      check_clusters(inum, node);
+    }
+
+    if (!S_ISDIR(node->mode)) {
+      continue;
+    }
+    if (bad || node->size % BLOCK_SIZE != 0) {
+      problem(0, "directory %d: cannot be read", inum);
+      unreadable[inum] = 1;
+      continue;
+    }
+
+    int live = 0;
+    dir_pos_t pos;
+    for (dirent_t *entry = directory_first(node, &pos); entry != 0;
+         entry = directory_next(node, &pos)) {
+      if (inode_in_use(entry->inum)) {
+        atomic_fetch_add(&links[entry->inum], 1);
+      }
+      live += 1;
+    }
+
+    if (node->nodes != live) {
+      problem(repair, "directory %d: entry count is %d, should be %d", inum,
+              node->nodes, live);
+      if (repair) {
+        node->nodes = live;
+      }
+    }
+  }
+}
+
+// Pass 1b: count the blocks held by snapshots. A snapshot is a frozen
+// copy of the inode table, so its block maps are only counted, never
+// repaired; it may share any block with the live tree.
+static inode_t *snap_inodes;
+static uint8_t *snap_ibm;
+
+static void count_block(const char *what, int bnum) {
+  if (bnum < (int) sb->data_block || bnum >= (int) sb->block_count) {
+    problem(0, "%s: block %d is out of range", what, bnum);
+    return;
+  }
+  atomic_fetch_add(&owners[bnum], 1);
+}
+
+static void scan_snapshot(int lo, int hi) {
+  int ptrs_per_block = BLOCK_SIZE / sizeof(int);
+
+  for (int inum = lo; inum < hi; ++inum) {
+    inode_t *node = &snap_inodes[inum];
+    if (!bitmap_get(snap_ibm, inum)) {
+      continue;
+    }
+    if (node->block != 0) {
+      count_block("snapshot inode", node->block);
+    }
+    if (node->indirect == 0) {
+      continue;
+    }
+    count_block("snapshot inode", node->indirect);
+    if (node->indirect < (int) sb->data_block || node->indirect >= (int) sb->block_count) {
+      continue;
+    }
+    int *ptrs = blocks_get_block(node->indirect);
+    for (int ii = 0; ii < ptrs_per_block; ++ii) {
+      if (ptrs[ii] != 0) {
+        count_block("snapshot inode", ptrs[ii]);
+      }
+    }
+  }
+}
+
+static void scan_snapshots() {
+  if (sb->snap_block == 0) {
+    return;
+  }
+  count_block("snapshot table", sb->snap_block);
+
+  for (int ii = 0; ii < MAX_SNAPSHOTS; ++ii) {
+    snapshot_t *snap = snapshot_get(ii);
+    if (snap == 0) {
+      continue;
+    }
+    if (snap->ibm_block < sb->data_block ||
+        snap->ibm_block + snap->blocks > sb->block_count) {
+      problem(0, "snapshot %s: copies are out of range", snap->name);
+      continue;
+    }
+    for (uint32_t bb = 0; bb < snap->blocks; ++bb) {
+      count_block("snapshot copy", snap->ibm_block + bb);
+    }
+
+    snap_ibm = blocks_get_block(snap->ibm_block);
+    snap_inodes = blocks_get_block(snap->inode_block);
+    parallel_for(sb->inode_count, scan_snapshot);
+  }
+}
+
+// The dedup index saved at unmount holds its blocks alone.
+static void scan_dedup_index() {
+  for (uint32_t ii = 0; ii < sb->dedup_blocks; ++ii) {
+    count_block("dedup index", sb->dedup_block + ii);
+  }
+}
+
+// Pass 2: drop directory entries that name free or invalid inodes.
+static void check_entries() {
+  for (int inum = 0; inum < (int) sb->inode_count; ++inum) {
+    inode_t *node = get_inode(inum);
+    if (!inode_in_use(inum) || !S_ISDIR(node->mode) || unreadable[inum]) {
+      continue;
+    }
+
+    dir_pos_t pos;
+    dirent_t *entry = directory_first(node, &pos);
+    while (entry != 0) {
+      if (inode_in_use(entry->inum)) {
+        entry = directory_next(node, &pos);
+        continue;
+      }
+
+      problem(repair, "directory %d: entry '%s' names free inode %d", inum,
+              entry->name, entry->inum);
+      if (!repair) {
+        entry = directory_next(node, &pos);
+        continue;
+      }
+
+      // removing may compact the block, so start over
+      directory_remove(node, &pos);
+      entry = directory_first(node, &pos);
+    }
+  }
+}
+
+// Pass 3: mark everything reachable from the given directory. Each level
+// of the tree is split across the threads.
+static int *frontier;
+static int *next_frontier;
+static atomic_int next_count;
+
+static void visit_level(int lo, int hi) {
+  for (int ii = lo; ii < hi; ++ii) {
+    inode_t *dir = get_inode(frontier[ii]);
+    if (unreadable[frontier[ii]]) {
+      continue;
+    }
+
+    dir_pos_t pos;
+    for (dirent_t *entry = directory_first(dir, &pos); entry != 0;
+         entry = directory_next(dir, &pos)) {
+      int child = entry->inum;
+      if (!inode_in_use(child) || atomic_exchange(&reached[child], 1)) {
+        continue;
+      }
+      if (S_ISDIR(get_inode(child)->mode)) {
+        next_frontier[atomic_fetch_add(&next_count, 1)] = child;
+      }
+    }
+  }
+}
+
+static void walk_tree(int start) {
+  int count = 1;
+  frontier[0] = start;
+  reached[start] = 1;
+
+  while (count > 0) {
+    atomic_store(&next_count, 0);
+    parallel_for(count, visit_level);
+
+    int *tmp = frontier;
+    frontier = next_frontier;
+    next_frontier = tmp;
+    count = atomic_load(&next_count);
+  }
+}
+
+// Pass 4: reconnect inodes that are not reachable from the root as
+// "#<inum>" in the root directory. Directories go first, so that their
+// contents come back along with them.
+static void reconnect_orphans() {
+  inode_t *root = get_inode(0);
+
+  for (int dirs = 1; dirs >= 0; --dirs) {
+    for (int inum = 1; inum < (int) sb->inode_count; ++inum) {
+      if (!inode_in_use(inum) || reached[inum] ||
+          S_ISDIR(get_inode(inum)->mode) != dirs) {
+        continue;
+      }
+
+      char name[DIR_NAME_LENGTH + 1];
+      snprintf(name, sizeof(name), "#%d", inum);
+      int ok = repair && directory_put(root, name, inum) == 0;
+      problem(ok, "inode %d: not reachable from the root", inum);
+      if (!ok) {
+        continue;
+      }
+
+      // directory_put() already bumped refs; keep the link count in step
+      atomic_fetch_add(&links[inum], 1);
+      if (dirs) {
+        // re-parent the directory under the root
+        inode_t *dir = get_inode(inum);
+        dir_pos_t pos;
+        for (dirent_t *entry = unreadable[inum] ? 0 : directory_first(dir, &pos);
+             entry != 0; entry = directory_next(dir, &pos)) {
+          if (strcmp(entry->name, "..") == 0 && entry->inum != 0) {
+            if (inode_in_use(entry->inum)) {
+              atomic_fetch_sub(&links[entry->inum], 1);
+            }
+            entry->inum = 0;
+            atomic_fetch_add(&links[0], 1);
+          }
+        }
+        dir->parent = 0;
+        walk_tree(inum);
+      } else {
+        reached[inum] = 1;
+      }
+    }
+  }
+}
+
+// Pass 5: compare reference counts and bitmaps with what was found.
+static void reconcile_inodes(int lo, int hi) {
+  void *ibm = get_inode_bitmap();
+
+  for (int inum = lo; inum < hi; ++inum) {
+    int used = inode_in_use(inum);
+    if (used != bitmap_get(ibm, inum)) {
+      problem(repair, "inode %d: bitmap says %s", inum, used ? "free" : "used");
+      if (repair) {
+        bitmap_put(ibm, inum, used);
+      }
+    }
+
+    inode_t *node = get_inode(inum);
+    if (used && node->refs != links[inum]) {
+      problem(repair, "inode %d: refs is %d, should be %d", inum, node->refs,
+              links[inum]);
+      if (repair) {
+        node->refs = links[inum];
+      }
+    }
+
+    // a directory's parent pointer must agree with its ".." entry
+    if (used && S_ISDIR(node->mode) && !unreadable[inum]) {
+      dir_pos_t pos;
+      for (dirent_t *entry = directory_first(node, &pos); entry != 0;
+           entry = directory_next(node, &pos)) {
+        if (strcmp(entry->name, "..") == 0 && entry->inum != node->parent) {
+          problem(repair, "directory %d: parent is %d, should be %d", inum,
+                  node->parent, entry->inum);
+          if (repair) {
+            node->parent = entry->inum;
+          }
+        }
+      }
+    }
+  }
+}
+
+static void reconcile_blocks(int lo, int hi) {
+  void *bbm = get_blocks_bitmap();
+
+  for (int bnum = lo; bnum < hi; ++bnum) {
+    int refs = atomic_load(&owners[bnum]);
+    int used = bnum < (int) sb->data_block || refs > 0;
+    if (used != bitmap_get(bbm, bnum)) {
+      problem(repair, "block %d: bitmap says %s", bnum, used ? "free" : "used");
+      if (repair) {
+        bitmap_put(bbm, bnum, used);
+      }
+    }
+
+    // a block shared by clones or snapshots must count all of its owners
+    if (refs > 0 && bitmap_get(bbm, bnum) && blocks_refs(bnum) != refs) {
+      problem(repair, "block %d: reference count is %d, should be %d", bnum,
+              blocks_refs(bnum), refs);
+      if (repair) {
+        blocks_set_refs(bnum, refs);
+      }
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "nyj:")) != -1) {
+    switch (opt) {
+    case 'n': repair = 0; break;
+    case 'y': repair = 1; break;
+    case 'j': nthreads = atoi(optarg); break;
+    default:
+      fprintf(stderr, "usage: fsck.nufs [-n | -y] [-j threads] image\n");
+      return 8;
+    }
+  }
+  if (optind != argc - 1 || nthreads < 1) {
+    fprintf(stderr, "usage: fsck.nufs [-n | -y] [-j threads] image\n");
+    return 8;
+  }
+
+  const char *image = argv[optind];
+  if (blocks_open(image) != 0 || blocks_super()->inode_size != sizeof(inode_t)) {
+    fprintf(stderr, "fsck.nufs: %s: not a nufs image\n", image);
+    return 8;
+  }
+  sb = blocks_super();
+  printf("%s: %u blocks of %u bytes, %u inodes, %s\n", image, sb->block_count,
+         sb->block_size, sb->inode_count, sb->clean ? "clean" : "not clean");
+
+  owners = calloc(sb->block_count, sizeof(int));
+  exclusive = calloc(BLOCK_BITMAP_SIZE, 1);
+  links = calloc(sb->inode_count, sizeof(int));
+  reached = calloc(sb->inode_count, 1);
+  unreadable = calloc(sb->inode_count, 1);
+  frontier = calloc(sb->inode_count, sizeof(int));
+  next_frontier = calloc(sb->inode_count, sizeof(int));
+
+  if (!inode_in_use(0) || !S_ISDIR(get_inode(0)->mode)) {
+    fprintf(stderr, "fsck.nufs: %s: root directory is missing\n", image);
+    return 8;
+  }
+
+  parallel_for(sb->inode_count, scan_inodes);
+  scan_snapshots();
+  scan_dedup_index();
+  check_entries();
+  walk_tree(0);
+  reconnect_orphans();
+  parallel_for(sb->inode_count, reconcile_inodes);
+  parallel_for(sb->block_count, reconcile_blocks);
+
+  if (repair) {
+    blocks_recount();
+    if (atomic_load(&errors) == atomic_load(&fixed)) {
+      sb->clean = 1;
+    }
+  }
+  printf("%s: %u free blocks, %u free inodes, %d problems, %d fixed\n", image,
+         sb->free_blocks, sb->free_inodes, atomic_load(&errors), atomic_load(&fixed));
+  blocks_close();
+
+  if (atomic_load(&errors) == 0) {
+    return 0;
+  }
+  return atomic_load(&errors) == atomic_load(&fixed) ? 1 : 4;
+}
@@ -0,0 +1,113 @@
+// mkfs.nufs: create a new nufs disk image.
+//
+// usage: mkfs.nufs [-B block_size] [-b block_count | -s size] [-i inodes]
+//                  [-u stripe_unit] image[:image...]
+//
+// Several images separated by colons make one file system striped over
+// them; -u sets the stripe unit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../blocks.h"
+#include "../directory.h"
+#include "../inode.h"
+
+static void usage() {
+  fprintf(stderr,
+          "usage: mkfs.nufs [-B block_size] [-b block_count | -s size[K|M|G]]"
+          " [-i inodes]\n"
+          "                 [-u stripe_unit[K|M]] image[:image...]\n");
+  exit(2);
+}
+
+// Parse a byte count with an optional K/M/G suffix.
+static long long parse_size(const char *text) {
+  char *end;
+  long long value = strtoll(text, &end, 10);
+  switch (*end) {
+  case 'G': case 'g': value <<= 10; // fall through
+  case 'M': case 'm': value <<= 10; // fall through
+  case 'K': case 'k': value <<= 10; ++end; break;
+  }
+  return *end == 0 ? value : -1;
+}
+
+int main(int argc, char *argv[]) {
+  int block_size = NUFS_DEFAULT_BLOCK_SIZE;
+  long long block_count = NUFS_DEFAULT_BLOCK_COUNT;
+  long long size = -1;
+  long long inodes = -1;
+  long long unit = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "B:b:s:i:u:")) != -1) {
+    switch (opt) {
+    case 'B': block_size = (int) parse_size(optarg); break;
+    case 'b': block_count = atoll(optarg); break;
+    case 's': size = parse_size(optarg); break;
+    case 'i': inodes = atoll(optarg); break;
+    case 'u': unit = parse_size(optarg); break;
+    default: usage();
+    }
+  }
+  if (optind != argc - 1) {
+    usage();
+  }
+  const char *image = argv[optind];
+
+  if (size > 0) {
+    block_count = size / block_size;
+  }
+  if (inodes < 0) {
+    // one inode per block by default, like the original 256/256 layout
+    inodes = block_count;
+  }
+
+  if (block_count > (1LL << 30) || !blocks_geometry_ok(block_size, block_count)) {
+    fprintf(stderr, "mkfs.nufs: unsupported geometry: %lld blocks of %d bytes\n",
+            block_count, block_size);
+    return 1;
+  }
+
+  if (unit < 0 || unit % block_size != 0 || unit / block_size > block_count) {
+    fprintf(stderr, "mkfs.nufs: stripe unit must be a multiple of %d bytes\n",
+            block_size);
+    return 1;
+  }
+
+  if (inodes < 1 || inodes > (1LL << 30)) {
+    fprintf(stderr, "mkfs.nufs: unsupported inode count: %lld\n", inodes);
+    return 1;
+  }
+
+  if (blocks_create_striped(image, block_size, block_count, unit / block_size) == -1) {
+    perror(image);
+    return 1;
+  }
+  if (blocks_format(inodes, sizeof(inode_t)) == -1) {
+    fprintf(stderr, "mkfs.nufs: %lld inodes do not fit in %lld blocks\n",
+            inodes, block_count);
+    blocks_close();
+    char paths[strlen(image) + 1];
+    strcpy(paths, image);
+    for (char *path = strtok(paths, ":"); path != 0; path = strtok(0, ":")) {
+      unlink(path);
+    }
+    return 1;
+  }
+  directory_init();
+
+  superblock_t *sb = blocks_super();
+  printf("%s: %u blocks of %u bytes, %u inodes, data starts at block %u\n",
+         image, sb->block_count, sb->block_size, sb->inode_count, sb->data_block);
+  if (sb->stripe_members > 1) {
+    printf("%s: striped over %u files in units of %u blocks\n", image,
+           sb->stripe_members, sb->stripe_blocks);
+  }
+
+  blockslist_free();
+  return 0;
+}
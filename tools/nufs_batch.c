@@ -0,0 +1,135 @@
+// Client side of NUFS_IOC_BATCH; see nufs_batch.h.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "nufs_batch.h"
+
+struct nufs_batch {
+  int fd;          // the directory the operations work in
+  uint32_t used;   // bytes of req.data in use
+  nufs_ioc_batch_t req;
+};
+
+// Open a batch for names in the given directory of a nufs mount.
+nufs_batch_t *nufs_batch_open(const char *dir) {
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  nufs_batch_t *batch = calloc(1, sizeof(*batch));
+  if (batch == NULL) {
+    close(fd);
+    return NULL;
+  }
+  batch->fd = fd;
+  return batch;
+}
+
+void nufs_batch_close(nufs_batch_t *batch) {
+  close(batch->fd);
+  free(batch);
+}
+
+// Copy len bytes into the data area. Returns their offset, or -1 if they
+// don't fit.
+static int add_data(nufs_batch_t *batch, const void *buf, size_t len) {
+  if (len > NUFS_BATCH_DATA_SIZE - batch->used) {
+    return -1;
+  }
+  int off = batch->used;
+  memcpy(batch->req.data + off, buf, len);
+  batch->used += len;
+  return off;
+}
+
+// Queue an operation on name, with len bytes of data for a write.
+static nufs_batch_op_t *add_op(nufs_batch_t *batch, uint32_t opcode,
+                               const char *name, size_t len) {
+  size_t name_len = strlen(name) + 1;
+  if (name_len > NUFS_BATCH_DATA_SIZE) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  if (batch->req.count == NUFS_BATCH_MAX_OPS ||
+      name_len + len > NUFS_BATCH_DATA_SIZE - batch->used) {
+    errno = ENOBUFS;
+    return NULL;
+  }
+
+  nufs_batch_op_t *op = &batch->req.ops[batch->req.count++];
+  memset(op, 0, sizeof(*op));
+  op->opcode = opcode;
+  op->name_off = add_data(batch, name, name_len);
+  return op;
+}
+
+int nufs_batch_create(nufs_batch_t *batch, const char *name, mode_t mode) {
+  nufs_batch_op_t *op = add_op(batch, NUFS_BATCH_CREATE, name, 0);
+  if (op == NULL) {
+    return -1;
+  }
+  op->mode = mode;
+  return op - batch->req.ops;
+}
+
+int nufs_batch_stat(nufs_batch_t *batch, const char *name) {
+  nufs_batch_op_t *op = add_op(batch, NUFS_BATCH_STAT, name, 0);
+  return op == NULL ? -1 : op - batch->req.ops;
+}
+
+int nufs_batch_unlink(nufs_batch_t *batch, const char *name) {
+  nufs_batch_op_t *op = add_op(batch, NUFS_BATCH_UNLINK, name, 0);
+  return op == NULL ? -1 : op - batch->req.ops;
+}
+
+// Queue a write of len bytes at offset; the data is copied into the batch.
+int nufs_batch_write(nufs_batch_t *batch, const char *name, const void *buf,
+                     size_t len, off_t offset) {
+  if (len > NUFS_BATCH_DATA_SIZE) {
+    errno = EFBIG;
+    return -1;
+  }
+  nufs_batch_op_t *op = add_op(batch, NUFS_BATCH_WRITE, name, len);
+  if (op == NULL) {
+    return -1;
+  }
+  op->offset = offset;
+  op->data_len = len;
+  op->data_off = add_data(batch, buf, len);
+  return op - batch->req.ops;
+}
+
+// Number of operations queued.
+int nufs_batch_count(nufs_batch_t *batch) { return batch->req.count; }
+
+// Run the queued operations. Returns how many of them succeeded, or -1 if
+// the ioctl itself failed (errno ENOTTY: not a nufs mount).
+int nufs_batch_run(nufs_batch_t *batch) {
+  if (batch->req.count == 0) {
+    return 0;
+  }
+  if (ioctl(batch->fd, NUFS_IOC_BATCH, &batch->req) == -1) {
+    return -1;
+  }
+  return batch->req.done;
+}
+
+// The operation with the given index, with its results once run.
+const nufs_batch_op_t *nufs_batch_result(nufs_batch_t *batch, int index) {
+  if (index < 0 || index >= (int) batch->req.count) {
+    return NULL;
+  }
+  return &batch->req.ops[index];
+}
+
+// Empty the batch for the next set of operations.
+void nufs_batch_clear(nufs_batch_t *batch) {
+  batch->req.count = 0;
+  batch->used = 0;
+}
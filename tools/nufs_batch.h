@@ -0,0 +1,41 @@
+// Client side of NUFS_IOC_BATCH (libnufs.a).
+//
+// Queues operations on names in one directory of a mounted nufs file
+// system and runs them all with a single ioctl, instead of one FUSE round
+// trip and one path lookup each:
+//
+//   nufs_batch_t *batch = nufs_batch_open("mnt/incoming");
+//   int op = nufs_batch_create(batch, "a.txt", 0644);
+//   nufs_batch_write(batch, "a.txt", data, len, 0);
+//   if (nufs_batch_run(batch) != -1 && nufs_batch_result(batch, op)->result < 0)
+//     ... /* a.txt could not be created */
+//   nufs_batch_close(batch);
+//
+// The add functions return the index of the queued operation, or -1 with
+// errno set to ENOBUFS once the batch is full; run it, clear it and add
+// the operation again.
+
+#ifndef NUFS_BATCH_H
+#define NUFS_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../nufs_ioctl.h"
+
+typedef struct nufs_batch nufs_batch_t;
+
+nufs_batch_t *nufs_batch_open(const char *dir);
+void nufs_batch_close(nufs_batch_t *batch);
+int nufs_batch_create(nufs_batch_t *batch, const char *name, mode_t mode);
+int nufs_batch_stat(nufs_batch_t *batch, const char *name);
+int nufs_batch_unlink(nufs_batch_t *batch, const char *name);
+int nufs_batch_write(nufs_batch_t *batch, const char *name, const void *buf,
+                     size_t len, off_t offset);
+int nufs_batch_count(nufs_batch_t *batch);
+int nufs_batch_run(nufs_batch_t *batch);
+const nufs_batch_op_t *nufs_batch_result(nufs_batch_t *batch, int index);
+void nufs_batch_clear(nufs_batch_t *batch);
+
+#endif
@@ -0,0 +1,53 @@
+// nufs-reflink: copy a file on a mounted nufs file system by sharing its
+// data blocks instead of copying them (what `cp --reflink` would do).
+//
+// usage: nufs-reflink source dest
+//
+// Both files must be on the same nufs mount. dest is created or
+// truncated; its blocks are copied only when one of the files is written.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../nufs_ioctl.h"
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: nufs-reflink source dest\n");
+    return 2;
+  }
+
+  int src = open(argv[1], O_RDONLY);
+  if (src == -1) {
+    fprintf(stderr, "nufs-reflink: %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+  int32_t inum;
+  if (ioctl(src, NUFS_IOC_GET_INUM, &inum) == -1) {
+    fprintf(stderr, "nufs-reflink: %s: not on a nufs mount\n", argv[1]);
+    return 1;
+  }
+
+  struct stat st;
+  fstat(src, &st);
+  int dst = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+  if (dst == -1) {
+    fprintf(stderr, "nufs-reflink: %s: %s\n", argv[2], strerror(errno));
+    return 1;
+  }
+
+  nufs_ioc_clone_range_t req = {.src_inum = inum};
+  if (ioctl(dst, NUFS_IOC_CLONE_RANGE, &req) == -1) {
+    fprintf(stderr, "nufs-reflink: %s: %s\n", argv[2], strerror(errno));
+    return 1;
+  }
+
+  close(dst);
+  close(src);
+  return 0;
+}
@@ -0,0 +1,62 @@
+// nufs-snap: take, list and delete snapshots of a mounted nufs file system.
+//
+// usage: nufs-snap mountpoint list
+//        nufs-snap mountpoint create NAME
+//        nufs-snap mountpoint delete NAME
+//
+// A snapshot is mounted read-only with `nufs -o snapshot=NAME`.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "../nufs_ioctl.h"
+
+static void usage() {
+  fprintf(stderr, "usage: nufs-snap mountpoint list|create NAME|delete NAME\n");
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    usage();
+    return 2;
+  }
+
+  int fd = open(argv[1], O_RDONLY | O_DIRECTORY);
+  if (fd == -1) {
+    fprintf(stderr, "nufs-snap: %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+
+  int rv;
+  if (strcmp(argv[2], "list") == 0 && argc == 3) {
+    nufs_ioc_snapshot_list_t list;
+    rv = ioctl(fd, NUFS_IOC_SNAP_LIST, &list);
+    for (int ii = 0; rv != -1 && ii < (int) list.count; ++ii) {
+      printf("%s\n", list.names[ii]);
+    }
+  } else if ((strcmp(argv[2], "create") == 0 || strcmp(argv[2], "delete") == 0) &&
+             argc == 4) {
+    nufs_ioc_snapshot_t req = {{0}};
+    if (strlen(argv[3]) >= sizeof(req.name)) {
+      fprintf(stderr, "nufs-snap: %s: %s\n", argv[3], strerror(ENAMETOOLONG));
+      return 1;
+    }
+    strcpy(req.name, argv[3]);
+    rv = ioctl(fd, argv[2][0] == 'c' ? NUFS_IOC_SNAP_CREATE : NUFS_IOC_SNAP_DELETE,
+               &req);
+  } else {
+    usage();
+    return 2;
+  }
+
+  if (rv == -1) {
+    fprintf(stderr, "nufs-snap: %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,58 @@
+// nufs-stats: print the counters of a mounted nufs file system.
+//
+// usage: nufs-stats mountpoint
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "../nufs_ioctl.h"
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: nufs-stats mountpoint\n");
+    return 2;
+  }
+
+  int fd = open(argv[1], O_RDONLY | O_DIRECTORY);
+  if (fd == -1) {
+    fprintf(stderr, "nufs-stats: %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+
+  nufs_ioc_dedup_stats_t dedup;
+  if (ioctl(fd, NUFS_IOC_DEDUP_STATS, &dedup) == -1) {
+    fprintf(stderr, "nufs-stats: %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+  double rate = dedup.hashed ? 100.0 * dedup.shared / dedup.hashed : 0;
+  printf("dedup: %llu blocks hashed, %llu shared (%.1f%%, %llu bytes saved), "
+         "%llu collisions, %llu indexed\n",
+         (unsigned long long) dedup.hashed, (unsigned long long) dedup.shared, rate,
+         (unsigned long long) (dedup.shared * dedup.block_size),
+         (unsigned long long) dedup.collisions, (unsigned long long) dedup.indexed);
+
+  nufs_ioc_defrag_stats_t defrag;
+  if (ioctl(fd, NUFS_IOC_DEFRAG_STATS, &defrag) == -1) {
+    fprintf(stderr, "nufs-stats: %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+  if (defrag.rate > 0) {
+    printf("defrag: %u KB/s, %llu blocks moved, %llu files joined, %llu packed, "
+           "%llu passes\n", defrag.rate, (unsigned long long) defrag.moved,
+           (unsigned long long) defrag.files_joined,
+           (unsigned long long) defrag.files_packed, (unsigned long long) defrag.passes);
+  } else {
+    printf("defrag: off\n");
+  }
+  printf("fragmentation: %u of %u files fragmented (score %u%%), free space in %u runs, "
+         "longest %u blocks (score %u%%)\n",
+         defrag.fragmented, defrag.files, defrag.file_score, defrag.free_runs,
+         defrag.largest_free, defrag.free_score);
+
+  close(fd);
+  return 0;
+}